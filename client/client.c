@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // sendmmsg()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,11 +10,82 @@
 #include <stdbool.h>
 #include <syslog.h>
 #include <glob.h> // Required for wildcard matching
+#include <sys/statvfs.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include "pimon_shm.h"
 
 #define SERVER_PORT 5000
 #define CLIENT_ID_LEN 32
 #define RESOLVE_INTERVAL_SEC 60
+#define RESOLVE_RETRY_SEC 5     // until the first lookup succeeds
+#define MAX_SERVERS 8
+#define SERVER_HOST_LEN 256
+#define MAX_PACKET 1400     // keep datagrams below a typical Ethernet MTU
+#define MAX_DATAGRAMS 4     // per sample, see tlv_append()
+#define MAX_CPUS 64
+#define MAX_CPUFREQ_POLICIES 16
+#define MAX_FREQ_STATES 32      // time_in_state rows per policy
+#define MAX_COOLING 8
+#define COOLING_TYPE_LEN 20
+#define MAX_SENSORS 32
+#define SENSOR_LABEL_LEN 24
+#define MAX_IFACES 8
+#define IFACE_NAME_LEN 16
+#define MAX_DISKS 8
+#define DISK_NAME_LEN 16
+#define MAX_DISK_REJECTS 64     // diskstats names remembered as not whole disks
+#define MAX_MOUNTS 8
+#define MOUNT_PATH_LEN 32
+#define MAX_TOP_N 10
+#define PROC_TABLE_SIZE 2048    // open-addressed pid table, power of two
+#define PROC_FD_BUDGET 512      // cached /proc/<pid>/stat fds, rest are reopened
+#define PROC_SCAN_BUDGET 64     // stat reads per tick on top of the current top set
+#define PROC_DISCOVER_TICKS 5   // readdir(/proc) for new pids every N ticks
+#define COMM_LEN 16
+#define MAX_CGROUPS 16
+#define CGROUP_NAME_LEN 32
+#define CGROUP_DISCOVER_TICKS 30
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define SPOOL_DEFAULT_KB 4096   // roughly two hours of samples at 1 Hz
+#define SPOOL_MIN_KB 64
+#define SPOOL_DATA_OFF 4096     // SpoolHeader page, records follow
+#define SPOOL_REPLAY_BATCH 32   // spooled samples resent per tick
+#define SPOOL_RETRY_TICKS 3     // resend from the ack point when it stalls this long
+#define ACK_LIVE_SEC 5          // replay only while acks arrive
+#define SELF_REPORT_SEC 10      // TLV_SELF covers this many seconds
+#define SAMPLE_INTERVAL_NS 1000000000ULL    // default sample and send interval
+#define MAX_SAMPLE_HZ 50
+#define WINDOW_EXACT 64         // samples per window kept for an exact p95
+#define BURST_DEFAULT_HZ 20
+#define BURST_HOLD_SEC 2        // stay at the burst rate after the last rule clears
+#define BURST_MAX_SEC 60        // longest burst before falling back to the base rate
+#define MAX_BURST_RULES 8
+#define BENCH_DEFAULT_MS 200    // per collector in --bench mode
 static const char *SERVER_ENV = "PIMON_SERVER_IP";
+static const char *MOUNTS_ENV = "PIMON_MOUNTS";     // colon separated, default "/"
+static const char *TOP_N_ENV = "PIMON_TOP_N";       // 0 or unset disables process reporting
+static const char *CGROUPS_ENV = "PIMON_CGROUPS";   // colon separated globs below CGROUP_ROOT
+static const char *MCAST_TTL_ENV = "PIMON_MCAST_TTL"; // hop limit for multicast destinations
+static const char *SPOOL_ENV = "PIMON_SPOOL";       // spool file, enables acknowledged mode
+static const char *SPOOL_KB_ENV = "PIMON_SPOOL_KB";
+static const char *SHM_ENV = "PIMON_SHM";           // shm object name, "off" disables
+static const char *ROOT_ENV = "PIMON_ROOT";         // prefix for /sys and /proc, see fixtures/
+static const char *BURST_ENV = "PIMON_BURST";       // threshold rules, "off" disables
+static const char *BURST_HZ_ENV = "PIMON_BURST_HZ";
+static const char *SAMPLE_HZ_ENV = "PIMON_SAMPLE_HZ";   // internal rate of the header metrics
+static const char *SEND_SEC_ENV = "PIMON_SEND_SEC";     // one packet per interval
 
 // #define CLIENT_DIAGNOSTICS
 
@@ -33,19 +105,346 @@ typedef struct {
     uint64_t timestamp;
 } TelemetryPacket;
 
+// Optional extension records follow the fixed TelemetryPacket header in the
+// same datagram. Each record is a TelemetryTlv header followed by len bytes of
+// value. Receivers skip types they do not know, so old servers keep working.
+typedef struct {
+    uint16_t type;
+    uint16_t len;
+} TelemetryTlv;
+
+enum {
+    TLV_CONTINUATION = 0,   // first record of the extra datagrams of one sample
+    TLV_CPU_CORES = 1,      // array of TlvCpuCore, one per online cpuN
+    TLV_SENSOR    = 2,      // one TlvSensor per hwmon channel, label not terminated
+    TLV_MEMORY    = 3,      // TlvMemory
+    TLV_PRESSURE  = 4,      // TlvPressure
+    TLV_NET_IFACE = 5,      // one TlvNetIface per interface, name not terminated
+    TLV_DISK      = 6,      // one TlvDisk per block device, name not terminated
+    TLV_FS        = 7,      // one TlvFs per configured mount point, path not terminated
+    TLV_PROC      = 8,      // one TlvProc per top process, comm not terminated
+    TLV_CGROUP    = 9,      // one TlvCgroup per matched cgroup, name not terminated
+    TLV_SEQUENCE  = 10,     // TlvSequence, first record of datagram 0 in acknowledged mode
+    TLV_SELF      = 11,     // TlvSelf, every SELF_REPORT_SEC seconds
+    TLV_WINDOW    = 12,     // one TlvWindow per header metric sampled since the last send
+    TLV_FREQ      = 13,     // one TlvFreq per cpufreq policy with stats, states trimmed to state_count
+    TLV_COOLING   = 14,     // one TlvCooling per thermal cooling device, type not terminated
+};
+
+typedef struct {
+    uint16_t busy;          // 0.01 % units
+    uint16_t mhz;
+} TlvCpuCore;
+
+enum {
+    SENSOR_TEMP  = 1,       // millidegree Celsius
+    SENSOR_FAN   = 2,       // RPM
+    SENSOR_IN    = 3,       // millivolt
+    SENSOR_POWER = 4,       // microwatt
+};
+
+// Wire layout: value, kind, then tlv.len - offsetof(label) label bytes
+typedef struct {
+    int32_t value;
+    uint8_t kind;
+    char    label[SENSOR_LABEL_LEN];
+} TlvSensor;
+
+typedef struct {
+    uint32_t mem_total_kb;
+    uint32_t mem_avail_kb;
+    uint32_t swap_total_kb;
+    uint32_t swap_used_kb;
+    uint32_t dirty_kb;
+    uint32_t writeback_kb;
+} TlvMemory;
+
+enum { PSI_CPU = 0, PSI_MEMORY = 1, PSI_IO = 2, PSI_COUNT = 3 };
+
+// Share of the last interval with stalled tasks, 0.01 % units
+typedef struct {
+    uint16_t some[PSI_COUNT];
+    uint16_t full[PSI_COUNT];
+} TlvPressure;
+
+// Per-second rates over the last interval
+typedef struct {
+    float rx_bytes;
+    float tx_bytes;
+    float rx_packets;
+    float tx_packets;
+    float rx_errors;
+    float tx_errors;
+    float rx_drops;
+    float tx_drops;
+    char  name[IFACE_NAME_LEN];
+} TlvNetIface;
+
+enum {
+    NET_RX_BYTES, NET_RX_PACKETS, NET_RX_ERRS, NET_RX_DROP,
+    NET_TX_BYTES, NET_TX_PACKETS, NET_TX_ERRS, NET_TX_DROP,
+    NET_COUNTERS
+};
+
+typedef struct {
+    char name[IFACE_NAME_LEN];
+    bool seen;              // present in the latest /proc/net/dev read
+    bool primed;            // prev[] holds a real sample
+    uint64_t prev[NET_COUNTERS];
+    TlvNetIface rate;
+} NetIface;
+
+enum {
+    DISK_RD_IOS, DISK_RD_SECTORS, DISK_RD_MS,
+    DISK_WR_IOS, DISK_WR_SECTORS, DISK_WR_MS,
+    DISK_IO_TICKS,
+    DISK_COUNTERS
+};
+
+// Per-second rates over the last interval plus instantaneous queue depth
+typedef struct {
+    float    rd_iops;
+    float    wr_iops;
+    float    rd_bytes;
+    float    wr_bytes;
+    float    await_ms;      // average service time of completed requests
+    uint16_t in_flight;
+    uint8_t  util;          // % of the interval the device was busy
+    uint8_t  life_used;     // eMMC wear estimate in %, 0 when unknown
+    char     name[DISK_NAME_LEN];
+} TlvDisk;
+
+typedef struct {
+    char name[DISK_NAME_LEN];
+    bool seen;
+    bool primed;
+    uint64_t prev[DISK_COUNTERS];
+    TlvDisk rate;
+} BlockDisk;
+
+typedef struct {
+    uint32_t total_mb;
+    uint32_t free_mb;       // available to unprivileged users
+    char     path[MOUNT_PATH_LEN];
+} TlvFs;
+
+enum {
+    PROC_TOP_CPU = 0x01,
+    PROC_TOP_RSS = 0x02,
+};
+
+typedef struct {
+    uint32_t pid;
+    uint32_t rss_kb;
+    uint16_t cpu;           // 0.1 % units of one core
+    uint8_t  flags;         // PROC_TOP_*
+    char     comm[COMM_LEN];
+} TlvProc;
+
+typedef struct {
+    int32_t  pid;           // 0 = empty slot, -1 = deleted
+    int      fd;            // cached /proc/<pid>/stat or -1
+    uint32_t gen;           // discovery pass the pid was last listed in
+    uint32_t tick;          // tick the entry was last refreshed in
+    uint64_t prev_ticks;
+    uint64_t sample_ns;     // when prev_ticks was read
+    float    cpu_pct;       // over the entry's own last refresh interval
+    uint32_t rss_kb;
+    char     comm[COMM_LEN];
+} ProcEntry;
+
+typedef struct {
+    float    cpu_pct;       // of one core
+    uint32_t mem_kb;        // memory.current
+    float    rd_bytes;      // per second, summed over devices
+    float    wr_bytes;
+    float    rd_ios;
+    float    wr_ios;
+    char     name[CGROUP_NAME_LEN];
+} TlvCgroup;
+
+enum { CG_RBYTES, CG_WBYTES, CG_RIOS, CG_WIOS, CG_IO_COUNTERS };
+
+enum {
+    SEQ_REPLAY = 0x01,      // resent from the spool, not the current sample
+};
+
+// Acknowledged mode. seq counts samples from 1 for the life of the spool
+// file, epoch changes when the spool is recreated and acked echoes the
+// cumulative ack the client holds so a restarted collector can resync.
+typedef struct {
+    uint64_t seq;
+    uint64_t acked;
+    uint32_t epoch;
+    uint8_t  flags;         // SEQ_*
+} TlvSequence;
+
+// The client's own cost over the last SELF_REPORT_SEC seconds
+typedef struct {
+    float    cpu_pct;       // user + system time, % of one core
+    uint32_t rss_kb;
+    uint32_t max_jitter_us; // worst deviation of a sample interval from its schedule
+    uint32_t max_work_us;   // longest collect-and-send pass
+} TlvSelf;
+
+enum { WIN_LOAD, WIN_TEMP, WIN_MHZ, WIN_FAN, WIN_METRICS };
+
+// Distribution of one header metric over the samples taken since the last
+// packet. The header itself then carries the mean.
+typedef struct {
+    float    min;
+    float    max;
+    float    mean;
+    float    p95;           // P-square estimate
+    uint16_t count;
+    uint8_t  metric;        // WIN_*
+} TlvWindow;
+
+typedef struct {
+    uint32_t khz;
+    uint16_t share;         // 0.01 % of the interval
+} TlvFreqState;
+
+// Frequency residency of one cpufreq policy over the last interval, from the
+// stats/time_in_state and stats/total_trans deltas. Only frequencies the
+// policy spent time at are listed.
+// Wire layout: fields, then state_count TlvFreqState
+typedef struct {
+    float   trans_per_sec;
+    uint8_t policy;         // N of policyN
+    uint8_t state_count;
+    TlvFreqState states[MAX_FREQ_STATES];
+} TlvFreq;
+
+// Wire layout: states, then tlv.len - offsetof(type) type bytes
+typedef struct {
+    uint16_t cur_state;     // 0 = not throttling / fan off
+    uint16_t max_state;
+    char     type[COOLING_TYPE_LEN];    // "cpufreq-cpu0", "pwm-fan", ...
+} TlvCooling;
+
+#define ACK_MAGIC 0x4b414d50    // "PMAK"
+
+// Collector -> client: every sample up to and including acked has arrived
+typedef struct {
+    uint32_t magic;
+    uint32_t epoch;
+    char     client_id[CLIENT_ID_LEN];
+    uint64_t acked;
+} AckPacket;
+
+// Spool file: one SpoolHeader page, then a byte ring of SpoolRecords. head
+// and tail are logical offsets that only grow; the record for offset pos is
+// at SPOOL_DATA_OFF + pos % data_size. A record never wraps: the gap at the
+// end of the ring is a count == 0 record, or skipped implicitly when it is
+// too small to hold a SpoolRecord.
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t epoch;
+    uint64_t data_size;
+    uint64_t head;          // next write
+    uint64_t tail;          // oldest retained record
+    uint64_t next_seq;
+    uint64_t acked;         // cumulative ack from the collector
+} SpoolHeader;
+
+// Followed by the datagrams of one sample back to back
+typedef struct {
+    uint32_t size;          // including this header, multiple of 8
+    uint16_t count;         // datagrams, 0 = padding to the end of the ring
+    uint16_t len[MAX_DATAGRAMS];
+    uint64_t seq;
+} SpoolRecord;
+
+typedef struct {
+    char path[PATH_MAX];    // relative to CGROUP_ROOT
+    ino_t ino;              // of the directory; a restarted service gets a new one
+    int cpu_fd;
+    int mem_fd;
+    int io_fd;
+    bool seen;
+    bool primed;
+    uint64_t prev_usage_usec;
+    uint64_t prev_io[CG_IO_COUNTERS];
+    uint64_t sample_ns;
+    TlvCgroup stats;
+} CgroupEntry;
+
+// The datagrams that carry one sample
+typedef struct {
+    unsigned char buf[MAX_DATAGRAMS][MAX_PACKET];
+    size_t len[MAX_DATAGRAMS];
+    int count;
+} TxBatch;
+
+typedef struct {
+    uint64_t total;
+    uint64_t idle;
+} CpuTimes;
+
+typedef struct {
+    int fd;                 // cached scaling_cur_freq
+    uint64_t cpus;          // bitmask of affected_cpus
+    int stats_fd;           // cached stats/time_in_state, -1 without CONFIG_CPU_FREQ_STAT
+    int trans_fd;           // cached stats/total_trans
+    int state_count;
+    uint32_t state_khz[MAX_FREQ_STATES];
+    uint64_t prev_time[MAX_FREQ_STATES];    // 10 ms units
+    uint64_t prev_trans;
+    bool primed;
+    TlvFreq rate;
+} CpuFreqPolicy;
+
+typedef struct {
+    int fd;                 // cached cur_state
+    TlvCooling stats;
+} CoolingDevice;
+
+typedef struct {
+    int fd;                 // cached *_input
+    uint8_t kind;
+    bool valid;             // last read succeeded
+    int32_t value;
+    char label[SENSOR_LABEL_LEN];
+} HwmonSensor;
+
 #define FAN_GLOB "/sys/devices/platform/cooling_fan/hwmon/*/fan1_input"
 char fan_file[PATH_MAX];
 bool argon40_fan=false;
 uint64_t argon40_period=0;
 
+// A destination whose address is kept fresh by its own resolver thread.
+// The sampling loop only copies addr under mtx and never waits on DNS.
+typedef struct {
+    char host[SERVER_HOST_LEN];
+    int port;
+    pthread_t thread;
+    pthread_mutex_t mtx;
+    struct sockaddr_storage addr;   // IPv4 or IPv6, unicast or multicast group
+    socklen_t addr_len;
+    bool valid;             // addr holds a resolved address
+} ServerTarget;
+
 /* ---------- Helpers ---------- */
 
+static void format_addr(const struct sockaddr_storage *ss, char *buf, size_t len)
+{
+    buf[0] = '\0';
+    if (ss->ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)ss)->sin6_addr, buf, len);
+    } else if (ss->ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)ss)->sin_addr, buf, len);
+    }
+}
+
+// Either family; getaddrinfo() already orders results by RFC 6724 preference
 static int resolve_server(const char *server_host, int port,
-                          struct sockaddr_in *out,
+                          struct sockaddr_storage *out, socklen_t *out_len,
                           char *out_ip, size_t out_ip_len) {
     struct addrinfo hints = {0};
     struct addrinfo *res = NULL;
-    hints.ai_family = AF_INET;
+    hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_DGRAM;
 
     char port_str[16];
@@ -54,18 +453,144 @@ static int resolve_server(const char *server_host, int port,
         return -1;
     }
 
-    struct sockaddr_in *addr = (struct sockaddr_in *)res->ai_addr;
-    *out = *addr;
+    memset(out, 0, sizeof(*out));
+    memcpy(out, res->ai_addr, res->ai_addrlen);
+    *out_len = res->ai_addrlen;
 
     if (out_ip && out_ip_len > 0) {
-        out_ip[0] = '\0';
-        inet_ntop(AF_INET, &out->sin_addr, out_ip, out_ip_len);
+        format_addr(out, out_ip, out_ip_len);
     }
 
     freeaddrinfo(res);
     return 0;
 }
 
+static bool target_get(ServerTarget *t, struct sockaddr_storage *out, socklen_t *out_len)
+{
+    bool valid;
+    pthread_mutex_lock(&t->mtx);
+    valid = t->valid;
+    *out = t->addr;
+    *out_len = t->addr_len;
+    pthread_mutex_unlock(&t->mtx);
+    return valid;
+}
+
+// Resolve immediately, then every RESOLVE_INTERVAL_SEC (RESOLVE_RETRY_SEC
+// while nothing has resolved yet). A failed lookup keeps the stale address.
+static void *resolver_thread(void *arg)
+{
+    ServerTarget *t = (ServerTarget *)arg;
+
+    while (1) {
+        struct sockaddr_storage new_addr;
+        socklen_t new_len = 0;
+        char new_ip[INET6_ADDRSTRLEN] = {0};
+        char old_ip[INET6_ADDRSTRLEN] = {0};
+        bool ok;
+        bool had_addr;
+        bool changed = false;
+
+        // getaddrinfo() may block for seconds; the lock is not held meanwhile
+        ok = resolve_server(t->host, t->port, &new_addr, &new_len,
+                            new_ip, sizeof(new_ip)) == 0;
+
+        pthread_mutex_lock(&t->mtx);
+        had_addr = t->valid;
+        if (ok) {
+            changed = had_addr &&
+                      (new_len != t->addr_len || memcmp(&new_addr, &t->addr, new_len) != 0);
+            if (changed) format_addr(&t->addr, old_ip, sizeof(old_ip));
+            t->addr = new_addr;
+            t->addr_len = new_len;
+            t->valid = true;
+        }
+        pthread_mutex_unlock(&t->mtx);
+
+        if (new_ip[0] == '\0') snprintf(new_ip, sizeof(new_ip), "unknown");
+        if (!ok) {
+            syslog(LOG_WARNING, "Server lookup failed: %s%s", t->host,
+                   had_addr ? " (keeping previous address)" : "");
+        } else if (!had_addr) {
+            syslog(LOG_INFO, "Server %s resolved to %s", t->host, new_ip);
+        } else if (changed) {
+            syslog(LOG_INFO, "Server IP changed: %s -> %s",
+                   old_ip[0] ? old_ip : "unknown", new_ip);
+        }
+
+        sleep((ok || had_addr) ? RESOLVE_INTERVAL_SEC : RESOLVE_RETRY_SEC);
+    }
+    return NULL;
+}
+
+// Split one entry into a target: "host", "host:port", "1.2.3.4:port",
+// "[2001:db8::1]:port" or a bare IPv6 literal. Entries are separated by
+// commas or whitespace; see parse_targets().
+static int parse_target(const char *spec, size_t len, ServerTarget *t)
+{
+    const char *host = spec;
+    const char *colon = memchr(spec, ':', len);
+    size_t host_len = colon ? (size_t)(colon - spec) : len;
+
+    if (len > 0 && spec[0] == '[') {
+        const char *close = memchr(spec, ']', len);
+        if (!close) return -1;
+        host = spec + 1;
+        host_len = (size_t)(close - host);
+        colon = (close + 1 < spec + len && close[1] == ':') ? close + 1 : NULL;
+        if (!colon && close + 1 != spec + len) return -1;
+    } else if (colon && memchr(colon + 1, ':', len - host_len - 1)) {
+        // Several colons without brackets: an IPv6 literal, default port
+        colon = NULL;
+        host_len = len;
+    }
+
+    if (host_len == 0 || host_len >= sizeof(t->host)) return -1;
+    memcpy(t->host, host, host_len);
+    t->host[host_len] = '\0';
+    t->port = SERVER_PORT;
+    if (colon) {
+        char port_str[8];
+        size_t plen = (size_t)(spec + len - colon - 1);
+        if (plen == 0 || plen >= sizeof(port_str)) return -1;
+        memcpy(port_str, colon + 1, plen);
+        port_str[plen] = '\0';
+        t->port = atoi(port_str);
+        if (t->port <= 0 || t->port > 65535) return -1;
+    }
+    return 0;
+}
+
+static int parse_targets(const char *list, ServerTarget *targets, int *count)
+{
+    const char *p = list;
+
+    while (*p) {
+        size_t n;
+        p += strspn(p, ", \t");
+        n = strcspn(p, ", \t");
+        if (n == 0) break;
+        if (*count >= MAX_SERVERS) {
+            syslog(LOG_WARNING, "Too many servers, ignoring %.*s", (int)n, p);
+        } else if (parse_target(p, n, &targets[*count]) != 0) {
+            syslog(LOG_WARNING, "Bad server entry: %.*s", (int)n, p);
+        } else {
+            (*count)++;
+        }
+        p += n;
+    }
+    return *count;
+}
+
+static int start_resolver(ServerTarget *t)
+{
+    pthread_mutex_init(&t->mtx, NULL);
+    t->valid = false;
+    if (pthread_create(&t->thread, NULL, resolver_thread, t) != 0) return -1;
+    pthread_detach(t->thread);
+    return 0;
+}
+
 void print_packet(const TelemetryPacket *p) {
     DIAG_PRINT("---- Telemetry Packet ----\n");
     DIAG_PRINT(" Client ID : %s\n", p->client_id);
@@ -78,8 +603,38 @@ void print_packet(const TelemetryPacket *p) {
     DIAG_PRINT("--------------------------\n\n");
 }
 
+// PIMON_ROOT relocates every /sys and /proc path the collectors read, so
+// they can run against a fixture tree. Empty on a real system. The agent's
+// own /proc/self files are never relocated.
+static char fs_root[PATH_MAX / 2];
+
+static void init_root(void)
+{
+    const char *env = getenv(ROOT_ENV);
+    size_t n;
+
+    if (!env || !env[0]) return;
+    snprintf(fs_root, sizeof(fs_root), "%s", env);
+    n = strlen(fs_root);
+    while (n > 0 && fs_root[n - 1] == '/') fs_root[--n] = '\0';
+}
+
+static const char *rooted(const char *abs, char *buf, size_t len)
+{
+    if (!fs_root[0]) return abs;
+    snprintf(buf, len, "%s%s", fs_root, abs);
+    return buf;
+}
+
+static int open_rooted(const char *abs, int flags)
+{
+    char path[PATH_MAX];
+    return open(rooted(abs, path, sizeof(path)), flags);
+}
+
 float read_cpu_temp() {
-    FILE *f = fopen("/sys/class/thermal/thermal_zone0/temp", "r");
+    char path[PATH_MAX];
+    FILE *f = fopen(rooted("/sys/class/thermal/thermal_zone0/temp", path, sizeof(path)), "r");
     if (!f) return -1;
     int temp;
     fscanf(f, "%d", &temp);
@@ -87,163 +642,2850 @@ float read_cpu_temp() {
     return temp / 1000.0f;
 }
 
-float read_cpu_mhz() {
-    FILE *f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "r");
-    if (!f) return -1;
-    int khz;
-    fscanf(f, "%d", &khz);
-    fclose(f);
-    return khz / 1000.0f;
+// Read a small procfs/sysfs file through a cached fd. pread() at offset 0
+// makes the kernel regenerate the content, so there is no open/close per tick.
+static ssize_t read_cached(int fd, char *buf, size_t len)
+{
+    ssize_t n;
+    if (fd < 0 || len == 0) return -1;
+    n = pread(fd, buf, len - 1, 0);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    return n;
 }
 
-float read_cpu_load() {
-    static long prev_idle = 0, prev_total = 0;
-    FILE *f = fopen("/proc/stat", "r");
-    if (!f) return -1;
+static const char *parse_u64(const char *p, uint64_t *out)
+{
+    uint64_t v = 0;
+    while (*p == ' ' || *p == '\t') p++;
+    while (*p >= '0' && *p <= '9') {
+        v = v * 10 + (uint64_t)(*p - '0');
+        p++;
+    }
+    *out = v;
+    return p;
+}
 
-    long user, nice, system, idle, iowait, irq, softirq;
-    fscanf(f, "cpu %ld %ld %ld %ld %ld %ld %ld",
-           &user, &nice, &system, &idle, &iowait, &irq, &softirq);
-    fclose(f);
+static CpuFreqPolicy cpufreq_policies[MAX_CPUFREQ_POLICIES];
+static int cpufreq_policy_count = 0;
+static float core_mhz[MAX_CPUS];
+
+// Parse a cpulist such as "0-3" or "0 1 2 3" into a bitmask
+static uint64_t parse_cpu_list(const char *p)
+{
+    uint64_t mask = 0;
+    while (*p) {
+        uint64_t lo, hi;
+        if (*p < '0' || *p > '9') {
+            p++;
+            continue;
+        }
+        p = parse_u64(p, &lo);
+        hi = lo;
+        if (*p == '-') p = parse_u64(p + 1, &hi);
+        for (; lo <= hi && lo < MAX_CPUS; lo++) mask |= 1ULL << lo;
+    }
+    return mask;
+}
+
+// Enumerate cpufreq policies once at startup. Falls back to cpu0 only on
+// kernels without the policyN directories.
+void init_cpufreq(void)
+{
+    glob_t globbuf;
+    char pattern[PATH_MAX];
+    size_t i;
+
+    if (glob(rooted("/sys/devices/system/cpu/cpufreq/policy[0-9]*", pattern, sizeof(pattern)),
+             0, NULL, &globbuf) == 0) {
+        for (i = 0; i < globbuf.gl_pathc && cpufreq_policy_count < MAX_CPUFREQ_POLICIES; i++) {
+            char path[PATH_MAX];
+            char buf[256];
+            int fd;
+            CpuFreqPolicy *pol = &cpufreq_policies[cpufreq_policy_count];
+
+            snprintf(path, sizeof(path), "%s/affected_cpus", globbuf.gl_pathv[i]);
+            fd = open(path, O_RDONLY);
+            if (fd < 0) continue;
+            if (read_cached(fd, buf, sizeof(buf)) <= 0) {
+                close(fd);
+                continue;
+            }
+            close(fd);
+
+            snprintf(path, sizeof(path), "%s/scaling_cur_freq", globbuf.gl_pathv[i]);
+            pol->fd = open(path, O_RDONLY);
+            if (pol->fd < 0) continue;
+            pol->cpus = parse_cpu_list(buf);
+            pol->rate.policy = (uint8_t)atoi(strrchr(globbuf.gl_pathv[i], '/') + strlen("/policy"));
+            snprintf(path, sizeof(path), "%s/stats/time_in_state", globbuf.gl_pathv[i]);
+            pol->stats_fd = open(path, O_RDONLY);
+            snprintf(path, sizeof(path), "%s/stats/total_trans", globbuf.gl_pathv[i]);
+            pol->trans_fd = open(path, O_RDONLY);
+            cpufreq_policy_count++;
+        }
+    }
+    globfree(&globbuf);
+
+    if (cpufreq_policy_count == 0) {
+        int fd = open_rooted("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", O_RDONLY);
+        if (fd >= 0) {
+            cpufreq_policies[0].fd = fd;
+            cpufreq_policies[0].cpus = 1;
+            cpufreq_policies[0].stats_fd = -1;
+            cpufreq_policies[0].trans_fd = -1;
+            cpufreq_policy_count = 1;
+        }
+    }
+}
+
+// Sample every policy, fill core_mhz[] and return the frequency of cpu0
+float read_cpu_mhz() {
+    float cpu0_mhz = -1;
+    int i;
+
+    for (i = 0; i < cpufreq_policy_count; i++) {
+        char buf[32];
+        uint64_t khz;
+        float mhz;
+        int cpu;
+
+        if (read_cached(cpufreq_policies[i].fd, buf, sizeof(buf)) <= 0) continue;
+        parse_u64(buf, &khz);
+        mhz = khz / 1000.0f;
+        for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (cpufreq_policies[i].cpus & (1ULL << cpu)) core_mhz[cpu] = mhz;
+        }
+        if (cpufreq_policies[i].cpus & 1) cpu0_mhz = mhz;
+    }
+    return cpu0_mhz;
+}
+
+static int stat_fd = -1;
+static CpuTimes cpu_prev[MAX_CPUS + 1];     // [0] is the aggregate line
+static float core_busy[MAX_CPUS];
+static CpuTimes core_now[MAX_CPUS];         // latest per-core counters
+static CpuTimes core_sent[MAX_CPUS];        // per-core counters at the last send
+static int core_count = 0;
 
-    long total = user + nice + system + idle + iowait + irq + softirq;
-    long totald = total - prev_total;
-    long idled  = idle  - prev_idle;
+static float cpu_busy_pct(CpuTimes *prev, uint64_t total, uint64_t idle)
+{
+    uint64_t totald = total - prev->total;
+    uint64_t idled  = idle  - prev->idle;
 
-    prev_total = total;
-    prev_idle  = idle;
+    prev->total = total;
+    prev->idle  = idle;
 
     if (totald == 0) return 0;
     return (1.0f - (float)idled / totald) * 100.0f;
 }
 
-// Get the fan file name
-// If this is a Pi 5 with pwm_fan module running we will be reading the fan speed from the sysfs
-// If this is not a Pi 5, look for the pwm files updated by the pwm_fan_control2 service
-// If found, we can assume it is an Argon40 mini fan. MAx speed is 8400 rpm but that is not stored
-// We can extimate the fan speed by:
-//     ( /sys/class/pwm/pwmchip0/pwm0/duty_cycle divided by /sys/class/pwm/pwmchip0/pwm0/period ) * 8400
-//
-void get_fan_file(void)
-{
-    glob_t globbuf;
-    int ret = glob(FAN_GLOB, 0, NULL, &globbuf);
+// One pass over /proc/stat: the aggregate "cpu" line gives the return value,
+// the "cpuN" lines fill core_busy[]. Parsing stops at the first non-cpu line.
+float read_cpu_load() {
+    char buf[8192];
+    const char *p = buf;
+    float load = -1;
 
-    if (ret != 0 || globbuf.gl_pathc == 0) {
-        // see if ther is a pwm0 setup
-        FILE *f;
-        f = fopen("/sys/class/pwm/pwmchip0/pwm0/period", "r");
-        if(f) {
-            argon40_fan = true;
-            fscanf(f, "%lu", &argon40_period);
-            fclose(f);
-            strcpy(fan_file, "/sys/class/pwm/pwmchip0/pwm0/duty_cycle");
-            fan_file[sizeof("/sys/class/pwm/pwmchip0/pwm0/duty_cycle")] = '\0';
+    if (stat_fd < 0) stat_fd = open_rooted("/proc/stat", O_RDONLY);
+    if (read_cached(stat_fd, buf, sizeof(buf)) <= 0) return -1;
+
+    core_count = 0;
+    while (p[0] == 'c' && p[1] == 'p' && p[2] == 'u') {
+        uint64_t v[7];
+        uint64_t cpu = 0;
+        uint64_t total = 0;
+        int slot = 0;
+        int k;
+
+        p += 3;
+        if (*p >= '0' && *p <= '9') {
+            p = parse_u64(p, &cpu);
+            slot = (int)cpu + 1;
         }
-    } else {
-        // Use the first fan found
-        strncpy(fan_file, globbuf.gl_pathv[0], sizeof(fan_file) - 1);
-        fan_file[sizeof(fan_file) - 1] = '\0';
+        for (k = 0; k < 7; k++) {
+            p = parse_u64(p, &v[k]);
+            total += v[k];
+        }
+
+        if (slot == 0) {
+            load = cpu_busy_pct(&cpu_prev[0], total, v[3]);
+        } else if (cpu < MAX_CPUS) {
+            core_busy[cpu] = cpu_busy_pct(&cpu_prev[slot], total, v[3]);
+            core_now[cpu].total = total;
+            core_now[cpu].idle = v[3];
+            if ((int)cpu + 1 > core_count) core_count = (int)cpu + 1;
+        }
+
+        p = strchr(p, '\n');
+        if (!p) break;
+        p++;
     }
-    globfree(&globbuf);
-    return;
+    return load;
 }
 
+static void tx_begin(TxBatch *tx, const TelemetryPacket *pkt)
+{
+    memcpy(tx->buf[0], pkt, sizeof(*pkt));
+    tx->len[0] = sizeof(*pkt);
+    tx->count = 1;
+}
 
-// Function to read fan speed from sysfs
-float read_fan_speed() {
-    if(!fan_file[0]) return 0.0f; // The fan file was not found in get_fan_file()
-    FILE *f;
-    uint64_t fan_speed_rpm = -1;
-    f = fopen(fan_file, "r");
-    if (!f) return 0.0f;
-    fscanf(f, "%lu", &fan_speed_rpm);
-    fclose(f);
-    if(argon40_fan)
-        fan_speed_rpm = ((float) fan_speed_rpm / (float) argon40_period) * 8400.0;
-    return (float) fan_speed_rpm;
+// Append one extension record. When the current datagram is full a new one
+// is started with a copy of the header and a TLV_CONTINUATION marker; once
+// MAX_DATAGRAMS are used further records are dropped.
+static void tlv_append(TxBatch *tx, uint16_t type,
+                       const void *value, uint16_t value_len)
+{
+    TelemetryTlv tlv;
+    int cur = tx->count - 1;
+
+    if (tx->len[cur] + sizeof(tlv) + value_len > MAX_PACKET) {
+        if (tx->count >= MAX_DATAGRAMS) return;
+        if (sizeof(TelemetryPacket) + 2 * sizeof(tlv) + value_len > MAX_PACKET) return;
+        cur = tx->count++;
+        memcpy(tx->buf[cur], tx->buf[0], sizeof(TelemetryPacket));
+        tlv.type = TLV_CONTINUATION;
+        tlv.len = 0;
+        memcpy(tx->buf[cur] + sizeof(TelemetryPacket), &tlv, sizeof(tlv));
+        tx->len[cur] = sizeof(TelemetryPacket) + sizeof(tlv);
+    }
+    tlv.type = type;
+    tlv.len = value_len;
+    memcpy(tx->buf[cur] + tx->len[cur], &tlv, sizeof(tlv));
+    memcpy(tx->buf[cur] + tx->len[cur] + sizeof(tlv), value, value_len);
+    tx->len[cur] += sizeof(tlv) + value_len;
 }
 
-/* ---------- Main ---------- */
+// Per-core busy over the whole send interval, not just the last sample:
+// with PIMON_SAMPLE_HZ > 1 core_busy[] only covers the final 1/HZ slice.
+static void append_cpu_cores(TxBatch *tx)
+{
+    TlvCpuCore cores[MAX_CPUS];
+    int i;
 
-int main(int argc, char **argv) {
-    DIAG_PRINT("Starting client UDP broadcaster\n");
+    if (core_count <= 0) return;
+    for (i = 0; i < core_count; i++) {
+        float busy = cpu_busy_pct(&core_sent[i], core_now[i].total, core_now[i].idle);
+        if (busy < 0) busy = 0;
+        cores[i].busy = (uint16_t)(busy * 100.0f + 0.5f);
+        cores[i].mhz = (uint16_t)core_mhz[i];
+    }
+    tlv_append(tx, TLV_CPU_CORES, cores,
+               (uint16_t)(sizeof(cores[0]) * core_count));
+}
 
-    const char *server_ip = NULL;
-    if (argc > 1 && argv[1][0] != '\0') {
-        server_ip = argv[1];
-    } else {
-        server_ip = getenv(SERVER_ENV);
+void print_cores(void) {
+    int i;
+    for (i = 0; i < core_count; i++) {
+        DIAG_PRINT(" cpu%-2d %5.1f %% %6.0f MHz\n", i, core_busy[i], core_mhz[i]);
     }
-    if (!server_ip || server_ip[0] == '\0') {
-        fprintf(stderr, "Usage: %s <server_ip>\n", argv[0]);
-        fprintf(stderr, "Or set %s in the environment.\n", SERVER_ENV);
-        return 1;
+}
+
+static HwmonSensor sensors[MAX_SENSORS];
+static int sensor_count = 0;
+
+static const char *parse_i64(const char *p, int64_t *out)
+{
+    uint64_t v;
+    bool neg = false;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '-') {
+        neg = true;
+        p++;
     }
+    p = parse_u64(p, &v);
+    *out = neg ? -(int64_t)v : (int64_t)v;
+    return p;
+}
 
-    openlog("PiMon_Client", LOG_PID | LOG_CONS, LOG_DAEMON);
-    syslog(LOG_ERR,"Server: %s", server_ip);
+// Read a one-line sysfs attribute and strip the trailing newline
+static int read_sysfs_line(const char *path, char *buf, size_t len)
+{
+    int fd = open(path, O_RDONLY);
+    ssize_t n;
+    if (fd < 0) return -1;
+    n = read_cached(fd, buf, len);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
 
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+static int sensor_kind(const char *attr)
+{
+    if (strncmp(attr, "temp", 4) == 0) return SENSOR_TEMP;
+    if (strncmp(attr, "fan", 3) == 0) return SENSOR_FAN;
+    if (strncmp(attr, "in", 2) == 0) return SENSOR_IN;
+    if (strncmp(attr, "power", 5) == 0) return SENSOR_POWER;
+    return 0;
+}
 
-    struct sockaddr_in server = {0};
-    char resolved_ip[INET_ADDRSTRLEN] = {0};
-    if (resolve_server(server_ip, SERVER_PORT, &server,
-                       resolved_ip, sizeof(resolved_ip)) != 0) {
-        syslog(LOG_ERR, "Unable to resolve server: %s", server_ip);
-        closelog();
-        return 1;
+// Enumerate every hwmon temp/fan/in/power channel once at startup and keep
+// the *_input fd open. Labels are "<chip>:<label>", or "<chip>:<channel>"
+// when the driver provides no label, e.g. "nvme:Composite", "rp1_adc:in1".
+void init_hwmon_sensors(void)
+{
+    glob_t globbuf;
+    char pattern[PATH_MAX];
+    size_t i;
+
+    if (glob(rooted("/sys/class/hwmon/hwmon*/*_input", pattern, sizeof(pattern)),
+             0, NULL, &globbuf) != 0) {
+        globfree(&globbuf);
+        return;
     }
-    if (resolved_ip[0] != '\0') {
-        syslog(LOG_INFO, "Server resolved to %s", resolved_ip);
-    } else {
-        syslog(LOG_INFO, "Server resolved (address conversion failed)");
+
+    for (i = 0; i < globbuf.gl_pathc && sensor_count < MAX_SENSORS; i++) {
+        const char *path = globbuf.gl_pathv[i];
+        const char *attr = strrchr(path, '/') + 1;
+        HwmonSensor *sn = &sensors[sensor_count];
+        char dir[PATH_MAX];
+        char chip[32] = "hwmon";
+        char label[64];
+        char channel[32];
+        char tmp[PATH_MAX + 64];
+        int kind = sensor_kind(attr);
+
+        if (!kind) continue;
+
+        snprintf(dir, sizeof(dir), "%.*s", (int)(attr - path - 1), path);
+        snprintf(channel, sizeof(channel), "%.*s",
+                 (int)(strlen(attr) - strlen("_input")), attr);
+
+        snprintf(tmp, sizeof(tmp), "%s/name", dir);
+        read_sysfs_line(tmp, chip, sizeof(chip));
+        snprintf(tmp, sizeof(tmp), "%s/%s_label", dir, channel);
+        if (read_sysfs_line(tmp, label, sizeof(label)) != 0) {
+            snprintf(label, sizeof(label), "%s", channel);
+        }
+
+        sn->fd = open(path, O_RDONLY);
+        if (sn->fd < 0) continue;
+        sn->kind = (uint8_t)kind;
+        snprintf(sn->label, sizeof(sn->label), "%.11s:%.11s", chip, label);
+        sensor_count++;
+        syslog(LOG_INFO, "Sensor %s", sn->label);
     }
+    globfree(&globbuf);
+}
 
-    TelemetryPacket pkt = {0};
-    gethostname(pkt.client_id, CLIENT_ID_LEN);
-    get_fan_file();
+void read_hwmon_sensors(void)
+{
+    int i;
+    for (i = 0; i < sensor_count; i++) {
+        char buf[32];
+        int64_t v;
 
-    syslog(LOG_ERR,"Entering main loop");
+        // Drivers return EIO/ENODATA while a device sleeps; skip that sample
+        sensors[i].valid = read_cached(sensors[i].fd, buf, sizeof(buf)) > 0;
+        if (!sensors[i].valid) continue;
+        parse_i64(buf, &v);
+        sensors[i].value = (int32_t)v;
+    }
+}
 
-    time_t last_resolve = time(NULL);
+static void append_sensors(TxBatch *tx)
+{
+    int i;
+    for (i = 0; i < sensor_count; i++) {
+        TlvSensor rec;
+        size_t label_len = strlen(sensors[i].label);
 
-    while (1) {
-        time_t now = time(NULL);
-        if (now - last_resolve >= RESOLVE_INTERVAL_SEC) {
-            struct sockaddr_in new_server = {0};
-            char new_ip[INET_ADDRSTRLEN] = {0};
-            if (resolve_server(server_ip, SERVER_PORT, &new_server,
-                               new_ip, sizeof(new_ip)) == 0) {
-                if (memcmp(&new_server.sin_addr, &server.sin_addr,
-                           sizeof(server.sin_addr)) != 0) {
-                    char old_ip[INET_ADDRSTRLEN] = {0};
-                    inet_ntop(AF_INET, &server.sin_addr, old_ip, sizeof(old_ip));
-                    server = new_server;
-                    if (new_ip[0] == '\0') {
-                        snprintf(new_ip, sizeof(new_ip), "unknown");
-                    }
-                    syslog(LOG_INFO, "Server IP changed: %s -> %s",
-                           old_ip[0] ? old_ip : "unknown", new_ip);
-                }
-            } else {
-                syslog(LOG_WARNING, "Server lookup failed: %s", server_ip);
-            }
-            last_resolve = now;
+        if (!sensors[i].valid) continue;
+        rec.value = sensors[i].value;
+        rec.kind = sensors[i].kind;
+        memcpy(rec.label, sensors[i].label, label_len);
+        tlv_append(tx, TLV_SENSOR, &rec,
+                   (uint16_t)(offsetof(TlvSensor, label) + label_len));
+    }
+}
+
+void print_sensors(void) {
+    int i;
+    for (i = 0; i < sensor_count; i++) {
+        if (sensors[i].valid) {
+            DIAG_PRINT(" %-24s %d\n", sensors[i].label, sensors[i].value);
         }
+    }
+}
 
-        pkt.cpu_load  = read_cpu_load();
-        pkt.cpu_temp  = read_cpu_temp();
-        pkt.cpu_mhz   = read_cpu_mhz();
-        pkt.fan_speed = read_fan_speed();
-        pkt.timestamp = (uint64_t)now;
+static int meminfo_fd = -1;
+static int psi_fd[PSI_COUNT] = { -1, -1, -1 };
+static uint64_t psi_prev_some[PSI_COUNT];
+static uint64_t psi_prev_full[PSI_COUNT];
+static uint64_t psi_prev_ns = 0;
+static TlvMemory mem_stats;
+static TlvPressure psi_stats;
+static bool psi_valid = false;
 
-        print_packet(&pkt);
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
 
-        sendto(sock, &pkt, sizeof(pkt), 0,
-               (struct sockaddr*)&server, sizeof(server));
+void init_memory(void)
+{
+    static const char *psi_paths[PSI_COUNT] = {
+        "/proc/pressure/cpu", "/proc/pressure/memory", "/proc/pressure/io"
+    };
+    int i;
+
+    meminfo_fd = open_rooted("/proc/meminfo", O_RDONLY);
+    // PSI needs CONFIG_PSI and, on Raspberry Pi OS, psi=1 on the cmdline
+    for (i = 0; i < PSI_COUNT; i++) psi_fd[i] = open_rooted(psi_paths[i], O_RDONLY);
+}
+
+// The fields we need are all in the first couple of kB of /proc/meminfo.
+// Walk it line by line and stop once every wanted key has been seen.
+int read_meminfo(void)
+{
+    char buf[2048];
+    const char *p = buf;
+    uint64_t total = 0, avail = 0, swap_total = 0, swap_free = 0;
+    uint64_t dirty = 0, writeback = 0;
+    int found = 0;
+
+    if (read_cached(meminfo_fd, buf, sizeof(buf)) <= 0) return -1;
+
+    while (*p && found < 6) {
+        const char *colon = strchr(p, ':');
+        size_t key_len;
+        uint64_t *dst = NULL;
+
+        if (!colon) break;
+        key_len = (size_t)(colon - p);
+#define MEMINFO_KEY(name, var) \
+        if (!dst && key_len == sizeof(name) - 1 && memcmp(p, name, key_len) == 0) dst = &var
+        MEMINFO_KEY("MemTotal", total);
+        MEMINFO_KEY("MemAvailable", avail);
+        MEMINFO_KEY("SwapTotal", swap_total);
+        MEMINFO_KEY("SwapFree", swap_free);
+        MEMINFO_KEY("Dirty", dirty);
+        MEMINFO_KEY("Writeback", writeback);
+#undef MEMINFO_KEY
+        p = colon + 1;
+        if (dst) {
+            p = parse_u64(p, dst);
+            found++;
+        }
+        p = strchr(p, '\n');
+        if (!p) break;
+        p++;
+    }
+
+    mem_stats.mem_total_kb  = (uint32_t)total;
+    mem_stats.mem_avail_kb  = (uint32_t)avail;
+    mem_stats.swap_total_kb = (uint32_t)swap_total;
+    mem_stats.swap_used_kb  = (uint32_t)(swap_total > swap_free ? swap_total - swap_free : 0);
+    mem_stats.dirty_kb      = (uint32_t)dirty;
+    mem_stats.writeback_kb  = (uint32_t)writeback;
+    return 0;
+}
+
+// Parse the "total=" stall counters (microseconds) of a pressure file
+static int parse_psi(const char *buf, uint64_t *some, uint64_t *full)
+{
+    const char *p;
+    *some = 0;
+    *full = 0;
+    p = strstr(buf, "total=");
+    if (!p) return -1;
+    parse_u64(p + 6, some);
+    p = strstr(p + 6, "total=");
+    if (p) parse_u64(p + 6, full);
+    return 0;
+}
+
+static uint16_t psi_pct(uint64_t now, uint64_t prev, uint64_t elapsed_us)
+{
+    double pct;
+    if (elapsed_us == 0 || now < prev) return 0;
+    pct = (double)(now - prev) * 100.0 / (double)elapsed_us;
+    if (pct > 100.0) pct = 100.0;
+    return (uint16_t)(pct * 100.0 + 0.5);
+}
+
+// Stall percentages are computed from counter deltas over the real elapsed
+// time, so they cover exactly the last sample interval, unlike avg10.
+void read_pressure(void)
+{
+    uint64_t now_ns = monotonic_ns();
+    uint64_t elapsed_us = (now_ns - psi_prev_ns) / 1000;
+    bool first = (psi_prev_ns == 0);
+    bool any = false;
+    int i;
+
+    for (i = 0; i < PSI_COUNT; i++) {
+        char buf[256];
+        uint64_t some, full;
+
+        if (read_cached(psi_fd[i], buf, sizeof(buf)) <= 0) continue;
+        if (parse_psi(buf, &some, &full) != 0) continue;
+        psi_stats.some[i] = psi_pct(some, psi_prev_some[i], elapsed_us);
+        psi_stats.full[i] = psi_pct(full, psi_prev_full[i], elapsed_us);
+        psi_prev_some[i] = some;
+        psi_prev_full[i] = full;
+        any = true;
+    }
+    psi_prev_ns = now_ns;
+    psi_valid = any && !first;
+}
+
+static void append_memory(TxBatch *tx)
+{
+    if (mem_stats.mem_total_kb) {
+        tlv_append(tx, TLV_MEMORY, &mem_stats, sizeof(mem_stats));
+    }
+    if (psi_valid) {
+        tlv_append(tx, TLV_PRESSURE, &psi_stats, sizeof(psi_stats));
+    }
+}
+
+void print_memory(void) {
+    DIAG_PRINT(" Mem avail : %u / %u kB\n", mem_stats.mem_avail_kb, mem_stats.mem_total_kb);
+    DIAG_PRINT(" Swap used : %u / %u kB\n", mem_stats.swap_used_kb, mem_stats.swap_total_kb);
+    DIAG_PRINT(" Dirty/WB  : %u / %u kB\n", mem_stats.dirty_kb, mem_stats.writeback_kb);
+    if (psi_valid) {
+        DIAG_PRINT(" PSI some  : cpu %.2f mem %.2f io %.2f %%\n",
+                   psi_stats.some[PSI_CPU] / 100.0, psi_stats.some[PSI_MEMORY] / 100.0,
+                   psi_stats.some[PSI_IO] / 100.0);
+    }
+}
+
+static int netdev_fd = -1;
+static NetIface net_ifaces[MAX_IFACES];
+static int net_iface_count = 0;
+static uint64_t net_prev_ns = 0;
+
+// Delta of an unsigned long kernel counter (net/dev, diskstats). Only where
+// long is 32 bits can such a counter wrap at 2^32; a value that went
+// backwards on a 64-bit kernel, or past 2^32 on a 32-bit one, is a reset
+// (interface re-created) and gives 0, the caller re-priming from now.
+static uint64_t counter_delta(uint64_t now, uint64_t prev)
+{
+    if (now >= prev) return now - prev;
+    if (sizeof(long) == 4 && prev <= UINT32_MAX) return now + (UINT32_MAX - prev) + 1;
+    return 0;
+}
+
+static NetIface *find_iface(const char *name, size_t name_len)
+{
+    int i;
+    NetIface *nif;
+
+    for (i = 0; i < net_iface_count; i++) {
+        if (strlen(net_ifaces[i].name) == name_len &&
+            memcmp(net_ifaces[i].name, name, name_len) == 0) {
+            return &net_ifaces[i];
+        }
+    }
+    if (net_iface_count >= MAX_IFACES || name_len >= IFACE_NAME_LEN) return NULL;
+    nif = &net_ifaces[net_iface_count++];
+    memset(nif, 0, sizeof(*nif));
+    memcpy(nif->name, name, name_len);
+    return nif;
+}
+
+// Read /proc/net/dev once per tick and turn the counters into rates. The
+// loopback device is skipped; interfaces that disappear are dropped.
+void read_net_dev(void)
+{
+    // 0-based columns of the counters we keep, after "name:"
+    static const int cols[NET_COUNTERS] = { 0, 1, 2, 3, 8, 9, 10, 11 };
+    char buf[4096];
+    const char *p;
+    uint64_t now_ns = monotonic_ns();
+    double secs = (now_ns - net_prev_ns) / 1e9;
+    int i;
+
+    if (netdev_fd < 0) netdev_fd = open_rooted("/proc/net/dev", O_RDONLY);
+    if (read_cached(netdev_fd, buf, sizeof(buf)) <= 0) return;
+    net_prev_ns = now_ns;
+
+    for (i = 0; i < net_iface_count; i++) net_ifaces[i].seen = false;
+
+    // Skip the two header lines
+    p = strchr(buf, '\n');
+    if (p) p = strchr(p + 1, '\n');
+    while (p && *++p) {
+        const char *name = p;
+        const char *colon;
+        uint64_t v[12];
+        NetIface *nif;
+        int k;
+
+        while (*name == ' ') name++;
+        colon = strchr(name, ':');
+        if (!colon) break;
+        p = colon + 1;
+        for (k = 0; k < 12; k++) p = parse_u64(p, &v[k]);
+        p = strchr(p, '\n');
+
+        if (colon - name == 2 && memcmp(name, "lo", 2) == 0) continue;
+        nif = find_iface(name, (size_t)(colon - name));
+        if (!nif) continue;
+        nif->seen = true;
+
+        if (nif->primed && secs > 0) {
+            double d[NET_COUNTERS];
+            for (k = 0; k < NET_COUNTERS; k++) {
+                d[k] = (double)counter_delta(v[cols[k]], nif->prev[k]) / secs;
+            }
+            nif->rate.rx_bytes   = (float)d[NET_RX_BYTES];
+            nif->rate.tx_bytes   = (float)d[NET_TX_BYTES];
+            nif->rate.rx_packets = (float)d[NET_RX_PACKETS];
+            nif->rate.tx_packets = (float)d[NET_TX_PACKETS];
+            nif->rate.rx_errors  = (float)d[NET_RX_ERRS];
+            nif->rate.tx_errors  = (float)d[NET_TX_ERRS];
+            nif->rate.rx_drops   = (float)d[NET_RX_DROP];
+            nif->rate.tx_drops   = (float)d[NET_TX_DROP];
+        }
+        for (k = 0; k < NET_COUNTERS; k++) nif->prev[k] = v[cols[k]];
+        nif->primed = true;
+    }
+
+    // Compact away interfaces that were removed
+    for (i = 0; i < net_iface_count; ) {
+        if (!net_ifaces[i].seen) {
+            net_ifaces[i] = net_ifaces[--net_iface_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+static void append_net(TxBatch *tx)
+{
+    int i;
+    for (i = 0; i < net_iface_count; i++) {
+        TlvNetIface rec = net_ifaces[i].rate;
+        size_t name_len = strlen(net_ifaces[i].name);
+
+        memcpy(rec.name, net_ifaces[i].name, name_len);
+        tlv_append(tx, TLV_NET_IFACE, &rec,
+                   (uint16_t)(offsetof(TlvNetIface, name) + name_len));
+    }
+}
+
+void print_net(void) {
+    int i;
+    for (i = 0; i < net_iface_count; i++) {
+        DIAG_PRINT(" %-8s rx %.0f B/s %.0f pkt/s tx %.0f B/s %.0f pkt/s\n",
+                   net_ifaces[i].name,
+                   net_ifaces[i].rate.rx_bytes, net_ifaces[i].rate.rx_packets,
+                   net_ifaces[i].rate.tx_bytes, net_ifaces[i].rate.tx_packets);
+    }
+}
+
+static uint64_t freq_prev_ns = 0;
+static CoolingDevice cooling[MAX_COOLING];
+static int cooling_count = 0;
+
+// Turn the time_in_state and total_trans counters of every policy into the
+// share of the interval spent at each frequency and a transition rate. A
+// single scaling_cur_freq read misses DVFS changes between samples; these
+// counters do not.
+void read_cpufreq_stats(void)
+{
+    uint64_t now_ns = monotonic_ns();
+    double secs = (now_ns - freq_prev_ns) / 1e9;
+    int i;
+
+    freq_prev_ns = now_ns;
+    for (i = 0; i < cpufreq_policy_count; i++) {
+        CpuFreqPolicy *pol = &cpufreq_policies[i];
+        char buf[1024];
+        uint32_t khz[MAX_FREQ_STATES];
+        uint64_t t[MAX_FREQ_STATES];
+        uint64_t d[MAX_FREQ_STATES];
+        uint64_t trans = 0;
+        uint64_t total = 0;
+        const char *p = buf;
+        int n = 0;
+        int k;
+
+        if (read_cached(pol->stats_fd, buf, sizeof(buf)) <= 0) continue;
+        while (n < MAX_FREQ_STATES && *p >= '0' && *p <= '9') {
+            uint64_t v;
+            p = parse_u64(p, &v);
+            khz[n] = (uint32_t)v;
+            p = parse_u64(p, &t[n]);
+            n++;
+            if (*p == '\n') p++;
+        }
+        if (read_cached(pol->trans_fd, buf, sizeof(buf)) > 0) parse_u64(buf, &trans);
+
+        // A changed frequency table (driver reload) starts over
+        if (n != pol->state_count || memcmp(khz, pol->state_khz, n * sizeof(khz[0])) != 0) {
+            pol->primed = false;
+        }
+        if (pol->primed) {
+            for (k = 0; k < n; k++) {
+                d[k] = counter_delta(t[k], pol->prev_time[k]);
+                total += d[k];
+            }
+            // Below the 10 ms resolution the previous shares stand
+            if (total > 0) {
+                pol->rate.state_count = 0;
+                for (k = 0; k < n; k++) {
+                    TlvFreqState *st;
+                    if (d[k] == 0) continue;
+                    st = &pol->rate.states[pol->rate.state_count++];
+                    st->khz = khz[k];
+                    st->share = (uint16_t)(d[k] * 10000 / total);
+                }
+            }
+            if (secs > 0) {
+                pol->rate.trans_per_sec = (float)(counter_delta(trans, pol->prev_trans) / secs);
+            }
+        }
+        pol->state_count = n;
+        memcpy(pol->state_khz, khz, n * sizeof(khz[0]));
+        memcpy(pol->prev_time, t, n * sizeof(t[0]));
+        pol->prev_trans = trans;
+        pol->primed = true;
+    }
+}
+
+static void append_cpufreq_stats(TxBatch *tx)
+{
+    int i;
+    for (i = 0; i < cpufreq_policy_count; i++) {
+        const TlvFreq *rec = &cpufreq_policies[i].rate;
+        if (rec->state_count == 0) continue;
+        tlv_append(tx, TLV_FREQ, rec,
+                   (uint16_t)(offsetof(TlvFreq, states) + rec->state_count * sizeof(TlvFreqState)));
+    }
+}
+
+void print_cpufreq_stats(void) {
+    int i, k;
+    for (i = 0; i < cpufreq_policy_count; i++) {
+        const TlvFreq *rec = &cpufreq_policies[i].rate;
+        if (rec->state_count == 0) continue;
+        DIAG_PRINT(" policy%u   : %.1f trans/s", rec->policy, rec->trans_per_sec);
+        for (k = 0; k < rec->state_count; k++) {
+            DIAG_PRINT(" %u MHz %.1f%%", rec->states[k].khz / 1000, rec->states[k].share / 100.0);
+        }
+        DIAG_PRINT("\n");
+    }
+}
+
+// Thermal cooling devices: cpufreq-cpuN reports the throttling step the
+// thermal governor applied, pwm-fan and friends the fan speed step
+void init_cooling(void)
+{
+    glob_t globbuf;
+    char pattern[PATH_MAX];
+    size_t i;
+
+    if (glob(rooted("/sys/class/thermal/cooling_device[0-9]*", pattern, sizeof(pattern)),
+             0, NULL, &globbuf) != 0) {
+        return;
+    }
+    for (i = 0; i < globbuf.gl_pathc && cooling_count < MAX_COOLING; i++) {
+        CoolingDevice *cd = &cooling[cooling_count];
+        char path[PATH_MAX];
+        char buf[64];
+        uint64_t max_state = 0;
+
+        memset(cd, 0, sizeof(*cd));
+        snprintf(path, sizeof(path), "%s/type", globbuf.gl_pathv[i]);
+        if (read_sysfs_line(path, cd->stats.type, sizeof(cd->stats.type)) < 0) continue;
+
+        snprintf(path, sizeof(path), "%s/max_state", globbuf.gl_pathv[i]);
+        if (read_sysfs_line(path, buf, sizeof(buf)) == 0) parse_u64(buf, &max_state);
+        cd->stats.max_state = (uint16_t)max_state;
+
+        snprintf(path, sizeof(path), "%s/cur_state", globbuf.gl_pathv[i]);
+        cd->fd = open(path, O_RDONLY);
+        if (cd->fd < 0) continue;
+        cooling_count++;
+    }
+    globfree(&globbuf);
+}
+
+void read_cooling(void)
+{
+    int i;
+    for (i = 0; i < cooling_count; i++) {
+        char buf[32];
+        uint64_t cur;
+        if (read_cached(cooling[i].fd, buf, sizeof(buf)) <= 0) continue;
+        parse_u64(buf, &cur);
+        cooling[i].stats.cur_state = (uint16_t)cur;
+    }
+}
+
+static void append_cooling(TxBatch *tx)
+{
+    int i;
+    for (i = 0; i < cooling_count; i++) {
+        tlv_append(tx, TLV_COOLING, &cooling[i].stats,
+                   (uint16_t)(offsetof(TlvCooling, type) + strlen(cooling[i].stats.type)));
+    }
+}
+
+void print_cooling(void) {
+    int i;
+    for (i = 0; i < cooling_count; i++) {
+        DIAG_PRINT(" cooling   : %s %u/%u\n", cooling[i].stats.type,
+                   cooling[i].stats.cur_state, cooling[i].stats.max_state);
+    }
+}
+
+static int diskstats_fd = -1;
+static BlockDisk disks[MAX_DISKS];
+static int disk_count = 0;
+static uint64_t disk_prev_ns = 0;
+// Names find_disk() found no /sys/block entry for (partitions such as
+// mmcblk0p1 or sda1), so steady state costs no access() per line per tick.
+// loop* and ram* are turned down by prefix and never reach the list.
+static char disk_rejected[MAX_DISK_REJECTS][DISK_NAME_LEN];
+static int disk_rejected_count = 0;
+static char mounts[MAX_MOUNTS][MOUNT_PATH_LEN];
+static int mount_count = 0;
+static TlvFs fs_stats[MAX_MOUNTS];
+
+// eMMC parts (CM4, some SBC boot media) report wear in 10 % steps through
+// life_time ("0x01 0x02", type A and B cells). SD cards do not expose it.
+static uint8_t read_disk_life(const char *name)
+{
+    char path[PATH_MAX];
+    char buf[32];
+    uint64_t a = 0, b = 0;
+    char *end;
+
+    snprintf(path, sizeof(path), "%s/sys/block/%s/device/life_time", fs_root, name);
+    if (read_sysfs_line(path, buf, sizeof(buf)) != 0) return 0;
+    a = strtoull(buf, &end, 16);
+    b = strtoull(end, NULL, 16);
+    if (b > a) a = b;
+    if (a == 0 || a > 0x0B) return 0;
+    return (uint8_t)(a * 10);
+}
+
+// Whole disks only: partitions have no /sys/block entry, loop and ram
+// devices are noise on a Pi.
+static BlockDisk *find_disk(const char *name, size_t name_len)
+{
+    int i;
+    BlockDisk *d;
+    char path[PATH_MAX];
+
+    for (i = 0; i < disk_count; i++) {
+        if (strlen(disks[i].name) == name_len &&
+            memcmp(disks[i].name, name, name_len) == 0) {
+            return &disks[i];
+        }
+    }
+    if (disk_count >= MAX_DISKS || name_len >= DISK_NAME_LEN) return NULL;
+    if (strncmp(name, "loop", 4) == 0 || strncmp(name, "ram", 3) == 0) return NULL;
+    for (i = 0; i < disk_rejected_count; i++) {
+        if (strlen(disk_rejected[i]) == name_len &&
+            memcmp(disk_rejected[i], name, name_len) == 0) {
+            return NULL;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/sys/block/%.*s", fs_root, (int)name_len, name);
+    if (access(path, F_OK) != 0) {
+        if (disk_rejected_count < MAX_DISK_REJECTS) {
+            memcpy(disk_rejected[disk_rejected_count], name, name_len);
+            disk_rejected[disk_rejected_count][name_len] = '\0';
+            disk_rejected_count++;
+        }
+        return NULL;
+    }
+
+    d = &disks[disk_count++];
+    memset(d, 0, sizeof(*d));
+    memcpy(d->name, name, name_len);
+    d->rate.life_used = read_disk_life(d->name);
+    return d;
+}
+
+void read_diskstats(void)
+{
+    // 0-based columns after the device name
+    static const int cols[DISK_COUNTERS] = { 0, 2, 3, 4, 6, 7, 9 };
+    char buf[16384];
+    const char *p = buf;
+    uint64_t now_ns = monotonic_ns();
+    double secs = (now_ns - disk_prev_ns) / 1e9;
+    int i;
+
+    if (diskstats_fd < 0) diskstats_fd = open_rooted("/proc/diskstats", O_RDONLY);
+    if (read_cached(diskstats_fd, buf, sizeof(buf)) <= 0) return;
+    disk_prev_ns = now_ns;
+
+    for (i = 0; i < disk_count; i++) disks[i].seen = false;
+
+    while (*p) {
+        uint64_t major, minor, v[11];
+        const char *name;
+        size_t name_len;
+        BlockDisk *d;
+        int k;
+
+        p = parse_u64(p, &major);
+        p = parse_u64(p, &minor);
+        while (*p == ' ') p++;
+        name = p;
+        while (*p && *p != ' ' && *p != '\n') p++;
+        name_len = (size_t)(p - name);
+        for (k = 0; k < 11; k++) p = parse_u64(p, &v[k]);
+        p = strchr(p, '\n');
+        p = p ? p + 1 : "";
+
+        if (name_len == 0 || v[0] + v[4] == 0) continue;    // never used
+        d = find_disk(name, name_len);
+        if (!d) continue;
+        d->seen = true;
+        d->rate.in_flight = (uint16_t)(v[8] > UINT16_MAX ? UINT16_MAX : v[8]);
+
+        if (d->primed && secs > 0) {
+            uint64_t dl[DISK_COUNTERS];
+            uint64_t ios;
+            double util;
+
+            for (k = 0; k < DISK_COUNTERS; k++) {
+                dl[k] = counter_delta(v[cols[k]], d->prev[k]);
+            }
+            ios = dl[DISK_RD_IOS] + dl[DISK_WR_IOS];
+            d->rate.rd_iops  = (float)(dl[DISK_RD_IOS] / secs);
+            d->rate.wr_iops  = (float)(dl[DISK_WR_IOS] / secs);
+            d->rate.rd_bytes = (float)(dl[DISK_RD_SECTORS] * 512.0 / secs);
+            d->rate.wr_bytes = (float)(dl[DISK_WR_SECTORS] * 512.0 / secs);
+            d->rate.await_ms = ios ? (float)(dl[DISK_RD_MS] + dl[DISK_WR_MS]) / ios : 0.0f;
+            util = dl[DISK_IO_TICKS] / (secs * 10.0);
+            d->rate.util = (uint8_t)(util > 100.0 ? 100 : util);
+        }
+        for (k = 0; k < DISK_COUNTERS; k++) d->prev[k] = v[cols[k]];
+        d->primed = true;
+    }
+
+    for (i = 0; i < disk_count; ) {
+        if (!disks[i].seen) {
+            disks[i] = disks[--disk_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+void init_mounts(void)
+{
+    const char *env = getenv(MOUNTS_ENV);
+    const char *p;
+
+    if (!env || !env[0]) env = "/";
+    p = env;
+    while (*p && mount_count < MAX_MOUNTS) {
+        size_t n = strcspn(p, ":");
+        if (n > 0 && n < MOUNT_PATH_LEN) {
+            memcpy(mounts[mount_count], p, n);
+            mounts[mount_count][n] = '\0';
+            mount_count++;
+        }
+        p += n;
+        if (*p == ':') p++;
+    }
+}
+
+void read_filesystems(void)
+{
+    int i;
+    for (i = 0; i < mount_count; i++) {
+        struct statvfs st;
+        char path[PATH_MAX];
+        TlvFs *fs = &fs_stats[i];
+
+        fs->total_mb = 0;
+        if (statvfs(rooted(mounts[i], path, sizeof(path)), &st) != 0) continue;
+        fs->total_mb = (uint32_t)((uint64_t)st.f_blocks * st.f_frsize >> 20);
+        fs->free_mb  = (uint32_t)((uint64_t)st.f_bavail * st.f_frsize >> 20);
+    }
+}
+
+static void append_disks(TxBatch *tx)
+{
+    int i;
+    for (i = 0; i < disk_count; i++) {
+        TlvDisk rec = disks[i].rate;
+        size_t name_len = strlen(disks[i].name);
+
+        if (!disks[i].primed) continue;
+        memcpy(rec.name, disks[i].name, name_len);
+        tlv_append(tx, TLV_DISK, &rec,
+                   (uint16_t)(offsetof(TlvDisk, name) + name_len));
+    }
+    for (i = 0; i < mount_count; i++) {
+        TlvFs rec = fs_stats[i];
+        size_t path_len = strlen(mounts[i]);
+
+        if (!rec.total_mb) continue;
+        memcpy(rec.path, mounts[i], path_len);
+        tlv_append(tx, TLV_FS, &rec,
+                   (uint16_t)(offsetof(TlvFs, path) + path_len));
+    }
+}
+
+void print_disks(void) {
+    int i;
+    for (i = 0; i < disk_count; i++) {
+        DIAG_PRINT(" %-8s r %.0f w %.0f iops await %.1f ms q %u util %u %%\n",
+                   disks[i].name, disks[i].rate.rd_iops, disks[i].rate.wr_iops,
+                   disks[i].rate.await_ms, disks[i].rate.in_flight, disks[i].rate.util);
+    }
+    for (i = 0; i < mount_count; i++) {
+        DIAG_PRINT(" %-8s %u / %u MB free\n", mounts[i], fs_stats[i].free_mb, fs_stats[i].total_mb);
+    }
+}
+
+static int top_n = 0;
+static ProcEntry proc_table[PROC_TABLE_SIZE];
+static int proc_fds_open = 0;
+static int proc_tombstones = 0;
+static uint32_t proc_gen = 0;
+static uint32_t proc_tick = 0;
+static int proc_cursor = 0;
+static long clk_tck = 100;
+static long page_kb = 4;
+static ProcEntry *top_cpu[MAX_TOP_N];
+static ProcEntry *top_rss[MAX_TOP_N];
+static int top_cpu_count = 0;
+static int top_rss_count = 0;
+
+void init_procs(void)
+{
+    const char *env = getenv(TOP_N_ENV);
+    if (env) top_n = atoi(env);
+    if (top_n < 0) top_n = 0;
+    if (top_n > MAX_TOP_N) top_n = MAX_TOP_N;
+    clk_tck = sysconf(_SC_CLK_TCK);
+    page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    if (clk_tck <= 0) clk_tck = 100;
+    if (page_kb <= 0) page_kb = 4;
+}
+
+static ProcEntry *proc_lookup(int32_t pid, bool insert)
+{
+    uint32_t h = ((uint32_t)pid * 2654435761u) & (PROC_TABLE_SIZE - 1);
+    ProcEntry *tomb = NULL;
+    int probe;
+
+    for (probe = 0; probe < PROC_TABLE_SIZE; probe++) {
+        ProcEntry *e = &proc_table[h];
+        if (e->pid == pid) return e;
+        if (e->pid == -1 && !tomb) tomb = e;
+        if (e->pid == 0) {
+            if (!insert) return NULL;
+            if (!tomb) tomb = e;
+            break;
+        }
+        h = (h + 1) & (PROC_TABLE_SIZE - 1);
+    }
+    if (!insert || !tomb) return NULL;
+    if (tomb->pid == -1) proc_tombstones--;
+    memset(tomb, 0, sizeof(*tomb));
+    tomb->pid = pid;
+    tomb->fd = -1;
+    return tomb;
+}
+
+static void proc_forget(ProcEntry *e)
+{
+    if (e->fd >= 0) {
+        close(e->fd);
+        proc_fds_open--;
+    }
+    e->pid = -1;
+    e->fd = -1;
+    proc_tombstones++;
+}
+
+// Deleted slots lengthen probe chains; rebuild once they pile up
+static void proc_rehash(void)
+{
+    static ProcEntry live[PROC_TABLE_SIZE];
+    int i, n = 0;
+
+    for (i = 0; i < PROC_TABLE_SIZE; i++) {
+        if (proc_table[i].pid > 0) live[n++] = proc_table[i];
+    }
+    memset(proc_table, 0, sizeof(proc_table));
+    proc_tombstones = 0;
+    for (i = 0; i < n; i++) {
+        ProcEntry *e = proc_lookup(live[i].pid, true);
+        *e = live[i];
+    }
+}
+
+// Parse "pid (comm) state ppid ..." - comm may itself contain spaces and
+// parentheses, so fields are counted from the last ')'.
+static int parse_proc_stat(const char *buf, ProcEntry *e, uint64_t *ticks)
+{
+    const char *open_paren = strchr(buf, '(');
+    const char *close_paren = strrchr(buf, ')');
+    const char *p;
+    uint64_t utime = 0, stime = 0, rss = 0;
+    size_t comm_len;
+    int field;
+
+    if (!open_paren || !close_paren || close_paren < open_paren) return -1;
+    comm_len = (size_t)(close_paren - open_paren - 1);
+    if (comm_len > COMM_LEN - 1) comm_len = COMM_LEN - 1;
+    memcpy(e->comm, open_paren + 1, comm_len);
+    e->comm[comm_len] = '\0';
+
+    // close_paren + 2 is field 3 (state); utime=14 stime=15 rss=24
+    p = close_paren + 2;
+    for (field = 3; field <= 24 && *p; field++) {
+        const char *next = strchr(p, ' ');
+        if (field == 14) parse_u64(p, &utime);
+        else if (field == 15) parse_u64(p, &stime);
+        else if (field == 24) parse_u64(p, &rss);
+        if (!next) break;
+        p = next + 1;
+    }
+    *ticks = utime + stime;
+    e->rss_kb = (uint32_t)(rss * (uint64_t)page_kb);
+    return 0;
+}
+
+// One stat read for one pid. The first read only sets the baseline. Returns
+// -1 once the pid is gone (pread fails with ESRCH); the entry is dropped so
+// a recycled pid starts fresh.
+static int proc_refresh(ProcEntry *e, uint64_t now_ns)
+{
+    char buf[512];
+    uint64_t ticks;
+    ssize_t n;
+
+    if (e->fd < 0) {
+        char path[PATH_MAX];
+        int fd;
+        snprintf(path, sizeof(path), "%s/proc/%d/stat", fs_root, e->pid);
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            proc_forget(e);
+            return -1;
+        }
+        n = read_cached(fd, buf, sizeof(buf));
+        if (proc_fds_open < PROC_FD_BUDGET) {
+            e->fd = fd;
+            proc_fds_open++;
+        } else {
+            close(fd);
+        }
+    } else {
+        n = read_cached(e->fd, buf, sizeof(buf));
+    }
+    if (n <= 0 || parse_proc_stat(buf, e, &ticks) != 0) {
+        proc_forget(e);
+        return -1;
+    }
+
+    if (e->sample_ns && now_ns > e->sample_ns && ticks >= e->prev_ticks) {
+        double secs = (now_ns - e->sample_ns) / 1e9;
+        e->cpu_pct = (float)((ticks - e->prev_ticks) * 100.0 / (secs * clk_tck));
+    }
+    e->prev_ticks = ticks;
+    e->sample_ns = now_ns;
+    e->tick = proc_tick;
+    return 0;
+}
+
+// Find pids that appeared since the last pass and drop the ones that left
+static void proc_discover(uint64_t now_ns)
+{
+    char path[PATH_MAX];
+    DIR *dir = opendir(rooted("/proc", path, sizeof(path)));
+    struct dirent *de;
+    int i;
+
+    if (!dir) return;
+    proc_gen++;
+    while ((de = readdir(dir)) != NULL) {
+        ProcEntry *e;
+        if (de->d_name[0] < '1' || de->d_name[0] > '9') continue;
+        e = proc_lookup((int32_t)atoi(de->d_name), true);
+        if (!e) continue;
+        if (e->gen == 0) proc_refresh(e, now_ns);
+        e->gen = proc_gen;
+    }
+    closedir(dir);
+
+    for (i = 0; i < PROC_TABLE_SIZE; i++) {
+        if (proc_table[i].pid > 0 && proc_table[i].gen != proc_gen) {
+            proc_forget(&proc_table[i]);
+        }
+    }
+    if (proc_tombstones > PROC_TABLE_SIZE / 4) proc_rehash();
+}
+
+static void top_insert(ProcEntry **top, int *count, ProcEntry *e, bool by_cpu)
+{
+    int pos = *count;
+    float key = by_cpu ? e->cpu_pct : (float)e->rss_kb;
+
+    if (key <= 0) return;
+    while (pos > 0 && key > (by_cpu ? top[pos - 1]->cpu_pct : (float)top[pos - 1]->rss_kb)) pos--;
+    if (pos >= top_n) return;
+    if (*count < top_n) (*count)++;
+    memmove(&top[pos + 1], &top[pos], sizeof(top[0]) * (size_t)(*count - 1 - pos));
+    top[pos] = e;
+}
+
+// Incremental scan with a bounded cost per tick: the previous top entries
+// are re-read every tick, then at most PROC_SCAN_BUDGET other pids are
+// refreshed round robin, each rate measured over its own interval. New pids
+// are picked up by a readdir every PROC_DISCOVER_TICKS ticks.
+void read_procs(void)
+{
+    uint64_t now_ns;
+    int i, budget;
+
+    if (top_n <= 0) return;
+    now_ns = monotonic_ns();
+    proc_tick++;
+
+    if (proc_tick % PROC_DISCOVER_TICKS == 1) proc_discover(now_ns);
+
+    for (i = 0; i < top_cpu_count; i++) {
+        if (top_cpu[i]->pid > 0 && top_cpu[i]->tick != proc_tick) proc_refresh(top_cpu[i], now_ns);
+    }
+    for (i = 0; i < top_rss_count; i++) {
+        if (top_rss[i]->pid > 0 && top_rss[i]->tick != proc_tick) proc_refresh(top_rss[i], now_ns);
+    }
+
+    budget = PROC_SCAN_BUDGET;
+    for (i = 0; i < PROC_TABLE_SIZE && budget > 0; i++) {
+        ProcEntry *e = &proc_table[proc_cursor];
+        proc_cursor = (proc_cursor + 1) & (PROC_TABLE_SIZE - 1);
+        if (e->pid <= 0 || e->tick == proc_tick) continue;
+        proc_refresh(e, now_ns);
+        budget--;
+    }
+
+    top_cpu_count = 0;
+    top_rss_count = 0;
+    for (i = 0; i < PROC_TABLE_SIZE; i++) {
+        if (proc_table[i].pid <= 0) continue;
+        top_insert(top_cpu, &top_cpu_count, &proc_table[i], true);
+        top_insert(top_rss, &top_rss_count, &proc_table[i], false);
+    }
+}
+
+static void append_proc(TxBatch *tx, const ProcEntry *e, uint8_t flags)
+{
+    TlvProc rec;
+    size_t comm_len = strlen(e->comm);
+    float pct = e->cpu_pct > 6553.5f ? 6553.5f : e->cpu_pct;
+
+    rec.pid = (uint32_t)e->pid;
+    rec.rss_kb = e->rss_kb;
+    rec.cpu = (uint16_t)(pct * 10.0f + 0.5f);
+    rec.flags = flags;
+    memcpy(rec.comm, e->comm, comm_len);
+    tlv_append(tx, TLV_PROC, &rec, (uint16_t)(offsetof(TlvProc, comm) + comm_len));
+}
+
+// Union of both top lists; a process in both is sent once with both flags
+static void append_procs(TxBatch *tx)
+{
+    int i, k;
+
+    for (i = 0; i < top_cpu_count; i++) {
+        uint8_t flags = PROC_TOP_CPU;
+        for (k = 0; k < top_rss_count; k++) {
+            if (top_rss[k] == top_cpu[i]) flags |= PROC_TOP_RSS;
+        }
+        append_proc(tx, top_cpu[i], flags);
+    }
+    for (i = 0; i < top_rss_count; i++) {
+        bool dup = false;
+        for (k = 0; k < top_cpu_count; k++) {
+            if (top_cpu[k] == top_rss[i]) dup = true;
+        }
+        if (!dup) append_proc(tx, top_rss[i], PROC_TOP_RSS);
+    }
+}
+
+void print_procs(void) {
+    int i;
+    for (i = 0; i < top_cpu_count; i++) {
+        DIAG_PRINT(" top cpu %6d %-15s %.1f %%\n", top_cpu[i]->pid, top_cpu[i]->comm,
+                   top_cpu[i]->cpu_pct);
+    }
+    for (i = 0; i < top_rss_count; i++) {
+        DIAG_PRINT(" top rss %6d %-15s %u kB\n", top_rss[i]->pid, top_rss[i]->comm,
+                   top_rss[i]->rss_kb);
+    }
+}
+
+static char cgroup_globs[512];
+static CgroupEntry cgroups[MAX_CGROUPS];
+static int cgroup_count = 0;
+static uint32_t cgroup_tick = 0;
+
+void init_cgroups(void)
+{
+    const char *env = getenv(CGROUPS_ENV);
+    if (!env || !env[0]) return;
+    snprintf(cgroup_globs, sizeof(cgroup_globs), "%s", env);
+}
+
+static int open_cgroup_file(const char *rel, const char *file)
+{
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s" CGROUP_ROOT "/%s/%s", fs_root, rel, file);
+    return open(path, O_RDONLY);
+}
+
+static void cgroup_close(CgroupEntry *cg)
+{
+    if (cg->cpu_fd >= 0) close(cg->cpu_fd);
+    if (cg->mem_fd >= 0) close(cg->mem_fd);
+    if (cg->io_fd >= 0) close(cg->io_fd);
+    cg->cpu_fd = cg->mem_fd = cg->io_fd = -1;
+}
+
+// (Re)open the files of cg->path; counters start over. Returns false when
+// none of them opens.
+static bool cgroup_open(CgroupEntry *cg, ino_t ino)
+{
+    cgroup_close(cg);
+    cg->ino = ino;
+    cg->primed = false;
+    cg->cpu_fd = open_cgroup_file(cg->path, "cpu.stat");
+    cg->mem_fd = open_cgroup_file(cg->path, "memory.current");
+    cg->io_fd = open_cgroup_file(cg->path, "io.stat");
+    return cg->cpu_fd >= 0 || cg->mem_fd >= 0 || cg->io_fd >= 0;
+}
+
+// Delta of a 64-bit cgroup counter; a decrease is a reset, not a wrap
+static uint64_t cgroup_delta(uint64_t now, uint64_t prev)
+{
+    return now >= prev ? now - prev : 0;
+}
+
+// Match the configured globs against the hierarchy. Known cgroups keep their
+// fds and counters unless the directory was re-created (service restart,
+// new inode) or their reads failed; new ones are opened; vanished ones are
+// closed. Runs at
+// startup and every CGROUP_DISCOVER_TICKS ticks, so services that start
+// later are picked up.
+static void cgroup_discover(void)
+{
+    const char *p = cgroup_globs;
+    int i;
+
+    for (i = 0; i < cgroup_count; i++) cgroups[i].seen = false;
+
+    while (*p) {
+        char pattern[PATH_MAX];
+        size_t n = strcspn(p, ":");
+        glob_t globbuf;
+        size_t k;
+
+        snprintf(pattern, sizeof(pattern), "%s" CGROUP_ROOT "/%.*s", fs_root, (int)n, p);
+        p += n;
+        if (*p == ':') p++;
+        if (glob(pattern, GLOB_ONLYDIR, NULL, &globbuf) != 0) {
+            globfree(&globbuf);
+            continue;
+        }
+        for (k = 0; k < globbuf.gl_pathc; k++) {
+            const char *rel = globbuf.gl_pathv[k] + strlen(fs_root) + strlen(CGROUP_ROOT "/");
+            const char *base = strrchr(rel, '/');
+            CgroupEntry *cg = NULL;
+            struct stat st;
+
+            if (stat(globbuf.gl_pathv[k], &st) != 0) continue;
+            for (i = 0; i < cgroup_count; i++) {
+                if (strcmp(cgroups[i].path, rel) == 0) cg = &cgroups[i];
+            }
+            if (!cg) {
+                if (cgroup_count >= MAX_CGROUPS) continue;
+                cg = &cgroups[cgroup_count];
+                memset(cg, 0, sizeof(*cg));
+                cg->cpu_fd = cg->mem_fd = cg->io_fd = -1;
+                snprintf(cg->path, sizeof(cg->path), "%s", rel);
+                snprintf(cg->stats.name, sizeof(cg->stats.name), "%s", base ? base + 1 : rel);
+                if (!cgroup_open(cg, st.st_ino)) continue;
+                cgroup_count++;
+            } else if (cg->ino != st.st_ino ||
+                       (cg->cpu_fd < 0 && cg->mem_fd < 0 && cg->io_fd < 0)) {
+                if (!cgroup_open(cg, st.st_ino)) continue;
+            }
+            cg->seen = true;
+        }
+        globfree(&globbuf);
+    }
+
+    for (i = 0; i < cgroup_count; ) {
+        if (!cgroups[i].seen) {
+            cgroup_close(&cgroups[i]);
+            cgroups[i] = cgroups[--cgroup_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+// Sum rbytes/wbytes/rios/wios over every "MAJ:MIN key=value ..." line
+static void parse_io_stat(const char *buf, uint64_t *io)
+{
+    static const char *keys[CG_IO_COUNTERS] = { "rbytes=", "wbytes=", "rios=", "wios=" };
+    const char *p = buf;
+    int k;
+
+    for (k = 0; k < CG_IO_COUNTERS; k++) io[k] = 0;
+    while (*p) {
+        const char *eol = strchr(p, '\n');
+        if (!eol) eol = p + strlen(p);
+        for (k = 0; k < CG_IO_COUNTERS; k++) {
+            const char *hit = strstr(p, keys[k]);
+            uint64_t v;
+            if (hit && hit < eol) {
+                parse_u64(hit + strlen(keys[k]), &v);
+                io[k] += v;
+            }
+        }
+        p = *eol ? eol + 1 : eol;
+    }
+}
+
+void read_cgroups(void)
+{
+    uint64_t now_ns;
+    int i;
+
+    if (!cgroup_globs[0]) return;
+    if (cgroup_tick++ % CGROUP_DISCOVER_TICKS == 0) cgroup_discover();
+    now_ns = monotonic_ns();
+
+    for (i = 0; i < cgroup_count; i++) {
+        CgroupEntry *cg = &cgroups[i];
+        char buf[1024];
+        uint64_t usage = 0, mem = 0;
+        uint64_t io[CG_IO_COUNTERS] = { 0 };
+        double secs = cg->primed ? (now_ns - cg->sample_ns) / 1e9 : 0;
+        bool failed = false;
+        int k;
+
+        // An open file that no longer reads (ENODEV once the directory is
+        // gone) fails the whole sample; the entry is reopened by the next
+        // discovery and starts over, rather than feeding zeros into a delta.
+        if (read_cached(cg->cpu_fd, buf, sizeof(buf)) >= 0) {
+            const char *u = strstr(buf, "usage_usec");
+            if (u) parse_u64(u + strlen("usage_usec"), &usage);
+        } else if (cg->cpu_fd >= 0) {
+            failed = true;
+        }
+        if (read_cached(cg->mem_fd, buf, sizeof(buf)) >= 0) parse_u64(buf, &mem);
+        else if (cg->mem_fd >= 0) failed = true;
+        if (read_cached(cg->io_fd, buf, sizeof(buf)) >= 0) parse_io_stat(buf, io);
+        else if (cg->io_fd >= 0) failed = true;
+        if (failed) {
+            cgroup_close(cg);
+            cg->primed = false;
+            cgroup_tick = 0;    // rediscover on the next tick
+            continue;
+        }
+
+        cg->stats.mem_kb = (uint32_t)(mem / 1024);
+        if (secs > 0) {
+            cg->stats.cpu_pct  = (float)(cgroup_delta(usage, cg->prev_usage_usec) / (secs * 1e4));
+            cg->stats.rd_bytes = (float)(cgroup_delta(io[CG_RBYTES], cg->prev_io[CG_RBYTES]) / secs);
+            cg->stats.wr_bytes = (float)(cgroup_delta(io[CG_WBYTES], cg->prev_io[CG_WBYTES]) / secs);
+            cg->stats.rd_ios   = (float)(cgroup_delta(io[CG_RIOS], cg->prev_io[CG_RIOS]) / secs);
+            cg->stats.wr_ios   = (float)(cgroup_delta(io[CG_WIOS], cg->prev_io[CG_WIOS]) / secs);
+        }
+        cg->prev_usage_usec = usage;
+        for (k = 0; k < CG_IO_COUNTERS; k++) cg->prev_io[k] = io[k];
+        cg->sample_ns = now_ns;
+        cg->primed = true;
+    }
+}
+
+static void append_cgroups(TxBatch *tx)
+{
+    int i;
+    for (i = 0; i < cgroup_count; i++) {
+        size_t name_len = strlen(cgroups[i].stats.name);
+        tlv_append(tx, TLV_CGROUP, &cgroups[i].stats,
+                   (uint16_t)(offsetof(TlvCgroup, name) + name_len));
+    }
+}
+
+void print_cgroups(void) {
+    int i;
+    for (i = 0; i < cgroup_count; i++) {
+        DIAG_PRINT(" %-24s cpu %.1f %% mem %u kB io %.0f/%.0f B/s\n",
+                   cgroups[i].stats.name, cgroups[i].stats.cpu_pct, cgroups[i].stats.mem_kb,
+                   cgroups[i].stats.rd_bytes, cgroups[i].stats.wr_bytes);
+    }
+}
+
+// Get the fan file name
+// If this is a Pi 5 with pwm_fan module running we will be reading the fan speed from the sysfs
+// If this is not a Pi 5, look for the pwm files updated by the pwm_fan_control2 service
+// If found, we can assume it is an Argon40 mini fan. MAx speed is 8400 rpm but that is not stored
+// We can extimate the fan speed by:
+//     ( /sys/class/pwm/pwmchip0/pwm0/duty_cycle divided by /sys/class/pwm/pwmchip0/pwm0/period ) * 8400
+//
+void get_fan_file(void)
+{
+    glob_t globbuf;
+    char path[PATH_MAX];
+    int ret = glob(rooted(FAN_GLOB, path, sizeof(path)), 0, NULL, &globbuf);
+
+    if (ret != 0 || globbuf.gl_pathc == 0) {
+        // see if ther is a pwm0 setup
+        FILE *f;
+        f = fopen(rooted("/sys/class/pwm/pwmchip0/pwm0/period", path, sizeof(path)), "r");
+        if(f) {
+            argon40_fan = true;
+            fscanf(f, "%lu", &argon40_period);
+            fclose(f);
+            snprintf(fan_file, sizeof(fan_file), "%s/sys/class/pwm/pwmchip0/pwm0/duty_cycle", fs_root);
+        }
+    } else {
+        // Use the first fan found
+        strncpy(fan_file, globbuf.gl_pathv[0], sizeof(fan_file) - 1);
+        fan_file[sizeof(fan_file) - 1] = '\0';
+    }
+    globfree(&globbuf);
+    return;
+}
+
+
+// Function to read fan speed from sysfs
+float read_fan_speed() {
+    if(!fan_file[0]) return 0.0f; // The fan file was not found in get_fan_file()
+    FILE *f;
+    uint64_t fan_speed_rpm = -1;
+    f = fopen(fan_file, "r");
+    if (!f) return 0.0f;
+    fscanf(f, "%lu", &fan_speed_rpm);
+    fclose(f);
+    if(argon40_fan)
+        fan_speed_rpm = ((float) fan_speed_rpm / (float) argon40_period) * 8400.0;
+    return (float) fan_speed_rpm;
+}
+
+// One socket per address family; the IPv6 one only exists when the kernel
+// has IPv6. Multicast groups are ordinary destinations, see open_sockets().
+typedef struct {
+    int fd4;
+    int fd6;
+} ClientSockets;
+
+static void open_sockets(ClientSockets *socks)
+{
+    const char *ttl_env = getenv(MCAST_TTL_ENV);
+
+    socks->fd4 = socket(AF_INET, SOCK_DGRAM, 0);
+    socks->fd6 = socket(AF_INET6, SOCK_DGRAM, 0);
+
+    // Multicast defaults to one hop (the local segment); routed sites can
+    // raise it. Has no effect on unicast destinations.
+    if (ttl_env && ttl_env[0]) {
+        int ttl = atoi(ttl_env);
+        if (socks->fd4 >= 0 &&
+            setsockopt(socks->fd4, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) != 0) {
+            syslog(LOG_WARNING, "IP_MULTICAST_TTL %d failed", ttl);
+        }
+        if (socks->fd6 >= 0 &&
+            setsockopt(socks->fd6, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl)) != 0) {
+            syslog(LOG_WARNING, "IPV6_MULTICAST_HOPS %d failed", ttl);
+        }
+    }
+}
+
+// sendmmsg stops at the first failing message (e.g. ECONNREFUSED from an
+// earlier ICMP error); step over it so one dead collector does not starve
+// the others.
+static void send_all(int fd, struct mmsghdr *msgs, unsigned int n)
+{
+    unsigned int sent = 0;
+
+    if (fd < 0) return;
+    while (sent < n) {
+        int r = sendmmsg(fd, msgs + sent, n - sent, 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            r = 1;
+        }
+        sent += (unsigned int)r;
+    }
+}
+
+// Every datagram of the sample to every resolved destination with one
+// sendmmsg() call per address family. Targets that have not resolved yet
+// are skipped.
+static void send_batch(const ClientSockets *socks, ServerTarget *targets, int count,
+                       const TxBatch *tx)
+{
+    static struct sockaddr_storage dest[MAX_SERVERS];
+    static struct iovec iov[MAX_DATAGRAMS];
+    static struct mmsghdr msgs4[MAX_SERVERS * MAX_DATAGRAMS];
+    static struct mmsghdr msgs6[MAX_SERVERS * MAX_DATAGRAMS];
+    unsigned int n4 = 0;
+    unsigned int n6 = 0;
+    int i, k;
+
+    for (k = 0; k < tx->count; k++) {
+        iov[k].iov_base = (void *)tx->buf[k];
+        iov[k].iov_len = tx->len[k];
+    }
+    for (i = 0; i < count; i++) {
+        socklen_t dest_len;
+        struct mmsghdr *msgs;
+        unsigned int *n;
+
+        if (!target_get(&targets[i], &dest[i], &dest_len)) continue;
+        if (dest[i].ss_family == AF_INET6) {
+            msgs = msgs6;
+            n = &n6;
+        } else {
+            msgs = msgs4;
+            n = &n4;
+        }
+        for (k = 0; k < tx->count; k++) {
+            memset(&msgs[*n], 0, sizeof(msgs[*n]));
+            msgs[*n].msg_hdr.msg_name = &dest[i];
+            msgs[*n].msg_hdr.msg_namelen = dest_len;
+            msgs[*n].msg_hdr.msg_iov = &iov[k];
+            msgs[*n].msg_hdr.msg_iovlen = 1;
+            (*n)++;
+        }
+    }
+
+    send_all(socks->fd4, msgs4, n4);
+    send_all(socks->fd6, msgs6, n6);
+}
+
+/* ---------- Shared-memory export ---------- */
+
+static PimonShm *shm_export;            // NULL when disabled or unavailable
+
+// Publish every sample to /dev/shm/pimon (layout in pimon_shm.h). Readable
+// by everyone: it holds nothing the sysfs files do not already show.
+void init_shm(void)
+{
+    const char *name = getenv(SHM_ENV);
+    void *map;
+    int fd;
+
+    if (name && (!name[0] || strcmp(name, "off") == 0)) return;
+    if (!name) name = PIMON_SHM_NAME;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        syslog(LOG_WARNING, "Shared memory %s: %s", name, strerror(errno));
+        return;
+    }
+    if (fchmod(fd, 0644) != 0 || ftruncate(fd, sizeof(PimonShm)) != 0) {
+        syslog(LOG_WARNING, "Shared memory %s: %s", name, strerror(errno));
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, sizeof(PimonShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        syslog(LOG_WARNING, "Shared memory %s: mmap failed", name);
+        return;
+    }
+    shm_export = map;
+    // A previous instance may have died mid-write and left seq odd
+    if (shm_export->seq & 1) __atomic_store_n(&shm_export->seq, shm_export->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Seqlock writer: seq goes odd, the payload is rewritten in place, seq goes
+// even again. Readers retry around the update, see pimon_shm_read().
+static void write_shm(const TelemetryPacket *pkt)
+{
+    PimonShm *s = shm_export;
+    uint32_t seq = s->seq;
+    int i;
+
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    s->magic = PIMON_SHM_MAGIC;
+    s->version = PIMON_SHM_VERSION;
+    s->size = sizeof(*s);
+    memcpy(s->client_id, pkt->client_id, sizeof(s->client_id));
+    s->timestamp = pkt->timestamp;
+    s->sample_ns = monotonic_ns();
+    s->cpu_load = pkt->cpu_load;
+    s->cpu_temp = pkt->cpu_temp;
+    s->cpu_mhz = pkt->cpu_mhz;
+    s->fan_speed = pkt->fan_speed;
+
+    s->mem_total_kb = mem_stats.mem_total_kb;
+    s->mem_avail_kb = mem_stats.mem_avail_kb;
+    s->swap_total_kb = mem_stats.swap_total_kb;
+    s->swap_used_kb = mem_stats.swap_used_kb;
+    for (i = 0; i < PSI_COUNT; i++) {
+        s->psi_some[i] = psi_valid ? psi_stats.some[i] : 0;
+        s->psi_full[i] = psi_valid ? psi_stats.full[i] : 0;
+    }
+
+    s->core_count = (uint32_t)(core_count > 0 ? core_count : 0);
+    for (i = 0; i < core_count; i++) {
+        s->cores[i].busy_pct = core_busy[i];
+        s->cores[i].mhz = core_mhz[i];
+    }
+    s->sensor_count = 0;
+    for (i = 0; i < sensor_count; i++) {
+        PimonShmSensor *sn = &s->sensors[s->sensor_count];
+        if (!sensors[i].valid) continue;
+        sn->value = sensors[i].value;
+        sn->kind = sensors[i].kind;
+        snprintf(sn->label, sizeof(sn->label), "%s", sensors[i].label);
+        s->sensor_count++;
+    }
+    s->iface_count = 0;
+    for (i = 0; i < net_iface_count; i++) {
+        PimonShmIface *nif = &s->ifaces[s->iface_count];
+        if (!net_ifaces[i].primed) continue;
+        nif->rx_bytes = net_ifaces[i].rate.rx_bytes;
+        nif->tx_bytes = net_ifaces[i].rate.tx_bytes;
+        nif->rx_packets = net_ifaces[i].rate.rx_packets;
+        nif->tx_packets = net_ifaces[i].rate.tx_packets;
+        memcpy(nif->name, net_ifaces[i].name, sizeof(nif->name));
+        s->iface_count++;
+    }
+    s->disk_count = 0;
+    for (i = 0; i < disk_count; i++) {
+        PimonShmDisk *d = &s->disks[s->disk_count];
+        if (!disks[i].primed) continue;
+        d->rd_bytes = disks[i].rate.rd_bytes;
+        d->wr_bytes = disks[i].rate.wr_bytes;
+        d->await_ms = disks[i].rate.await_ms;
+        d->util = disks[i].rate.util;
+        memcpy(d->name, disks[i].name, sizeof(d->name));
+        s->disk_count++;
+    }
+
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* ---------- Windowed statistics ---------- */
+
+static uint64_t base_interval_ns = SAMPLE_INTERVAL_NS;  // 1 / PIMON_SAMPLE_HZ
+static uint64_t send_interval_ns = SAMPLE_INTERVAL_NS;  // PIMON_SEND_SEC
+
+// P-square estimator (Jain & Chlamtac, 1985): five markers follow the
+// quantile in constant memory, whatever the number of samples
+typedef struct {
+    int n;
+    double q[5];            // marker heights, sorted
+    double pos[5];          // marker positions, 1-based
+    double want[5];         // desired positions
+} P2Quantile;
+
+static void p2_add(P2Quantile *e, double x, double p)
+{
+    int i, k;
+
+    if (e->n < 5) {
+        // Insertion sort until the markers can be placed
+        i = e->n++;
+        while (i > 0 && e->q[i - 1] > x) {
+            e->q[i] = e->q[i - 1];
+            i--;
+        }
+        e->q[i] = x;
+        if (e->n == 5) {
+            for (i = 0; i < 5; i++) e->pos[i] = i + 1;
+            e->want[0] = 1;
+            e->want[1] = 1 + 2 * p;
+            e->want[2] = 1 + 4 * p;
+            e->want[3] = 3 + 2 * p;
+            e->want[4] = 5;
+        }
+        return;
+    }
+
+    e->n++;
+    if (x < e->q[0]) {
+        e->q[0] = x;
+        k = 0;
+    } else if (x >= e->q[4]) {
+        e->q[4] = x;
+        k = 3;
+    } else {
+        k = 0;
+        while (k < 3 && x >= e->q[k + 1]) k++;
+    }
+    for (i = k + 1; i < 5; i++) e->pos[i] += 1;
+    e->want[1] += p / 2;
+    e->want[2] += p;
+    e->want[3] += (1 + p) / 2;
+    e->want[4] += 1;
+
+    // Move the middle markers towards their desired positions, parabolic
+    // interpolation when it stays monotonic, linear otherwise
+    for (i = 1; i <= 3; i++) {
+        double d = e->want[i] - e->pos[i];
+        if ((d >= 1 && e->pos[i + 1] - e->pos[i] > 1) ||
+            (d <= -1 && e->pos[i - 1] - e->pos[i] < -1)) {
+            int sgn = d > 0 ? 1 : -1;
+            double qp = e->q[i] + sgn / (e->pos[i + 1] - e->pos[i - 1]) *
+                        ((e->pos[i] - e->pos[i - 1] + sgn) * (e->q[i + 1] - e->q[i]) /
+                             (e->pos[i + 1] - e->pos[i]) +
+                         (e->pos[i + 1] - e->pos[i] - sgn) * (e->q[i] - e->q[i - 1]) /
+                             (e->pos[i] - e->pos[i - 1]));
+            if (e->q[i - 1] < qp && qp < e->q[i + 1]) {
+                e->q[i] = qp;
+            } else {
+                e->q[i] += sgn * (e->q[i + sgn] - e->q[i]) / (e->pos[i + sgn] - e->pos[i]);
+            }
+            e->pos[i] += sgn;
+        }
+    }
+}
+
+// Valid once five samples are in
+static double p2_result(const P2Quantile *e)
+{
+    return e->q[2];
+}
+
+typedef struct {
+    uint32_t count;
+    float min;
+    float max;
+    double sum;
+    float exact[WINDOW_EXACT];  // first samples, for an exact small-window p95
+    P2Quantile p95;
+} WindowStat;
+
+static int cmp_float(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank while every sample is kept, the P-square estimate beyond
+static float window_p95(WindowStat *w)
+{
+    int idx;
+
+    if (w->count > WINDOW_EXACT) return (float)p2_result(&w->p95);
+    qsort(w->exact, w->count, sizeof(w->exact[0]), cmp_float);
+    idx = (int)ceil(0.95 * w->count) - 1;
+    if (idx < 0) idx = 0;
+    return w->exact[idx];
+}
+
+static WindowStat windows[WIN_METRICS];
+static TlvWindow window_out[WIN_METRICS];
+static int window_out_count = 0;
+
+// PIMON_SAMPLE_HZ sets how often the header metrics are read, PIMON_SEND_SEC
+// how often a packet leaves; each packet summarises the samples in between
+void init_window(void)
+{
+    const char *hz_env = getenv(SAMPLE_HZ_ENV);
+    const char *send_env = getenv(SEND_SEC_ENV);
+
+    if (hz_env && hz_env[0]) {
+        double hz = atof(hz_env);
+        if (hz < 0.01) hz = 0.01;
+        if (hz > MAX_SAMPLE_HZ) hz = MAX_SAMPLE_HZ;
+        base_interval_ns = (uint64_t)(1e9 / hz);
+    }
+    if (send_env && send_env[0]) {
+        double sec = atof(send_env);
+        if (sec < 0.02) sec = 0.02;
+        send_interval_ns = (uint64_t)(sec * 1e9);
+    }
+    if (send_interval_ns < base_interval_ns) send_interval_ns = base_interval_ns;
+}
+
+static void window_add(int metric, float v)
+{
+    WindowStat *w = &windows[metric];
+
+    if (v < 0) return;      // collector has no value
+    if (w->count == 0 || v < w->min) w->min = v;
+    if (w->count == 0 || v > w->max) w->max = v;
+    w->sum += v;
+    if (w->count < WINDOW_EXACT) w->exact[w->count] = v;
+    w->count++;
+    p2_add(&w->p95, v, 0.95);
+}
+
+void read_window(const TelemetryPacket *sample)
+{
+    window_add(WIN_LOAD, sample->cpu_load);
+    window_add(WIN_TEMP, sample->cpu_temp);
+    window_add(WIN_MHZ, sample->cpu_mhz);
+    window_add(WIN_FAN, sample->fan_speed);
+}
+
+// End of a send interval: summarise, put the means in the header, restart
+static void window_close(TelemetryPacket *pkt)
+{
+    float *header[WIN_METRICS] = {
+        &pkt->cpu_load, &pkt->cpu_temp, &pkt->cpu_mhz, &pkt->fan_speed
+    };
+    int m;
+
+    window_out_count = 0;
+    for (m = 0; m < WIN_METRICS; m++) {
+        WindowStat *w = &windows[m];
+        TlvWindow *out;
+
+        if (w->count == 0) continue;
+        out = &window_out[window_out_count++];
+        out->metric = (uint8_t)m;
+        out->count = (uint16_t)(w->count > UINT16_MAX ? UINT16_MAX : w->count);
+        out->min = w->min;
+        out->max = w->max;
+        out->mean = (float)(w->sum / w->count);
+        out->p95 = window_p95(w);
+        *header[m] = out->mean;
+        memset(w, 0, sizeof(*w));
+    }
+}
+
+static void append_window(TxBatch *tx)
+{
+    int i;
+    for (i = 0; i < window_out_count; i++) {
+        tlv_append(tx, TLV_WINDOW, &window_out[i], sizeof(window_out[i]));
+    }
+}
+
+void print_window(void) {
+    int i;
+    for (i = 0; i < window_out_count; i++) {
+        DIAG_PRINT(" window %d: n %u min %.1f mean %.1f p95 %.1f max %.1f\n",
+                   window_out[i].metric, window_out[i].count, window_out[i].min,
+                   window_out[i].mean, window_out[i].p95, window_out[i].max);
+    }
+}
+
+/* ---------- Burst sampling ---------- */
+
+enum { BURST_TEMP, BURST_LOAD, BURST_MHZ, BURST_FAN, BURST_METRICS };
+
+static const char *burst_metric_names[BURST_METRICS] = { "temp", "load", "mhz", "fan" };
+
+// "<metric>[_jump](>|<)<value>": the value itself, or with _jump its change
+// over roughly the last second, crossing the threshold
+typedef struct {
+    int metric;
+    bool jump;
+    bool below;
+    float value;
+} BurstRule;
+
+static BurstRule burst_rules[MAX_BURST_RULES];
+static int burst_rule_count = 0;
+static uint64_t burst_interval_ns;
+static uint64_t burst_hold_until;       // monotonic ns
+static uint64_t burst_start_ns;         // when the current burst began
+static bool burst_spent;                // ran BURST_MAX_SEC, off until no rule matches
+static uint64_t sample_interval_ns = SAMPLE_INTERVAL_NS;    // current, burst or base
+static float burst_ref[BURST_METRICS];  // values about a second ago, for _jump
+static uint64_t burst_ref_ns;
+
+static int parse_burst_rule(const char *spec, size_t len, BurstRule *r)
+{
+    char buf[64];
+    char *op;
+    char *end;
+    int m;
+
+    if (len == 0 || len >= sizeof(buf)) return -1;
+    memcpy(buf, spec, len);
+    buf[len] = '\0';
+    op = strpbrk(buf, "<>");
+    if (!op) return -1;
+    r->below = *op == '<';
+    *op = '\0';
+    r->value = strtof(op + 1, &end);
+    if (end == op + 1) return -1;
+
+    r->jump = false;
+    if (op - buf > 5 && strcmp(op - 5, "_jump") == 0) {
+        r->jump = true;
+        op[-5] = '\0';
+    }
+    for (m = 0; m < BURST_METRICS; m++) {
+        if (strcmp(buf, burst_metric_names[m]) == 0) break;
+    }
+    if (m == BURST_METRICS) return -1;
+    r->metric = m;
+    return 0;
+}
+
+// PIMON_BURST lists the rules, comma separated; unset means no burst
+// sampling. Any matching rule switches sampling to PIMON_BURST_HZ.
+void init_burst(void)
+{
+    const char *rules = getenv(BURST_ENV);
+    const char *hz_env = getenv(BURST_HZ_ENV);
+    const char *p;
+    long hz = BURST_DEFAULT_HZ;
+
+    if (!rules || !rules[0] || strcmp(rules, "off") == 0) return;
+    if (hz_env && hz_env[0]) hz = atol(hz_env);
+    if (hz < 2) hz = 2;
+    if (hz > 100) hz = 100;
+    burst_interval_ns = 1000000000ULL / (uint64_t)hz;
+    if (burst_interval_ns > base_interval_ns) burst_interval_ns = base_interval_ns;
+    sample_interval_ns = base_interval_ns;
+
+    p = rules;
+    while (*p && burst_rule_count < MAX_BURST_RULES) {
+        size_t n = strcspn(p, ", \t");
+        if (n > 0) {
+            if (parse_burst_rule(p, n, &burst_rules[burst_rule_count]) == 0) {
+                burst_rule_count++;
+            } else {
+                syslog(LOG_WARNING, "Ignoring burst rule %.*s", (int)n, p);
+            }
+        }
+        p += n;
+        while (*p == ',' || *p == ' ' || *p == '\t') p++;
+    }
+}
+
+static float burst_metric(const TelemetryPacket *pkt, int metric)
+{
+    switch (metric) {
+    case BURST_TEMP: return pkt->cpu_temp;
+    case BURST_LOAD: return pkt->cpu_load;
+    case BURST_MHZ:  return pkt->cpu_mhz;
+    default:         return pkt->fan_speed;
+    }
+}
+
+// Interval to the next sample. A matching rule selects the burst rate and
+// holds it BURST_HOLD_SEC past the last match; after that the interval
+// doubles every sample until it is back at the base rate. A burst lasts
+// at most BURST_MAX_SEC: a condition that persists (a long build) then
+// gets the base rate until no rule matches. Rules look at the latest point
+// sample, not the window.
+static uint64_t burst_next_interval(const TelemetryPacket *pkt)
+{
+    uint64_t now = monotonic_ns();
+    bool hit = false;
+    int i;
+
+    if (burst_rule_count == 0) return base_interval_ns;
+
+    for (i = 0; i < burst_rule_count; i++) {
+        const BurstRule *r = &burst_rules[i];
+        float v = burst_metric(pkt, r->metric);
+
+        if (v < 0) continue;    // collector has no value
+        if (r->jump) {
+            if (burst_ref_ns == 0 || burst_ref[r->metric] < 0) continue;
+            v = fabsf(v - burst_ref[r->metric]);
+        }
+        if (r->below ? v < r->value : v > r->value) hit = true;
+    }
+    if (now - burst_ref_ns >= SAMPLE_INTERVAL_NS) {
+        for (i = 0; i < BURST_METRICS; i++) burst_ref[i] = burst_metric(pkt, i);
+        burst_ref_ns = now;
+    }
+
+    if (!hit) {
+        burst_spent = false;
+    } else if (burst_spent) {
+        hit = false;
+    } else if (sample_interval_ns > burst_interval_ns) {
+        burst_start_ns = now;
+    } else if (now - burst_start_ns >= BURST_MAX_SEC * 1000000000ULL) {
+        syslog(LOG_INFO, "Burst sampling capped after %d s", BURST_MAX_SEC);
+        burst_spent = true;
+        burst_hold_until = now;
+        hit = false;
+    }
+
+    if (hit) {
+        if (sample_interval_ns > burst_interval_ns) syslog(LOG_INFO, "Burst sampling started");
+        burst_hold_until = now + BURST_HOLD_SEC * 1000000000ULL;
+        sample_interval_ns = burst_interval_ns;
+    } else if (now >= burst_hold_until && sample_interval_ns < base_interval_ns) {
+        sample_interval_ns *= 2;
+        if (sample_interval_ns >= base_interval_ns) {
+            sample_interval_ns = base_interval_ns;
+            syslog(LOG_INFO, "Burst sampling ended");
+        }
+    }
+    return sample_interval_ns;
+}
+
+// Every sample is sent while the rate is raised
+static bool burst_active(void)
+{
+    return sample_interval_ns < base_interval_ns;
+}
+
+static void sleep_until(uint64_t deadline_ns)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(deadline_ns / 1000000000ULL);
+    ts.tv_nsec = (long)(deadline_ns % 1000000000ULL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+/* ---------- Self overhead ---------- */
+
+static int self_statm_fd = -1;
+static uint64_t self_cpu_prev_us;
+static uint64_t self_report_ns;         // start of the current report window
+static uint64_t self_tick_ns;           // start of the current sample
+static uint64_t self_interval_ns = SAMPLE_INTERVAL_NS;     // scheduled gap to the next one
+static uint32_t self_max_jitter_us;
+static uint32_t self_max_work_us;
+static TlvSelf self_stats;
+static bool self_ready;                 // self_stats is due to be sent
+
+static uint64_t self_cpu_us(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+           (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+void init_self(void)
+{
+    self_statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    self_cpu_prev_us = self_cpu_us();
+    self_report_ns = monotonic_ns();
+}
+
+// Start of a sample: measure how far the last interval strayed from its
+// schedule and close the report window every SELF_REPORT_SEC seconds
+void read_self(void)
+{
+    uint64_t now = monotonic_ns();
+
+    if (self_tick_ns) {
+        uint64_t period = now - self_tick_ns;
+        uint64_t jitter = period > self_interval_ns ? period - self_interval_ns
+                                                    : self_interval_ns - period;
+        if (jitter / 1000 > self_max_jitter_us) self_max_jitter_us = (uint32_t)(jitter / 1000);
+    }
+    self_tick_ns = now;
+
+    if (now - self_report_ns >= SELF_REPORT_SEC * 1000000000ULL) {
+        char buf[128];
+        uint64_t cpu = self_cpu_us();
+        uint64_t wall_us = (now - self_report_ns) / 1000;
+        unsigned long long pages = 0;
+        unsigned long long resident = 0;
+
+        if (read_cached(self_statm_fd, buf, sizeof(buf)) > 0 &&
+            sscanf(buf, "%llu %llu", &pages, &resident) == 2) {
+            self_stats.rss_kb = (uint32_t)(resident * (uint64_t)sysconf(_SC_PAGESIZE) / 1024);
+        }
+        self_stats.cpu_pct = wall_us ? (float)(cpu - self_cpu_prev_us) * 100.0f / (float)wall_us : 0;
+        self_stats.max_jitter_us = self_max_jitter_us;
+        self_stats.max_work_us = self_max_work_us;
+        self_ready = true;
+
+        self_cpu_prev_us = cpu;
+        self_report_ns = now;
+        self_max_jitter_us = 0;
+        self_max_work_us = 0;
+    }
+}
+
+// End of a sample, after everything has been sent
+static void self_work_done(void)
+{
+    uint64_t work_us = (monotonic_ns() - self_tick_ns) / 1000;
+    if (work_us > self_max_work_us) self_max_work_us = (uint32_t)work_us;
+}
+
+static void append_self(TxBatch *tx)
+{
+    if (!self_ready) return;
+    tlv_append(tx, TLV_SELF, &self_stats, sizeof(self_stats));
+    self_ready = false;     // held until a send, however many samples that takes
+}
+
+void print_self(void) {
+    if (!self_ready) return;
+    DIAG_PRINT(" self: cpu %.2f %% rss %u kB jitter %u us work %u us\n",
+               self_stats.cpu_pct, self_stats.rss_kb,
+               self_stats.max_jitter_us, self_stats.max_work_us);
+}
+
+/* ---------- Bench mode ---------- */
+
+// Syscalls made by this thread. Exact with the raw_syscalls:sys_enter
+// tracepoint when tracefs is readable (usually root); otherwise falls back
+// to /proc/self/io syscr + syscw, which only sees the read/write family.
+typedef struct {
+    int perf_fd;
+    int io_fd;
+} SyscallCounter;
+
+static void syscall_counter_open(SyscallCounter *sc)
+{
+    static const char *ids[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    };
+    char buf[32];
+    size_t i;
+
+    sc->perf_fd = -1;
+    sc->io_fd = -1;
+    for (i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+        struct perf_event_attr attr;
+
+        if (read_sysfs_line(ids[i], buf, sizeof(buf)) != 0) continue;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.size = sizeof(attr);
+        attr.config = strtoull(buf, NULL, 10);
+        attr.sample_period = 1;
+        sc->perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (sc->perf_fd >= 0) return;
+    }
+    sc->io_fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+}
+
+static uint64_t syscall_counter_read(const SyscallCounter *sc)
+{
+    char buf[512];
+    const char *p;
+    uint64_t r = 0;
+    uint64_t w = 0;
+
+    if (sc->perf_fd >= 0) {
+        uint64_t count = 0;
+        if (read(sc->perf_fd, &count, sizeof(count)) != (ssize_t)sizeof(count)) return 0;
+        return count;
+    }
+    if (read_cached(sc->io_fd, buf, sizeof(buf)) <= 0) return 0;
+    if ((p = strstr(buf, "syscr:")) != NULL) parse_u64(p + 6, &r);
+    if ((p = strstr(buf, "syscw:")) != NULL) parse_u64(p + 6, &w);
+    return r + w;
+}
+
+static void bench_cpu_load(void)  { (void)read_cpu_load(); }
+static void bench_cpu_temp(void)  { (void)read_cpu_temp(); }
+static void bench_cpu_mhz(void)   { (void)read_cpu_mhz(); }
+static void bench_fan_speed(void) { (void)read_fan_speed(); }
+static void bench_meminfo(void)   { (void)read_meminfo(); }
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} BenchCollector;
+
+// Everything the sampling loop calls; new collectors belong here too
+static const BenchCollector bench_collectors[] = {
+    { "read_cpu_load",      bench_cpu_load },
+    { "read_cpu_temp",      bench_cpu_temp },
+    { "read_cpu_mhz",       bench_cpu_mhz },
+    { "read_cpufreq_stats", read_cpufreq_stats },
+    { "read_cooling",       read_cooling },
+    { "read_fan_speed",     bench_fan_speed },
+    { "read_hwmon_sensors", read_hwmon_sensors },
+    { "read_meminfo",       bench_meminfo },
+    { "read_pressure",      read_pressure },
+    { "read_net_dev",       read_net_dev },
+    { "read_diskstats",     read_diskstats },
+    { "read_filesystems",   read_filesystems },
+    { "read_procs",         read_procs },
+    { "read_cgroups",       read_cgroups },
+    { "read_self",          read_self },
+};
+
+// Run each collector back to back for budget_ms and print ns/op and
+// syscalls/op. Collectors must be initialised first.
+static int run_bench(long budget_ms)
+{
+    SyscallCounter sc;
+    uint64_t budget_ns = (uint64_t)budget_ms * 1000000ULL;
+    size_t i;
+
+    syscall_counter_open(&sc);
+    printf("%-20s %10s %12s %12s\n", "collector", "ops", "ns/op", "syscalls/op");
+    for (i = 0; i < sizeof(bench_collectors) / sizeof(bench_collectors[0]); i++) {
+        const BenchCollector *b = &bench_collectors[i];
+        uint64_t ops = 0;
+        uint64_t sys0, sys1;
+        uint64_t start, end;
+
+        b->run();   // warm caches and cached fds
+        sys0 = syscall_counter_read(&sc);
+        start = monotonic_ns();
+        do {
+            b->run();
+            ops++;
+            end = monotonic_ns();
+        } while (end - start < budget_ns || ops < 10);
+        sys1 = syscall_counter_read(&sc);
+
+        // The counter read itself is one syscall
+        printf("%-20s %10llu %12.0f %12.2f\n", b->name, (unsigned long long)ops,
+               (double)(end - start) / (double)ops,
+               (double)(sys1 - sys0 - (sys1 > sys0 ? 1 : 0)) / (double)ops);
+    }
+    if (sc.perf_fd < 0) {
+        printf("syscalls/op counts read/write calls only (tracefs not available)\n");
+    }
+    return 0;
+}
+
+// One pass of every collector printed as stable text, for regression runs
+// against a fixture tree (PIMON_ROOT). Values that only exist as rates over
+// two samples, or that depend on the host (free space), are left out.
+static int run_dump(void)
+{
+    int i;
+
+    printf("load %.2f\n", read_cpu_load());
+    printf("temp %.1f\n", read_cpu_temp());
+    printf("mhz %.0f\n", read_cpu_mhz());
+    printf("fan %.0f\n", read_fan_speed());
+    read_cpufreq_stats();
+    read_cooling();
+    read_hwmon_sensors();
+    read_meminfo();
+    read_net_dev();
+    read_diskstats();
+    read_procs();
+    read_cgroups();
+
+    for (i = 0; i < core_count; i++) {
+        printf("core %d busy %.1f mhz %.0f\n", i, core_busy[i], core_mhz[i]);
+    }
+    for (i = 0; i < cpufreq_policy_count; i++) {
+        if (cpufreq_policies[i].stats_fd < 0) continue;
+        printf("cpufreq policy%u states %d trans %llu\n", cpufreq_policies[i].rate.policy,
+               cpufreq_policies[i].state_count,
+               (unsigned long long)cpufreq_policies[i].prev_trans);
+    }
+    for (i = 0; i < cooling_count; i++) {
+        printf("cooling %s %u/%u\n", cooling[i].stats.type,
+               cooling[i].stats.cur_state, cooling[i].stats.max_state);
+    }
+    for (i = 0; i < sensor_count; i++) {
+        printf("sensor %s kind %u value %d\n", sensors[i].label,
+               sensors[i].kind, sensors[i].valid ? sensors[i].value : -1);
+    }
+    printf("memory total %u avail %u swap %u/%u dirty %u writeback %u\n",
+           mem_stats.mem_total_kb, mem_stats.mem_avail_kb, mem_stats.swap_used_kb,
+           mem_stats.swap_total_kb, mem_stats.dirty_kb, mem_stats.writeback_kb);
+    printf("pressure %s\n", psi_fd[PSI_CPU] >= 0 ? "yes" : "no");
+    for (i = 0; i < net_iface_count; i++) printf("iface %s\n", net_ifaces[i].name);
+    for (i = 0; i < disk_count; i++) {
+        printf("disk %s life %u\n", disks[i].name, disks[i].rate.life_used);
+    }
+    for (i = 0; i < top_rss_count; i++) {
+        printf("proc %d %s rss %u\n", top_rss[i]->pid, top_rss[i]->comm, top_rss[i]->rss_kb);
+    }
+    for (i = 0; i < cgroup_count; i++) {
+        printf("cgroup %s mem %u\n", cgroups[i].stats.name, cgroups[i].stats.mem_kb);
+    }
+    return 0;
+}
+
+/* ---------- Acknowledged mode ---------- */
+
+static SpoolHeader *spool;              // NULL = fire and forget
+static unsigned char *spool_data;
+static uint64_t spool_lost;             // unacked samples overwritten
+static time_t spool_lost_logged;
+static uint64_t ack_ns;                 // when the last ack arrived
+static struct sockaddr_storage ack_addr;    // the collector that acks
+static socklen_t ack_addr_len;
+static uint64_t replay_next;            // next seq to resend
+static uint64_t replay_acked;           // spool->acked when it last moved
+static int replay_stall;                // ticks since then
+
+static const char SPOOL_MAGIC[8] = "PIMONSP1";
+
+static uint32_t spool_epoch(void)
+{
+    uint32_t e = 0;
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (read(fd, &e, sizeof(e)) != (ssize_t)sizeof(e)) e = 0;
+        close(fd);
+    }
+    if (e == 0) e = (uint32_t)time(NULL) ^ (uint32_t)getpid() ^ (uint32_t)monotonic_ns();
+    return e ? e : 1;
+}
+
+// NULL when pos is in the gap at the end of the ring too small for a record
+static SpoolRecord *spool_record(uint64_t pos)
+{
+    uint64_t phys = pos % spool->data_size;
+    if (spool->data_size - phys < sizeof(SpoolRecord)) return NULL;
+    return (SpoolRecord *)(spool_data + phys);
+}
+
+// Bytes from pos to the next record, 0 when the ring is damaged
+static uint64_t spool_step(uint64_t pos)
+{
+    uint64_t room = spool->data_size - pos % spool->data_size;
+    SpoolRecord *r = spool_record(pos);
+    if (!r) return room;
+    if (r->size < sizeof(*r) || r->size > room || (r->size & 7)) return 0;
+    return r->size;
+}
+
+// Overwriting an unacked sample gives it up: acked moves past it so the
+// collector stops waiting for it
+static bool spool_drop_oldest(void)
+{
+    SpoolRecord *r = spool_record(spool->tail);
+    uint64_t step = spool_step(spool->tail);
+
+    if (step == 0) return false;
+    if (r && r->count > 0 && r->seq > spool->acked) {
+        spool->acked = r->seq;
+        spool_lost++;
+    }
+    spool->tail += step;
+    return true;
+}
+
+// Forget everything the collector already has
+static void spool_trim(void)
+{
+    while (spool->tail < spool->head) {
+        SpoolRecord *r = spool_record(spool->tail);
+        if (r && r->count > 0 && r->seq > spool->acked) break;
+        if (!spool_drop_oldest()) {
+            spool->tail = spool->head;
+            break;
+        }
+    }
+}
+
+static bool spool_valid(uint64_t data_size)
+{
+    return memcmp(spool->magic, SPOOL_MAGIC, sizeof(SPOOL_MAGIC)) == 0 &&
+           spool->version == 1 &&
+           spool->epoch != 0 &&
+           spool->data_size == data_size &&
+           spool->tail <= spool->head &&
+           spool->head - spool->tail <= data_size &&
+           spool->next_seq > 0 &&
+           spool->acked < spool->next_seq;
+}
+
+// PIMON_SPOOL names the spool file and turns acknowledged mode on. The file
+// is mapped shared and never fsync()ed: samples survive a client or
+// collector restart, a power cut may lose the last few seconds.
+static void init_spool(void)
+{
+    const char *path = getenv(SPOOL_ENV);
+    const char *kb_env = getenv(SPOOL_KB_ENV);
+    uint64_t data_size = SPOOL_DEFAULT_KB * 1024ULL;
+    size_t map_len;
+    void *map;
+    int fd;
+
+    if (!path || !path[0]) return;
+    if (kb_env && kb_env[0]) {
+        long kb = atol(kb_env);
+        if (kb < SPOOL_MIN_KB) kb = SPOOL_MIN_KB;
+        data_size = (uint64_t)kb * 1024;
+    }
+    map_len = SPOOL_DATA_OFF + data_size;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Spool %s: %s, acknowledged mode off", path, strerror(errno));
+        return;
+    }
+    if (ftruncate(fd, (off_t)map_len) != 0) {
+        syslog(LOG_ERR, "Spool %s: %s, acknowledged mode off", path, strerror(errno));
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "Spool %s: mmap failed, acknowledged mode off", path);
+        return;
+    }
+    spool = map;
+    spool_data = (unsigned char *)map + SPOOL_DATA_OFF;
+
+    if (!spool_valid(data_size)) {
+        memset(spool, 0, sizeof(*spool));
+        memcpy(spool->magic, SPOOL_MAGIC, sizeof(SPOOL_MAGIC));
+        spool->version = 1;
+        spool->epoch = spool_epoch();
+        spool->data_size = data_size;
+        spool->next_seq = 1;
+        syslog(LOG_INFO, "Spool %s: new, %llu kB", path,
+               (unsigned long long)(data_size / 1024));
+    } else {
+        syslog(LOG_INFO, "Spool %s: resuming at sample %llu, %llu unacknowledged", path,
+               (unsigned long long)spool->next_seq,
+               (unsigned long long)(spool->next_seq - 1 - spool->acked));
+    }
+    replay_next = spool->acked + 1;
+    replay_acked = spool->acked;
+}
+
+// Must be the first record after tx_begin(): spool_append() finds the
+// flags byte at a fixed offset
+static void append_sequence(TxBatch *tx)
+{
+    TlvSequence seq = {0};
+
+    seq.seq = spool->next_seq;
+    seq.acked = spool->acked;
+    seq.epoch = spool->epoch;
+    seq.flags = 0;
+    tlv_append(tx, TLV_SEQUENCE, &seq, offsetof(TlvSequence, flags) + 1);
+}
+
+static void spool_append(const TxBatch *tx)
+{
+    const size_t flags_off = sizeof(TelemetryPacket) + sizeof(TelemetryTlv) +
+                             offsetof(TlvSequence, flags);
+    uint64_t size = sizeof(SpoolRecord);
+    uint64_t gap;
+    uint64_t lost = spool_lost;
+    SpoolRecord *r;
+    unsigned char *p;
+    int k;
+
+    for (k = 0; k < tx->count; k++) size += tx->len[k];
+    size = (size + 7) & ~7ULL;
+
+    // Records do not wrap; skip the end of the ring when it is too short
+    gap = spool->data_size - spool->head % spool->data_size;
+    if (gap >= size) gap = 0;
+    while (spool->head + gap + size - spool->tail > spool->data_size) {
+        if (spool->tail >= spool->head || !spool_drop_oldest()) {
+            syslog(LOG_WARNING, "Spool damaged, discarding unacknowledged samples");
+            spool->tail = spool->head;
+            spool->acked = spool->next_seq - 1;
+            break;
+        }
+    }
+    if (spool_lost != lost && time(NULL) - spool_lost_logged >= 60) {
+        spool_lost_logged = time(NULL);
+        syslog(LOG_WARNING, "Spool full, %llu unacknowledged samples dropped so far",
+               (unsigned long long)spool_lost);
+    }
+    if (gap) {
+        r = spool_record(spool->head);
+        if (r) {
+            r->size = (uint32_t)gap;
+            r->count = 0;
+            r->seq = 0;
+        }
+        spool->head += gap;
+    }
+
+    r = (SpoolRecord *)(spool_data + spool->head % spool->data_size);
+    p = (unsigned char *)(r + 1);
+    for (k = 0; k < tx->count; k++) {
+        memcpy(p, tx->buf[k], tx->len[k]);
+        r->len[k] = (uint16_t)tx->len[k];
+        p += tx->len[k];
+    }
+    // The spooled copy is only ever sent again as a replay
+    ((unsigned char *)(r + 1))[flags_off] |= SEQ_REPLAY;
+    r->count = (uint16_t)tx->count;
+    r->seq = spool->next_seq;
+    r->size = (uint32_t)size;
+
+    // Header last, so a crash mid-copy leaves the previous state intact
+    spool->head += size;
+    spool->next_seq++;
+}
+
+// Acks come back to whichever socket sent the sample. The collector that
+// sent the newest ack receives the replays.
+static void poll_acks(const ClientSockets *socks, const char *client_id)
+{
+    int fds[2] = { socks->fd4, socks->fd6 };
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (fds[i] < 0) continue;
+        while (1) {
+            AckPacket ack;
+            struct sockaddr_storage from;
+            socklen_t from_len = sizeof(from);
+            ssize_t n = recvfrom(fds[i], &ack, sizeof(ack), MSG_DONTWAIT,
+                                 (struct sockaddr *)&from, &from_len);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (n != (ssize_t)sizeof(ack) || ack.magic != ACK_MAGIC ||
+                ack.epoch != spool->epoch ||
+                strncmp(ack.client_id, client_id, CLIENT_ID_LEN) != 0) {
+                continue;
+            }
+            if (ack.acked >= spool->next_seq) ack.acked = spool->next_seq - 1;
+            if (ack.acked > spool->acked) spool->acked = ack.acked;
+            ack_ns = monotonic_ns();
+            ack_addr = from;
+            ack_addr_len = from_len;
+        }
+    }
+    spool_trim();
+}
+
+// Resend up to SPOOL_REPLAY_BATCH unacked samples older than the one just
+// sent, but only while a collector is acking: nobody would keep them
+// otherwise. When the ack point stalls the batch is assumed lost and the
+// range is sent again from there.
+static void replay_spool(const ClientSockets *socks)
+{
+    static struct iovec iov[SPOOL_REPLAY_BATCH * MAX_DATAGRAMS];
+    static struct mmsghdr msgs[SPOOL_REPLAY_BATCH * MAX_DATAGRAMS];
+    uint64_t live = spool->next_seq - 1;
+    uint64_t pos;
+    unsigned int n = 0;
+    int records = 0;
+    int fd;
+
+    if (ack_ns == 0 || monotonic_ns() - ack_ns > ACK_LIVE_SEC * 1000000000ULL) return;
+
+    if (spool->acked != replay_acked) {
+        replay_acked = spool->acked;
+        replay_stall = 0;
+    } else if (replay_next > spool->acked + 1 && ++replay_stall >= SPOOL_RETRY_TICKS) {
+        replay_next = spool->acked + 1;
+        replay_stall = 0;
+    }
+    if (replay_next <= spool->acked) replay_next = spool->acked + 1;
+    if (replay_next >= live) return;
+
+    fd = ack_addr.ss_family == AF_INET6 ? socks->fd6 : socks->fd4;
+    if (fd < 0) return;
+
+    for (pos = spool->tail; pos < spool->head && records < SPOOL_REPLAY_BATCH; ) {
+        uint64_t step = spool_step(pos);
+        SpoolRecord *r = spool_record(pos);
+
+        if (step == 0) break;
+        if (r && r->count > 0 && r->seq >= replay_next && r->seq < live) {
+            unsigned char *p = (unsigned char *)(r + 1);
+            int k;
+            for (k = 0; k < r->count && k < MAX_DATAGRAMS; k++) {
+                iov[n].iov_base = p;
+                iov[n].iov_len = r->len[k];
+                p += r->len[k];
+                memset(&msgs[n], 0, sizeof(msgs[n]));
+                msgs[n].msg_hdr.msg_name = &ack_addr;
+                msgs[n].msg_hdr.msg_namelen = ack_addr_len;
+                msgs[n].msg_hdr.msg_iov = &iov[n];
+                msgs[n].msg_hdr.msg_iovlen = 1;
+                n++;
+            }
+            replay_next = r->seq + 1;
+            records++;
+        }
+        pos += step;
+    }
+    send_all(fd, msgs, n);
+}
+
+/* ---------- Main ---------- */
+
+static void init_collectors(void)
+{
+    get_fan_file();
+    init_cpufreq();
+    init_cooling();
+    init_hwmon_sensors();
+    init_memory();
+    init_mounts();
+    init_procs();
+    init_cgroups();
+    init_self();
+    init_window();
+    init_burst();
+}
+
+int main(int argc, char **argv) {
+    DIAG_PRINT("Starting client UDP broadcaster\n");
+
+    static ServerTarget servers[MAX_SERVERS];
+    int server_count = 0;
+
+    openlog("PiMon_Client", LOG_PID | LOG_CONS, LOG_DAEMON);
+
+    init_root();
+
+    // --bench [ms]: time every collector instead of sending
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        long budget_ms = argc > 2 ? atol(argv[2]) : BENCH_DEFAULT_MS;
+        int rc;
+        init_collectors();
+        rc = run_bench(budget_ms > 0 ? budget_ms : BENCH_DEFAULT_MS);
+        closelog();
+        return rc;
+    }
+    // --dump: print one pass of every collector, see fixtures/run.sh
+    if (argc > 1 && strcmp(argv[1], "--dump") == 0) {
+        int rc;
+        init_collectors();
+        rc = run_dump();
+        closelog();
+        return rc;
+    }
+
+    // Every sample goes to all destinations: argv entries, or the
+    // PIMON_SERVER_IP list when no arguments are given
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) parse_targets(argv[i], servers, &server_count);
+    } else if (getenv(SERVER_ENV)) {
+        parse_targets(getenv(SERVER_ENV), servers, &server_count);
+    }
+    if (server_count == 0) {
+        fprintf(stderr, "Usage: %s <server>[:port] [<server>[:port] ...]\n", argv[0]);
+        fprintf(stderr, "A server may be an IPv6 literal ([addr]:port) or a multicast group.\n");
+        fprintf(stderr, "Or set %s in the environment (comma separated).\n", SERVER_ENV);
+        fprintf(stderr, "%s --bench [ms] times each collector, --dump prints one pass.\n", argv[0]);
+        closelog();
+        return 1;
+    }
+
+    for (int i = 0; i < server_count; i++) {
+        syslog(LOG_ERR, "Server: %s port %d", servers[i].host, servers[i].port);
+    }
+
+    ClientSockets socks;
+    open_sockets(&socks);
+
+    for (int i = 0; i < server_count; i++) {
+        if (start_resolver(&servers[i]) != 0) {
+            syslog(LOG_ERR, "Unable to start resolver thread");
+            closelog();
+            return 1;
+        }
+    }
+
+    TelemetryPacket pkt = {0};
+    static TxBatch tx;
+    gethostname(pkt.client_id, CLIENT_ID_LEN);
+    init_collectors();
+    init_spool();
+    init_shm();
+
+    syslog(LOG_ERR,"Entering main loop");
+
+    uint64_t next_ns = monotonic_ns();
+    uint64_t send_due_ns = next_ns;
+    uint64_t full_ns = 0;
+    TelemetryPacket sample = pkt;
+
+    while (1) {
+        time_t now = time(NULL);
+        bool full;
+        bool due;
+
+        // Header metrics every sample; they feed the window and the export
+        read_self();
+        sample.cpu_load  = read_cpu_load();
+        sample.cpu_temp  = read_cpu_temp();
+        sample.cpu_mhz   = read_cpu_mhz();
+        sample.fan_speed = read_fan_speed();
+        sample.timestamp = (uint64_t)now;
+        read_window(&sample);
+        if (shm_export) write_shm(&sample);
+
+        // Everything else only when a packet leaves: every send interval,
+        // or every sample while a burst rule matches
+        due = monotonic_ns() >= send_due_ns;
+        if (due || burst_active()) {
+            // Process, cgroup and filesystem scans stay at about 1 Hz in a burst
+            full = monotonic_ns() - full_ns >= SAMPLE_INTERVAL_NS * 9 / 10;
+            read_cpufreq_stats();
+            read_cooling();
+            read_hwmon_sensors();
+            read_meminfo();
+            read_pressure();
+            read_net_dev();
+            read_diskstats();
+            if (full) {
+                read_filesystems();
+                read_procs();
+                read_cgroups();
+                full_ns = monotonic_ns();
+            }
+            pkt = sample;
+            window_close(&pkt);
+
+            print_packet(&pkt);
+            print_window();
+            print_cores();
+            print_cpufreq_stats();
+            print_cooling();
+            print_sensors();
+            print_memory();
+            print_net();
+            print_disks();
+            print_procs();
+            print_cgroups();
+            print_self();
+
+            if (spool) poll_acks(&socks, pkt.client_id);
+
+            tx_begin(&tx, &pkt);
+            if (spool) append_sequence(&tx);
+            append_window(&tx);
+            append_cpu_cores(&tx);
+            append_cpufreq_stats(&tx);
+            append_cooling(&tx);
+            append_memory(&tx);
+            append_net(&tx);
+            append_disks(&tx);
+            append_procs(&tx);
+            append_cgroups(&tx);
+            append_sensors(&tx);
+            append_self(&tx);
+
+            if (spool) spool_append(&tx);
+
+            send_batch(&socks, servers, server_count, &tx);
+            if (spool) replay_spool(&socks);
+
+            // A burst send restarts the schedule from now; adding to it would
+            // push the next regular send one interval further per burst sample
+            if (due) {
+                send_due_ns += send_interval_ns;
+                if (send_due_ns < monotonic_ns()) send_due_ns = monotonic_ns() + send_interval_ns;
+            } else {
+                send_due_ns = monotonic_ns() + send_interval_ns;
+            }
+        }
+        self_work_done();
 
-        sleep(1);
+        // Fixed schedule; after an overrun start again from now, no catch-up
+        self_interval_ns = burst_next_interval(&sample);
+        next_ns += self_interval_ns;
+        if (next_ns < monotonic_ns()) next_ns = monotonic_ns();
+        sleep_until(next_ns);
     }
     closelog();
     return 0;
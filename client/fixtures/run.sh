@@ -0,0 +1,66 @@
+#!/bin/sh
+# Collector regression and benchmark runs against the fixture trees in this
+# directory (one per board layout, used as PIMON_ROOT).
+#
+#   ./run.sh [check]             diff --dump output with <board>/expected.txt
+#   ./run.sh update              rewrite expected.txt after an intended change
+#   ./run.sh bench [ms]          --bench per board, results in $BENCH_DIR;
+#                                compared with $BASELINE_DIR when it has results
+#
+# PIMON_CLIENT selects the binary (default ../PiMon_Client). Process RSS is
+# in host pages, so expected.txt assumes 4 kB pages (x86, arm64 4k kernels).
+
+here=$(cd "$(dirname "$0")" && pwd)
+client=${PIMON_CLIENT:-$here/../PiMon_Client}
+mode=${1:-check}
+boards="pi4 pi5 argon40"
+BENCH_DIR=${BENCH_DIR:-/tmp/pimon-bench}
+
+PIMON_TOP_N=3
+PIMON_CGROUPS='system.slice/*.service'
+PIMON_MOUNTS=/
+export PIMON_TOP_N PIMON_CGROUPS PIMON_MOUNTS
+
+if [ ! -x "$client" ]; then
+    echo "no client binary at $client (make compile, or set PIMON_CLIENT)" >&2
+    exit 2
+fi
+
+status=0
+case "$mode" in
+check|update)
+    for b in $boards; do
+        out=$(PIMON_ROOT="$here/$b" "$client" --dump)
+        if [ "$mode" = update ]; then
+            printf '%s\n' "$out" > "$here/$b/expected.txt"
+            echo "$b: updated"
+        elif printf '%s\n' "$out" | diff -u "$here/$b/expected.txt" - ; then
+            echo "$b: ok"
+        else
+            echo "$b: FAILED"
+            status=1
+        fi
+    done
+    ;;
+bench)
+    mkdir -p "$BENCH_DIR" || exit 2
+    for b in $boards; do
+        PIMON_ROOT="$here/$b" "$client" --bench ${2:-200} > "$BENCH_DIR/$b.txt" || status=1
+        echo "== $b"
+        if [ -n "$BASELINE_DIR" ] && [ -f "$BASELINE_DIR/$b.txt" ]; then
+            # ns/op against the baseline; negative is faster
+            awk 'NR == FNR { if ($3 + 0 > 0) base[$1] = $3; next }
+                 FNR == 1 { printf "%-20s %12s %12s %8s\n", "collector", "base ns/op", "ns/op", "change"; next }
+                 $1 in base { printf "%-20s %12.0f %12.0f %+7.1f%%\n", $1, base[$1], $3, ($3 - base[$1]) * 100 / base[$1]; next }
+                 { print }' "$BASELINE_DIR/$b.txt" "$BENCH_DIR/$b.txt"
+        else
+            cat "$BENCH_DIR/$b.txt"
+        fi
+    done
+    ;;
+*)
+    echo "usage: $0 [check|update|bench [ms]]" >&2
+    exit 2
+    ;;
+esac
+exit $status
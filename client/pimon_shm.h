@@ -0,0 +1,115 @@
+// Layout of the PiMon_Client shared-memory export.
+//
+// The client rewrites one PimonShm in the POSIX shared memory object
+// PIMON_SHM_NAME (/dev/shm/pimon) after every sample. Local programs (fan
+// controllers, status pages) map it read-only and copy the latest sample
+// with pimon_shm_read(): no syscalls per read and no second poller of the
+// same sysfs files.
+//
+//     int fd = shm_open(PIMON_SHM_NAME, O_RDONLY, 0);
+//     const PimonShm *shm = mmap(NULL, sizeof(PimonShm), PROT_READ, MAP_SHARED, fd, 0);
+//     PimonShm snap;
+//     if (pimon_shm_read(shm, &snap) == 0) use(snap.cpu_temp);
+//
+// Concurrency is a seqlock: seq is odd while the client writes. Readers copy
+// the whole struct and retry when seq was odd or changed meanwhile. Fields
+// are host byte order. Fields may be appended in later versions; size is
+// sizeof(PimonShm) as written by the client and readers must check magic.
+// Absent values are -1 (floats) or a count of 0.
+
+#ifndef PIMON_SHM_H
+#define PIMON_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PIMON_SHM_NAME "/pimon"
+#define PIMON_SHM_MAGIC 0x4d485350u     // "PSHM"
+#define PIMON_SHM_VERSION 1
+#define PIMON_SHM_CPUS 64
+#define PIMON_SHM_SENSORS 32
+#define PIMON_SHM_IFACES 8
+#define PIMON_SHM_DISKS 8
+#define PIMON_SHM_LABEL_LEN 24
+#define PIMON_SHM_NAME_LEN 16
+
+typedef struct {
+    float busy_pct;
+    float mhz;
+} PimonShmCore;
+
+typedef struct {
+    int32_t value;          // m°C, rpm, mV or µW by kind
+    uint8_t kind;           // 1 temp, 2 fan, 3 in, 4 power
+    char    label[PIMON_SHM_LABEL_LEN];     // "<chip>:<label>", terminated
+} PimonShmSensor;
+
+typedef struct {
+    float rx_bytes;         // per second over the last interval
+    float tx_bytes;
+    float rx_packets;
+    float tx_packets;
+    char  name[PIMON_SHM_NAME_LEN];
+} PimonShmIface;
+
+typedef struct {
+    float   rd_bytes;       // per second over the last interval
+    float   wr_bytes;
+    float   await_ms;
+    uint8_t util;           // % busy
+    char    name[PIMON_SHM_NAME_LEN];
+} PimonShmDisk;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t seq;           // seqlock, odd while the client writes
+
+    char     client_id[32];
+    uint64_t timestamp;     // Unix seconds of the sample
+    uint64_t sample_ns;     // CLOCK_MONOTONIC of the sample
+    float    cpu_load;      // %
+    float    cpu_temp;      // °C
+    float    cpu_mhz;       // cpu0
+    float    fan_speed;     // rpm
+
+    uint32_t mem_total_kb;
+    uint32_t mem_avail_kb;
+    uint32_t swap_total_kb;
+    uint32_t swap_used_kb;
+    uint16_t psi_some[3];   // cpu, memory, io stall share, 0.01 %
+    uint16_t psi_full[3];
+
+    uint32_t core_count;
+    uint32_t sensor_count;
+    uint32_t iface_count;
+    uint32_t disk_count;
+    PimonShmCore   cores[PIMON_SHM_CPUS];
+    PimonShmSensor sensors[PIMON_SHM_SENSORS];
+    PimonShmIface  ifaces[PIMON_SHM_IFACES];
+    PimonShmDisk   disks[PIMON_SHM_DISKS];
+} PimonShm;
+
+// Consistent copy of the latest sample. Returns 0 on success, -1 when the
+// segment is not (yet) a PiMon export or the writer kept it busy.
+static inline int pimon_shm_read(const PimonShm *shm, PimonShm *out)
+{
+    int tries;
+
+    for (tries = 0; tries < 1000; tries++) {
+        uint32_t s1 = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        uint32_t s2;
+
+        if (s1 & 1) continue;
+        memcpy(out, (const void *)shm, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        s2 = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+        if (s1 != s2) continue;
+        if (out->magic != PIMON_SHM_MAGIC || out->version != PIMON_SHM_VERSION) return -1;
+        return 0;
+    }
+    return -1;
+}
+
+#endif
@@ -21,6 +21,7 @@
 #define MAX_SAMPLES 2
 #define CLIENT_ID_LEN 32
 #define OFFLINE_SECS 30
+#define MAX_PACKET 1400
 #define IDI_APPICON 101
 
 typedef struct {
@@ -726,12 +727,13 @@ static void update_offline_state(HWND hwnd) {
 
 DWORD WINAPI recv_thread(LPVOID arg) {
     TelemetryPacket pkt;
+    char buf[MAX_PACKET];   // newer clients append extension records
     struct sockaddr_in from;
     int fromlen = sizeof(from);
     SOCKET sock = *(SOCKET*)arg;
 
     while (InterlockedCompareExchange(&g_running, 1, 1)) {
-        int n = recvfrom(sock, (char*)&pkt, sizeof(pkt), 0,
+        int n = recvfrom(sock, buf, sizeof(buf), 0,
                          (struct sockaddr*)&from, &fromlen);
         if (!InterlockedCompareExchange(&g_running, 1, 1))
             break;
@@ -741,7 +743,14 @@ DWORD WINAPI recv_thread(LPVOID arg) {
                 break;
             continue;
         }
-        if (n <= 0) continue;
+        if (n < (int)sizeof(pkt)) continue;
+        // Extra datagrams of an oversized sample start with a type 0
+        // (continuation) record; they repeat the header, skip them.
+        if (n >= (int)sizeof(pkt) + 4 &&
+            buf[sizeof(pkt)] == 0 && buf[sizeof(pkt) + 1] == 0)
+            continue;
+        memcpy(&pkt, buf, sizeof(pkt));
+        pkt.client_id[CLIENT_ID_LEN - 1] = '\0';
 
         ClientData *c = get_client(pkt.client_id);
         if (!c) continue;
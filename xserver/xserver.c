@@ -1,28 +1,98 @@
 /*
  * PiMon X11 server.
  *
- * Listens on UDP port 5000, renders telemetry with Xlib, provides an Edit
- * menu, clipboard copy, and simple preferences persistence.
+ * Listens on UDP port 5000 (IPv4 and IPv6, optionally a multicast group
+ * named by PIMON_MCAST_GROUP / PIMON_MCAST_IF), renders telemetry with Xlib,
+ * provides an Edit menu, clipboard copy, and simple preferences persistence.
+ *
+ * With PIMON_RELAY=host[:port] it runs headless as a site relay instead:
+ * same ingest, but every PIMON_RELAY_SEC seconds the clients seen are
+ * summarised and forwarded upstream in a few batched datagrams, tagged with
+ * PIMON_SITE. The collector upstream shows them as "site/client" rows.
+ *
+ * PIMON_RECV_THREADS=N starts N receiver threads, each with its own
+ * SO_REUSEPORT socket. The client table is split into N shards by a hash of
+ * client_id and site, so a client has one entry whichever thread reads it.
+ * PIMON_RECV=uring receives through io_uring (multishot recvmsg into a
+ * provided buffer ring) where the kernel supports it, recvfrom() otherwise.
+ * "xserver --bench-recv [packets]" compares the two on loopback.
+ *
+ * Every datagram first passes a token bucket for its source address
+ * (PIMON_FLOOD_SRC_PPS) and one for its client_id (PIMON_FLOOD_ID_PPS);
+ * excess is dropped before any shared state is touched, and counted. The
+ * client_id bucket counts samples: the first datagram decides, and its
+ * continuations follow that decision.
+ *
+ * PIMON_CAPTURE=file records every admitted datagram with its kernel
+ * receive time and source address. "xserver --replay file" plays such a
+ * capture back through the same ingest at the recorded pace, with the
+ * window showing the recorded time; "--replay-fast file" does it headless
+ * as fast as possible, then prints the throughput and the resulting table.
+ *
+ * Each client's load, temperature, MHz, fan, available memory and stall
+ * keep an EWMA baseline; a sample more than PIMON_ANOMALY_Z deviations off
+ * it highlights the row and prints an "anomaly" event line on stdout.
+ *
+ * The fleet panel above the table (online/offline, temperature and load
+ * percentiles, hottest hosts) comes from per-shard histograms updated as
+ * samples arrive, merged on redraw; the client table is never rescanned.
+ *
+ * "Heatmap view" in the Edit menu (key h) swaps the table for one colored
+ * cell per client, by temperature or load (key m), drawn into a client-side
+ * XImage and sent with one XPutImage, through MIT-SHM when the server is
+ * local. Clicking a cell shows that client's row and details below.
  */
 
+#define _DEFAULT_SOURCE     /* struct ip_mreqn alongside _POSIX_C_SOURCE */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <limits.h>
+#include <math.h>
+#include <net/if.h>
+#include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
 
+/* Multishot recvmsg and provided buffer rings arrived with Linux 6.0
+ * headers; older build hosts get the recvfrom() path only */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define HAVE_URING_RECV 1
+#endif
+
+/* MIT-SHM for the heatmap image; without the header it goes by XPutImage */
+#if defined(__has_include)
+#if __has_include(<X11/extensions/XShm.h>)
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#define HAVE_XSHM 1
+#endif
+#endif
+
 #if DEBUG
 #define DBG_PRINT(...)                  \
     do {                                \
@@ -35,12 +105,63 @@
 
 #define PORT            5000
 #define MAX_LINE        1024
+#define IP_COL_W        25      /* room for most IPv6 addresses */
+#define MAX_PACKET      1400
+#define MAX_CPUS        64
+#define MAX_SENSORS     32
+#define SENSOR_LABEL_LEN 24
+#define MAX_IFACES      8
+#define IFACE_NAME_LEN  16
+#define MAX_DISKS       8
+#define DISK_NAME_LEN   16
+#define MAX_MOUNTS      8
+#define MOUNT_PATH_LEN  32
+#define MAX_PROCS       20
+#define COMM_LEN        16
+#define MAX_CGROUPS     16
+#define CGROUP_NAME_LEN 32
+#define MAX_FREQ_POLICIES 4
+#define MAX_FREQ_STATES 32
+#define MAX_COOLING     8
+#define COOLING_TYPE_LEN 20
 #define CLIENT_ID_LEN   32
-#define MAX_CLIENTS     32
+#define SITE_LEN        16
+#define RELAY_DEFAULT_SEC 5
+#define RELAY_RECORD_MAX 256    /* one summarised client, see relay_record() */
+#define URING_ENTRIES   8
+#define URING_CQ_ENTRIES 1024
+#define URING_BUFS      256     /* provided receive buffers, power of two */
+#define URING_BGID      1
+#define RECV_BENCH_DEFAULT 200000
+#define RECV_BENCH_SENDERS 16
+#define FLOOD_SLOTS     1024    /* per shard and key kind, power of two */
+#define FLOOD_PROBE     8
+#define FLOOD_SRC_PPS   500     /* default per source address */
+#define FLOOD_ID_PPS    200     /* default per client_id, in samples; the
+                                   client sends at most 100 a second */
+#define FLOOD_ID_CONT   3       /* continuations one admitted sample may add */
+#define FLOOD_BURST_SEC 2       /* bucket depth in seconds of rate */
+#define CAPTURE_BUF     (256 * 1024)    /* stdio buffer of the capture file */
+#define RX_CMSG_SPACE   CMSG_SPACE(sizeof(struct timespec))
+#define ANOMALY_Z       4.0f    /* default PIMON_ANOMALY_Z */
+#define ANOMALY_ALPHA   0.05f   /* EWMA weight, about the last 20 samples */
+#define ANOMALY_WARMUP  20      /* samples before a baseline may flag */
+#define FLEET_TEMP_BUCKETS 256 /* 0.5 C wide from 0 C */
+#define FLEET_TEMP_WIDTH 0.5f
+#define FLEET_LOAD_BUCKETS 200 /* 0.5 % wide */
+#define FLEET_LOAD_WIDTH 0.5f
+#define FLEET_TOP       5       /* hottest hosts shown */
+#define SEQ_WINDOW      256     /* samples tracked beyond the cumulative ack */
+#define AGENT_CPU_WARN  5.0f    /* % of one core spent by the client itself */
+#define AGENT_JITTER_WARN_US 250000
+#define MAX_CLIENTS     8192    /* per receiver shard; the table grows to it */
+#define CLIENT_HASH     4096    /* lookup chains per shard, power of two */
+#define CLIENT_GROW     64      /* first allocation of a shard's table */
+#define MAX_SHARDS      8
 #define MAX_SAMPLES     2
 #define OFFLINE_SECS    30
 #define UI_TIMER_SECS   10
-#define WINDOW_W        900
+#define WINDOW_W        1060
 #define WINDOW_H        600
 
 #define MENU_BAR_H      24
@@ -49,6 +170,13 @@
 #define MENU_DROP_W     180
 #define MENU_ITEM_H     22
 
+#define HEAT_COLORS     64      /* palette steps from cool to hot */
+#define HEAT_CELL_MIN   6
+#define HEAT_CELL_MAX   48
+#define HEAT_TEMP_LO    30.0f   /* C at the cool end */
+#define HEAT_TEMP_HI    85.0f
+#define HEAT_DETAIL_LINES 14    /* kept free under the grid */
+
 #define PREF_W          360
 #define PREF_H          150
 
@@ -61,21 +189,390 @@ typedef struct {
     uint64_t timestamp;
 } TelemetryPacket;
 
+/* Extension records that may follow the fixed header (see client.c) */
+typedef struct {
+    uint16_t type;
+    uint16_t len;
+} TelemetryTlv;
+
+enum {
+    TLV_CONTINUATION = 0,   /* leads the extra datagrams of one sample */
+    TLV_CPU_CORES = 1,
+    TLV_SENSOR    = 2,
+    TLV_MEMORY    = 3,
+    TLV_PRESSURE  = 4,
+    TLV_NET_IFACE = 5,
+    TLV_DISK      = 6,
+    TLV_FS        = 7,
+    TLV_PROC      = 8,
+    TLV_CGROUP    = 9,
+    TLV_SEQUENCE  = 10,
+    TLV_SELF      = 11,
+    TLV_WINDOW    = 12,
+    TLV_FREQ      = 13,
+    TLV_COOLING   = 14,
+    TLV_SITE      = 15      /* relay records only: site name, not terminated */
+};
+
+/* Header metrics in TlvWindow.metric */
+enum { WIN_LOAD, WIN_TEMP, WIN_MHZ, WIN_FAN, WIN_METRICS };
+
+/* Baselined metrics: the header ones, then two from the records */
+enum { ANOM_MEM = WIN_METRICS, ANOM_STALL, ANOM_METRICS };
+
+enum {
+    SEQ_REPLAY = 0x01       /* resent from the client's spool */
+};
+
+enum {
+    PROC_TOP_CPU = 0x01,
+    PROC_TOP_RSS = 0x02
+};
+
+enum {
+    SENSOR_TEMP  = 1,       /* millidegree Celsius */
+    SENSOR_FAN   = 2,       /* RPM */
+    SENSOR_IN    = 3,       /* millivolt */
+    SENSOR_POWER = 4        /* microwatt */
+};
+
+typedef struct {
+    uint16_t busy;          /* 0.01 % units */
+    uint16_t mhz;
+} TlvCpuCore;
+
+typedef struct {
+    int32_t value;
+    uint8_t kind;
+    char    label[SENSOR_LABEL_LEN];
+} TlvSensor;
+
+typedef struct {
+    uint32_t mem_total_kb;
+    uint32_t mem_avail_kb;
+    uint32_t swap_total_kb;
+    uint32_t swap_used_kb;
+    uint32_t dirty_kb;
+    uint32_t writeback_kb;
+} TlvMemory;
+
+enum { PSI_CPU = 0, PSI_MEMORY = 1, PSI_IO = 2, PSI_COUNT = 3 };
+
+typedef struct {
+    uint16_t some[PSI_COUNT];   /* 0.01 % units */
+    uint16_t full[PSI_COUNT];
+} TlvPressure;
+
+typedef struct {                /* per-second rates */
+    float rx_bytes;
+    float tx_bytes;
+    float rx_packets;
+    float tx_packets;
+    float rx_errors;
+    float tx_errors;
+    float rx_drops;
+    float tx_drops;
+    char  name[IFACE_NAME_LEN];
+} TlvNetIface;
+
+typedef struct {
+    float    rd_iops;
+    float    wr_iops;
+    float    rd_bytes;      /* bytes/s */
+    float    wr_bytes;
+    float    await_ms;
+    uint16_t in_flight;
+    uint8_t  util;          /* % busy */
+    uint8_t  life_used;     /* eMMC wear %, 0 when unknown */
+    char     name[DISK_NAME_LEN];
+} TlvDisk;
+
+typedef struct {
+    uint32_t total_mb;
+    uint32_t free_mb;
+    char     path[MOUNT_PATH_LEN];
+} TlvFs;
+
+typedef struct {
+    uint32_t pid;
+    uint32_t rss_kb;
+    uint16_t cpu;           /* 0.1 % of one core */
+    uint8_t  flags;         /* PROC_TOP_* */
+    char     comm[COMM_LEN];
+} TlvProc;
+
+typedef struct {
+    float    cpu_pct;
+    uint32_t mem_kb;
+    float    rd_bytes;      /* per second */
+    float    wr_bytes;
+    float    rd_ios;
+    float    wr_ios;
+    char     name[CGROUP_NAME_LEN];
+} TlvCgroup;
+
+/* Acknowledged mode: seq counts samples for the life of the client's spool,
+ * epoch changes when the spool is recreated, acked is the cumulative ack
+ * the client holds (or the point it gave up resending from). */
+typedef struct {
+    uint64_t seq;
+    uint64_t acked;
+    uint32_t epoch;
+    uint8_t  flags;
+} TlvSequence;
+
+/* The client's own cost, sent every few samples */
+typedef struct {
+    float    cpu_pct;
+    uint32_t rss_kb;
+    uint32_t max_jitter_us;
+    uint32_t max_work_us;
+} TlvSelf;
+
+/* One header metric over the samples the client took since its last send;
+ * the header then carries the mean */
+typedef struct {
+    float    min;
+    float    max;
+    float    mean;
+    float    p95;           /* approximate beyond 64 samples */
+    uint16_t count;
+    uint8_t  metric;
+} TlvWindow;
+
+typedef struct {
+    uint32_t khz;
+    uint16_t share;         /* 0.01 % of the interval */
+} TlvFreqState;
+
+/* Frequency residency of one cpufreq policy; only state_count states are
+ * on the wire */
+typedef struct {
+    float   trans_per_sec;
+    uint8_t policy;
+    uint8_t state_count;
+    TlvFreqState states[MAX_FREQ_STATES];
+} TlvFreq;
+
+typedef struct {
+    uint16_t cur_state;
+    uint16_t max_state;
+    char     type[COOLING_TYPE_LEN];
+} TlvCooling;
+
+#define ACK_MAGIC 0x4b414d50    /* "PMAK" */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t epoch;
+    char     client_id[CLIENT_ID_LEN];
+    uint64_t acked;
+} AckPacket;
+
+/*
+ * Relay batch: a RelayHeader, then count records of a uint16_t length and
+ * that many bytes of TelemetryPacket plus records. The magic cannot start
+ * a client_id (hostnames never begin with 0xff).
+ */
+#define RELAY_MAGIC 0x524d50ffu     /* "\xffPMR" */
+
+typedef struct {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t reserved;
+} RelayHeader;
+
+/* One summarised client waiting to be packed into a relay batch */
+typedef struct {
+    size_t len;
+    unsigned char rec[RELAY_RECORD_MAX];
+} RelayRecord;
+
+/*
+ * Capture file: a CaptureHeader, then per datagram a CaptureRecord followed
+ * by len payload bytes. Host byte order, like the relay batches.
+ */
+#define CAPTURE_MAGIC   0x50434d50u     /* "PMCP" */
+#define CAPTURE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+} CaptureHeader;
+
+typedef struct {
+    uint64_t rx_ns;         /* kernel receive time, Unix ns */
+    uint8_t  addr[16];      /* source, IPv4 as ::ffff:a.b.c.d */
+    uint16_t port;          /* network byte order */
+    uint16_t len;
+    uint32_t reserved;
+} CaptureRecord;
+
+/* EWMA baseline of one metric of one client */
+typedef struct {
+    float mean;
+    float var;
+    float value;            /* latest sample */
+    float z;                /* its deviation from the baseline before it */
+    unsigned int n;         /* samples seen, up to ANOMALY_WARMUP */
+} AnomalyStat;
+
 typedef struct {
     TelemetryPacket samples[MAX_SAMPLES];
     int count;
-    struct sockaddr_in last_addr;
+    struct sockaddr_storage last_addr;  /* IPv4 or IPv6 sender */
+    int core_count;         /* 0 when the client sends no per-core data */
+    int hot_core;
+    float hot_busy;
+    int sensor_count;
+    TlvSensor sensors[MAX_SENSORS];
+    int has_memory;
+    TlvMemory memory;
+    int has_pressure;
+    TlvPressure pressure;
+    int iface_count;
+    TlvNetIface ifaces[MAX_IFACES];
+    int disk_count;
+    TlvDisk disks[MAX_DISKS];
+    int fs_count;
+    TlvFs fs[MAX_MOUNTS];
+    int proc_count;
+    TlvProc procs[MAX_PROCS];
+    int cgroup_count;
+    TlvCgroup cgroups[MAX_CGROUPS];
+    int has_self;
+    TlvSelf self;
+    int window_mask;        /* bit per WIN_* present in the latest sample */
+    TlvWindow window[WIN_METRICS];
+    int freq_count;
+    TlvFreq freq[MAX_FREQ_POLICIES];
+    int cooling_count;
+    TlvCooling cooling[MAX_COOLING];
+    int has_seq;            /* client runs in acknowledged mode */
+    uint32_t seq_epoch;
+    uint64_t seq_acked;     /* every sample up to here has arrived */
+    uint64_t seq_last;      /* newest live sample */
+    unsigned char seq_seen[SEQ_WINDOW];    /* by seq % SEQ_WINDOW, above seq_acked */
+    int replaying;          /* the current datagram group is a resend */
+    unsigned int backfilled;    /* resent samples that filled a gap */
+    int duplicate;          /* the current datagram group was seen before */
+    uint64_t first_hash;    /* whole first datagram of the latest sample, */
+    size_t first_len;       /* for clients without a sequence */
+    char site[SITE_LEN];    /* relay site, "" for direct clients */
+    AnomalyStat anom[ANOM_METRICS];
+    int anom_mask;          /* bit per ANOM_* metric off its baseline now */
+    int anom_onset;         /* bits that became anomalous, not yet reported */
+    /* Table bookkeeping */
+    int in_use;
+    int hash_next;          /* lookup chain or free list, index + 1, 0 ends */
+    time_t heard;           /* last datagram, view clock; expires sampleless entries */
+    /* What the client adds to its shard's FleetAgg */
+    int fleet_in;
+    float fleet_temp;
+    float fleet_load;
+    uint64_t fleet_seen;    /* timestamp of the sample counted */
+    int fleet_next;         /* temperature bucket list, index + 1, 0 ends */
+    int fleet_prev;
+    /* Relay mode: header metrics since the last forward */
+    unsigned int relay_count;
+    float relay_sum[WIN_METRICS];
+    float relay_min[WIN_METRICS];
+    float relay_max[WIN_METRICS];
+    float relay_p95[WIN_METRICS];
+    unsigned int relay_samples;
 } ClientData;
 
 typedef struct {
     int start_minimized;
 } Preferences;
 
+/* Token bucket for one source address or client_id */
+typedef struct {
+    unsigned char key[CLIENT_ID_LEN];   /* in6 address or client_id; all zero = free */
+    double tokens;
+    uint64_t last_ns;
+    uint64_t dropped;
+    int cont_left;          /* continuations still due to the last sample */
+} FloodBucket;
+
+/* Clients counted under one second of last contact */
+typedef struct {
+    uint64_t sec;
+    uint32_t count;
+} FleetSecond;
+
+/*
+ * Fleet aggregate of one shard, kept current as samples arrive: every client
+ * counts once with its latest sample. Histograms of equal buckets merge by
+ * adding counts. Each temperature bucket also lists its clients, so the
+ * hottest are found from the top bucket down without visiting the rest.
+ * A negative value ("no sensor") is left out of its metric, as the relay
+ * does. Last contact is counted per second in a wheel of OFFLINE_SECS slots.
+ */
+typedef struct {
+    uint32_t clients;
+    uint32_t temp_count;    /* clients with a temperature */
+    uint32_t load_count;
+    double temp_sum;
+    double load_sum;
+    uint32_t temp[FLEET_TEMP_BUCKETS];
+    uint32_t load[FLEET_LOAD_BUCKETS];
+    int temp_head[FLEET_TEMP_BUCKETS];      /* index + 1, 0 = empty */
+    FleetSecond seen[OFFLINE_SECS];
+} FleetAgg;
+
+/*
+ * One receiver thread and one shard of the client table. The kernel spreads
+ * datagrams over the SO_REUSEPORT sockets by 4-tuple, so any thread may read
+ * a client's datagram; it is applied to the shard client_shard() names,
+ * under that shard's lock. Socket, flood buckets and counters belong to the
+ * receiving thread.
+ */
+typedef struct {
+    pthread_mutex_t mtx;
+    int sock;
+    volatile int stop;      /* --bench-recv: leave the receive loop */
+    uint64_t packets;       /* datagrams handled, for --bench-recv */
+    uint64_t syscalls;      /* receive syscalls made, for --bench-recv */
+    int uring;              /* 1 while the io_uring loop serves the shard */
+    uint64_t dropped_src;   /* flood drops, written by the shard thread only */
+    uint64_t dropped_id;
+    FloodBucket src_flood[FLOOD_SLOTS];
+    FloodBucket id_flood[FLOOD_SLOTS];
+    FleetAgg fleet;
+    ClientData *clients;    /* client_cap entries, grown up to MAX_CLIENTS */
+    int client_cap;
+    int client_used;        /* entries handed out; cleared ones are reused */
+    int client_free;        /* cleared entries, index + 1, 0 = none */
+    int client_hash[CLIENT_HASH];   /* chains by client_id and site, index + 1 */
+} ClientShard;
+
 /* Global state ---------------------------------------------------------- */
-static ClientData g_clients[MAX_CLIENTS];
+static ClientShard g_shards[MAX_SHARDS];
+static int g_shard_count = 1;
+static int g_receiver_count = 0;
+static pthread_t g_receivers[MAX_SHARDS];
+static int g_recv_uring = 0;        /* PIMON_RECV=uring */
 static char g_latest_text[MAX_LINE] = "";
-static pthread_mutex_t g_line_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int g_latest_set = 0;        /* g_latest_text non-empty, read unlocked */
+static pthread_mutex_t g_line_mtx = PTHREAD_MUTEX_INITIALIZER;  /* g_latest_text */
 static int g_notify_fd = -1;
+static int g_notify_pending = 0;    /* a wake-up byte is in the pipe */
+static double g_flood_src_pps = FLOOD_SRC_PPS;     /* 0 = unlimited */
+static double g_flood_id_pps = FLOOD_ID_PPS;
+static float g_anomaly_z = ANOMALY_Z;   /* 0 = no anomaly detection */
+static FILE *g_capture = NULL;      /* PIMON_CAPTURE */
+static pthread_mutex_t g_capture_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t g_capture_flushed = 0;  /* second of the last flush */
+static uint64_t g_capture_skipped = 0;  /* flood drops left out of the capture */
+static const unsigned char *g_replay = NULL;    /* mapped capture file */
+static size_t g_replay_size = 0;
+static long g_view_offset = 0;      /* replay: recorded minus wall clock, s */
+static int g_relay_fd = -1;         /* upstream socket in relay mode */
+static struct sockaddr_storage g_relay_addr;
+static socklen_t g_relay_addr_len;
+static char g_site[SITE_LEN] = "";
 
 static int g_menu_open = 0;
 static int g_menu_hover = -1;
@@ -91,6 +588,8 @@ static const char *g_menu_items[] = {
     "Clear all",
     "Clear offline",
     "Select text",
+    "Heatmap view",
+    "Heat by temp/load",
     "Preferences",
     NULL,
     "Exit"
@@ -100,15 +599,48 @@ enum {
     MENU_CLEAR_ALL = 0,
     MENU_CLEAR_OFFLINE = 1,
     MENU_SELECT_TEXT = 2,
-    MENU_PREFS = 3,
-    MENU_SEPARATOR = 4,
-    MENU_EXIT = 5,
-    MENU_COUNT = 6
+    MENU_HEATMAP = 3,
+    MENU_HEAT_METRIC = 4,
+    MENU_PREFS = 5,
+    MENU_SEPARATOR = 6,
+    MENU_EXIT = 7,
+    MENU_COUNT = 8
 };
 
+/* One client as the heatmap draws it */
+typedef struct {
+    float value;
+    int online;
+    int anomalous;
+    char name[CLIENT_ID_LEN + SITE_LEN];
+} HeatCell;
+
+/* Heatmap image, palette, and the layout of the last draw for clicks */
+typedef struct {
+    XImage *img;
+    int shm;                /* img->data is a MIT-SHM segment */
+#ifdef HAVE_XSHM
+    XShmSegmentInfo shminfo;
+#endif
+    int palette_ready;
+    unsigned long palette[HEAT_COLORS];
+    unsigned long offline_pixel;
+    int x0, y0, cell, cols, count;
+    HeatCell *cells;        /* grown to the largest fleet drawn */
+    int cells_cap;
+} HeatMap;
+
+static int g_heatmap = 0;           /* heatmap instead of the table */
+static int g_heat_metric = WIN_TEMP;    /* WIN_TEMP or WIN_LOAD */
+static char g_heat_selected[CLIENT_ID_LEN + SITE_LEN] = "";
+static HeatMap g_heat;
+
+/* One byte in the pipe is enough however many datagrams arrive before the
+ * UI thread gets to it */
 static void notify_main_thread(void)
 {
     if (g_notify_fd < 0) return;
+    if (__atomic_exchange_n(&g_notify_pending, 1, __ATOMIC_ACQ_REL)) return;
 
     {
         char b = 'u';
@@ -201,552 +733,3436 @@ static void format_time(uint64_t ts, char *buf, size_t len)
     strftime(buf, len, "%Y-%m-%d %H:%M:%S", &tm);
 }
 
-static ClientData *get_client(const char *id)
+/* Make room for need elements of size in buf, doubling; NULL when out of
+ * memory, buf and cap then unchanged */
+static void *grow_array(void *buf, int *cap, int need, size_t size)
 {
-    int i;
-    ClientData *empty = NULL;
+    int new_cap = *cap ? *cap : CLIENT_GROW;
+    void *tmp;
+
+    while (new_cap < need) new_cap *= 2;
+    tmp = realloc(buf, (size_t)new_cap * size);
+    if (!tmp) return NULL;
+    *cap = new_cap;
+    return tmp;
+}
 
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        if (g_clients[i].count == 0 && empty == NULL) {
-            empty = &g_clients[i];
-        }
-        if (g_clients[i].count > 0 &&
-            strncmp(g_clients[i].samples[0].client_id, id, CLIENT_ID_LEN) == 0) {
-            return &g_clients[i];
+static uint32_t client_key_hash(const char *id, const char *site)
+{
+    uint32_t h = 2166136261u;   /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < CLIENT_ID_LEN && id[i]; i++) h = (h ^ (unsigned char)id[i]) * 16777619u;
+    h = (h ^ 0xffu) * 16777619u;
+    for (i = 0; i < SITE_LEN && site[i]; i++) h = (h ^ (unsigned char)site[i]) * 16777619u;
+    return h;
+}
+
+static int *client_chain(ClientShard *sh, const char *id, const char *site)
+{
+    return &sh->client_hash[client_key_hash(id, site) & (CLIENT_HASH - 1)];
+}
+
+/* The shard holding a client; the high hash bits, the chains use the low */
+static ClientShard *client_shard(const char *id, const char *site)
+{
+    return &g_shards[(client_key_hash(id, site) >> 16) % (uint32_t)g_shard_count];
+}
+
+/*
+ * Caller holds sh->mtx. Clients are keyed by client_id and site, so equal
+ * hostnames at two sites stay apart. O(1): one hash chain is walked, and a
+ * new client takes a cleared entry or the next one, growing the table by
+ * doubling. Entries move when it grows, so pointers do not outlive the lock.
+ */
+static ClientData *get_client(ClientShard *sh, const char *id, const char *site)
+{
+    int *chain = client_chain(sh, id, site);
+    ClientData *c;
+    int idx;
+
+    for (idx = *chain; idx; idx = c->hash_next) {
+        c = &sh->clients[idx - 1];
+        if (strncmp(c->samples[0].client_id, id, CLIENT_ID_LEN) == 0 &&
+            strncmp(c->site, site, SITE_LEN) == 0) {
+            return c;
         }
     }
 
-    if (empty) {
-        memset(empty, 0, sizeof(*empty));
-        strncpy(empty->samples[0].client_id, id, CLIENT_ID_LEN - 1);
-        empty->samples[0].client_id[CLIENT_ID_LEN - 1] = '\0';
-        return empty;
+    if (sh->client_free) {
+        idx = sh->client_free;
+        sh->client_free = sh->clients[idx - 1].hash_next;
+    } else {
+        if (sh->client_used == sh->client_cap) {
+            ClientData *grown;
+            if (sh->client_cap >= MAX_CLIENTS) return NULL;
+            grown = grow_array(sh->clients, &sh->client_cap, sh->client_cap + 1,
+                               sizeof(*grown));
+            if (!grown) return NULL;
+            sh->clients = grown;
+        }
+        idx = ++sh->client_used;
     }
-    return NULL;
+    c = &sh->clients[idx - 1];
+    memset(c, 0, sizeof(*c));
+    strncpy(c->samples[0].client_id, id, CLIENT_ID_LEN - 1);
+    c->samples[0].client_id[CLIENT_ID_LEN - 1] = '\0';
+    strncpy(c->site, site, SITE_LEN - 1);
+    c->in_use = 1;
+    c->hash_next = *chain;
+    *chain = idx;
+    return c;
 }
 
-static void clear_client_entry(ClientData *c)
+static float sample_metric(const TelemetryPacket *pkt, int metric)
 {
-    memset(c, 0, sizeof(*c));
+    switch (metric) {
+    case WIN_LOAD: return pkt->cpu_load;
+    case WIN_TEMP: return pkt->cpu_temp;
+    case WIN_MHZ:  return pkt->cpu_mhz;
+    default:       return pkt->fan_speed;
+    }
 }
 
-static void clear_all_clients(void)
+/* Returns 1 when the bytes after the fixed header are a well-formed record
+ * sequence, so plain text datagrams are not mistaken for telemetry. */
+static int tlv_valid(const unsigned char *p, size_t len)
 {
-    int i;
-    pthread_mutex_lock(&g_line_mtx);
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        clear_client_entry(&g_clients[i]);
+    while (len > 0) {
+        TelemetryTlv tlv;
+        if (len < sizeof(tlv)) return 0;
+        memcpy(&tlv, p, sizeof(tlv));
+        if (tlv.len > len - sizeof(tlv)) return 0;
+        p += sizeof(tlv) + tlv.len;
+        len -= sizeof(tlv) + tlv.len;
     }
-    g_latest_text[0] = '\0';
-    pthread_mutex_unlock(&g_line_mtx);
+    return 1;
 }
 
-static void clear_offline_clients(void)
+static void apply_cpu_cores(ClientData *c, const unsigned char *v, size_t len)
 {
     int i;
-    time_t now = time(NULL);
-
-    pthread_mutex_lock(&g_line_mtx);
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        if (g_clients[i].count <= 0) continue;
-        {
-            TelemetryPacket last = g_clients[i].samples[g_clients[i].count - 1];
-            int age = (int)(now - (time_t)last.timestamp);
-            if (age < 0) age = 0;
-            if (age >= OFFLINE_SECS) {
-                clear_client_entry(&g_clients[i]);
-            }
+    int n = (int)(len / sizeof(TlvCpuCore));
+
+    if (n > MAX_CPUS) n = MAX_CPUS;
+    c->core_count = n;
+    c->hot_core = 0;
+    c->hot_busy = 0.0f;
+    for (i = 0; i < n; i++) {
+        TlvCpuCore core;
+        memcpy(&core, v + i * sizeof(core), sizeof(core));
+        if (i == 0 || core.busy / 100.0f > c->hot_busy) {
+            c->hot_core = i;
+            c->hot_busy = core.busy / 100.0f;
         }
     }
-    pthread_mutex_unlock(&g_line_mtx);
 }
 
-static int append_text(char **buf, size_t *len, size_t *cap, const char *text)
+static void apply_sensor(ClientData *c, const unsigned char *v, size_t len)
 {
-    size_t add = strlen(text);
-    char *tmp;
-    if (*len + add + 1 > *cap) {
-        size_t new_cap = *cap ? *cap : 1024;
-        while (*len + add + 1 > new_cap) new_cap *= 2;
-        tmp = (char *)realloc(*buf, new_cap);
-        if (!tmp) return 0;
-        *buf = tmp;
-        *cap = new_cap;
+    TlvSensor *sn;
+    size_t label_len;
+
+    if (c->sensor_count >= MAX_SENSORS) return;
+    if (len < offsetof(TlvSensor, label)) return;
+    sn = &c->sensors[c->sensor_count++];
+    memset(sn, 0, sizeof(*sn));
+    label_len = len - offsetof(TlvSensor, label);
+    if (label_len > SENSOR_LABEL_LEN - 1) label_len = SENSOR_LABEL_LEN - 1;
+    memcpy(sn, v, offsetof(TlvSensor, label) + label_len);
+}
+
+static void apply_net_iface(ClientData *c, const unsigned char *v, size_t len)
+{
+    TlvNetIface *nif;
+    size_t name_len;
+
+    if (c->iface_count >= MAX_IFACES) return;
+    if (len < offsetof(TlvNetIface, name)) return;
+    nif = &c->ifaces[c->iface_count++];
+    memset(nif, 0, sizeof(*nif));
+    name_len = len - offsetof(TlvNetIface, name);
+    if (name_len > IFACE_NAME_LEN - 1) name_len = IFACE_NAME_LEN - 1;
+    memcpy(nif, v, offsetof(TlvNetIface, name) + name_len);
+}
+
+static void apply_freq(ClientData *c, const unsigned char *v, size_t len)
+{
+    TlvFreq *f;
+
+    if (c->freq_count >= MAX_FREQ_POLICIES) return;
+    if (len < offsetof(TlvFreq, states)) return;
+    f = &c->freq[c->freq_count++];
+    memset(f, 0, sizeof(*f));
+    if (len > sizeof(*f)) len = sizeof(*f);
+    memcpy(f, v, len);
+    if (f->state_count > (len - offsetof(TlvFreq, states)) / sizeof(TlvFreqState)) {
+        f->state_count = (uint8_t)((len - offsetof(TlvFreq, states)) / sizeof(TlvFreqState));
     }
-    memcpy(*buf + *len, text, add);
-    *len += add;
-    (*buf)[*len] = '\0';
-    return 1;
 }
 
-static char *build_clients_snapshot(void)
+static void apply_cooling(ClientData *c, const unsigned char *v, size_t len)
 {
-    ClientData clients[MAX_CLIENTS];
-    char latest_text[MAX_LINE];
-    char *buf = NULL;
-    size_t cap = 0;
-    size_t len = 0;
-    char line[256];
-    char ts[64];
-    int i;
-    int visible = 0;
-    time_t now = time(NULL);
+    TlvCooling *cd;
+    size_t type_len;
+
+    if (c->cooling_count >= MAX_COOLING) return;
+    if (len < offsetof(TlvCooling, type)) return;
+    cd = &c->cooling[c->cooling_count++];
+    memset(cd, 0, sizeof(*cd));
+    type_len = len - offsetof(TlvCooling, type);
+    if (type_len > COOLING_TYPE_LEN - 1) type_len = COOLING_TYPE_LEN - 1;
+    memcpy(cd, v, offsetof(TlvCooling, type) + type_len);
+}
 
-    pthread_mutex_lock(&g_line_mtx);
-    memcpy(clients, g_clients, sizeof(clients));
-    strncpy(latest_text, g_latest_text, sizeof(latest_text) - 1);
-    latest_text[sizeof(latest_text) - 1] = '\0';
-    pthread_mutex_unlock(&g_line_mtx);
+static void apply_disk(ClientData *c, const unsigned char *v, size_t len)
+{
+    TlvDisk *d;
+    size_t name_len;
+
+    if (c->disk_count >= MAX_DISKS) return;
+    if (len < offsetof(TlvDisk, name)) return;
+    d = &c->disks[c->disk_count++];
+    memset(d, 0, sizeof(*d));
+    name_len = len - offsetof(TlvDisk, name);
+    if (name_len > DISK_NAME_LEN - 1) name_len = DISK_NAME_LEN - 1;
+    memcpy(d, v, offsetof(TlvDisk, name) + name_len);
+}
 
-    format_time((uint64_t)now, ts, sizeof(ts));
-    snprintf(line, sizeof(line), "          %s\n", ts);
-    if (!append_text(&buf, &len, &cap, line)) return NULL;
+static void apply_fs(ClientData *c, const unsigned char *v, size_t len)
+{
+    TlvFs *fs;
+    size_t path_len;
+
+    if (c->fs_count >= MAX_MOUNTS) return;
+    if (len < offsetof(TlvFs, path)) return;
+    fs = &c->fs[c->fs_count++];
+    memset(fs, 0, sizeof(*fs));
+    path_len = len - offsetof(TlvFs, path);
+    if (path_len > MOUNT_PATH_LEN - 1) path_len = MOUNT_PATH_LEN - 1;
+    memcpy(fs, v, offsetof(TlvFs, path) + path_len);
+}
 
-    snprintf(line, sizeof(line), "%-32s %-15s %8s %8s %8s %8s %s\n",
-             "Client", "IP", "Avg Load", "Avg Temp", "Avg Fan", "Avg MHz", "Seen");
-    if (!append_text(&buf, &len, &cap, line)) {
-        free(buf);
-        return NULL;
-    }
+static void apply_proc(ClientData *c, const unsigned char *v, size_t len)
+{
+    TlvProc *pr;
+    size_t comm_len;
+
+    if (c->proc_count >= MAX_PROCS) return;
+    if (len < offsetof(TlvProc, comm)) return;
+    pr = &c->procs[c->proc_count++];
+    memset(pr, 0, sizeof(*pr));
+    comm_len = len - offsetof(TlvProc, comm);
+    if (comm_len > COMM_LEN - 1) comm_len = COMM_LEN - 1;
+    memcpy(pr, v, offsetof(TlvProc, comm) + comm_len);
+}
 
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        int j;
-        int n = clients[i].count;
-        float load = 0.0f;
-        float temp = 0.0f;
-        float fan = 0.0f;
-        float mhz = 0.0f;
-        TelemetryPacket last;
-        int age;
-        char ip[INET_ADDRSTRLEN];
-        char seen_time[64];
-        const char *seen;
-
-        if (n <= 0) continue;
-        for (j = 0; j < n; j++) {
-            load += clients[i].samples[j].cpu_load;
-            temp += clients[i].samples[j].cpu_temp;
-            fan += clients[i].samples[j].fan_speed;
-            mhz += clients[i].samples[j].cpu_mhz;
-        }
-
-        last = clients[i].samples[n - 1];
-        age = (int)(now - (time_t)last.timestamp);
-        if (age < 0) age = 0;
-        format_time(last.timestamp, seen_time, sizeof(seen_time));
-        seen = (age < OFFLINE_SECS) ? seen_time + 11 : "offline";
-        inet_ntop(AF_INET, &clients[i].last_addr.sin_addr, ip, sizeof(ip));
-
-        snprintf(line, sizeof(line), "%-32s %-15s %7.2f%% %8.2f %8d %8.2f %s\n",
-                 last.client_id,
-                 ip[0] ? ip : "0.0.0.0",
-                 load / n,
-                 temp / n,
-                 (int)(fan / n),
-                 mhz / n,
-                 seen);
-        if (!append_text(&buf, &len, &cap, line)) {
-            free(buf);
-            return NULL;
+static void apply_cgroup(ClientData *c, const unsigned char *v, size_t len)
+{
+    TlvCgroup *cg;
+    size_t name_len;
+
+    if (c->cgroup_count >= MAX_CGROUPS) return;
+    if (len < offsetof(TlvCgroup, name)) return;
+    cg = &c->cgroups[c->cgroup_count++];
+    memset(cg, 0, sizeof(*cg));
+    name_len = len - offsetof(TlvCgroup, name);
+    if (name_len > CGROUP_NAME_LEN - 1) name_len = CGROUP_NAME_LEN - 1;
+    memcpy(cg, v, offsetof(TlvCgroup, name) + name_len);
+}
+
+/* A sample too large for one datagram continues in datagrams whose first
+ * record is TLV_CONTINUATION; they add records but not a new sample. */
+static int tlv_is_continuation(const unsigned char *p, size_t len)
+{
+    TelemetryTlv tlv;
+    if (len < sizeof(tlv)) return 0;
+    memcpy(&tlv, p, sizeof(tlv));
+    return tlv.type == TLV_CONTINUATION;
+}
+
+/* Site tag of a relayed record as a terminated string, "" without one */
+static void find_site(const unsigned char *p, size_t len, char *out)
+{
+    out[0] = '\0';
+    while (len >= sizeof(TelemetryTlv)) {
+        TelemetryTlv tlv;
+
+        memcpy(&tlv, p, sizeof(tlv));
+        if (tlv.type == TLV_SITE) {
+            size_t n = tlv.len < SITE_LEN - 1 ? tlv.len : SITE_LEN - 1;
+            memcpy(out, p + sizeof(tlv), n);
+            out[n] = '\0';
+            return;
         }
-        visible++;
+        p += sizeof(tlv) + tlv.len;
+        len -= sizeof(tlv) + tlv.len;
     }
+}
 
-    if (visible == 0) {
-        if (latest_text[0]) {
-            if (!append_text(&buf, &len, &cap, latest_text) ||
-                !append_text(&buf, &len, &cap, "\n")) {
-                free(buf);
-                return NULL;
-            }
-        } else {
-            if (!append_text(&buf, &len, &cap, "No clients connected.\n")) {
-                free(buf);
-                return NULL;
-            }
+static int find_sequence(const unsigned char *p, size_t len, TlvSequence *out)
+{
+    while (len >= sizeof(TelemetryTlv)) {
+        TelemetryTlv tlv;
+
+        memcpy(&tlv, p, sizeof(tlv));
+        if (tlv.type == TLV_SEQUENCE) {
+            memset(out, 0, sizeof(*out));
+            memcpy(out, p + sizeof(tlv), tlv.len < sizeof(*out) ? tlv.len : sizeof(*out));
+            return 1;
         }
+        p += sizeof(tlv) + tlv.len;
+        len -= sizeof(tlv) + tlv.len;
     }
-    return buf;
+    return 0;
 }
 
-static void draw_text(Display *dpy, Window win, GC gc, int x, int y, const char *text)
+static void seq_advance(ClientData *c, uint64_t to)
 {
-    XDrawString(dpy, win, gc, x, y, text, (int)strlen(text));
+    while (c->seq_acked < to) {
+        c->seq_acked++;
+        c->seq_seen[c->seq_acked % SEQ_WINDOW] = 0;
+    }
 }
 
-static void draw_menu(Display *dpy, Window win, GC gc, int line_height)
+/* Caller holds the shard lock. Moves the cumulative ack for the client; samples
+ * further than SEQ_WINDOW ahead are not remembered and get resent later. */
+static void apply_sequence(ClientData *c, const TlvSequence *s)
 {
-    int i;
-    unsigned long black = BlackPixel(dpy, DefaultScreen(dpy));
-    unsigned long white = WhitePixel(dpy, DefaultScreen(dpy));
-
-    XSetForeground(dpy, gc, white);
-    XFillRectangle(dpy, win, gc, 0, 0, WINDOW_W, MENU_BAR_H);
-    XSetForeground(dpy, gc, black);
-    XDrawRectangle(dpy, win, gc, 0, 0, WINDOW_W - 1, MENU_BAR_H - 1);
-    draw_text(dpy, win, gc, MENU_PAD_X, 16, "Edit");
-
-    if (!g_menu_open) return;
-
-    XSetForeground(dpy, gc, white);
-    XFillRectangle(dpy, win, gc, MENU_PAD_X + 1, MENU_BAR_H + 1,
-                   MENU_DROP_W - 1, MENU_ITEM_H * MENU_COUNT - 1);
-    XSetForeground(dpy, gc, black);
-    XDrawRectangle(dpy, win, gc, MENU_PAD_X, MENU_BAR_H,
-                   MENU_DROP_W, MENU_ITEM_H * MENU_COUNT);
-    for (i = 0; i < MENU_COUNT; i++) {
-        int y = MENU_BAR_H + i * MENU_ITEM_H;
-        if (i == MENU_SEPARATOR) {
-            int line_y = y + (MENU_ITEM_H / 2);
-            XDrawLine(dpy, win, gc,
-                      MENU_PAD_X + 8, line_y,
-                      MENU_PAD_X + MENU_DROP_W - 8, line_y);
-            continue;
-        }
-        if (i == g_menu_hover) {
-            XFillRectangle(dpy, win, gc, MENU_PAD_X + 1, y + 1,
-                           MENU_DROP_W - 1, MENU_ITEM_H - 1);
-            XSetForeground(dpy, gc, WhitePixel(dpy, DefaultScreen(dpy)));
-            draw_text(dpy, win, gc, MENU_PAD_X + 8, y + (line_height - 2), g_menu_items[i]);
-            XSetForeground(dpy, gc, BlackPixel(dpy, DefaultScreen(dpy)));
+    if (!c->has_seq || s->epoch != c->seq_epoch) {
+        memset(c->seq_seen, 0, sizeof(c->seq_seen));
+        c->has_seq = 1;
+        c->seq_epoch = s->epoch;
+        c->seq_acked = s->acked;
+        c->seq_last = s->acked;
+        c->backfilled = 0;
+    }
+    /* The client no longer holds anything up to s->acked */
+    if (s->acked > c->seq_acked) {
+        if (s->acked - c->seq_acked > SEQ_WINDOW) {
+            memset(c->seq_seen, 0, sizeof(c->seq_seen));
+            c->seq_acked = s->acked;
         } else {
-            draw_text(dpy, win, gc, MENU_PAD_X + 8, y + (line_height - 2), g_menu_items[i]);
+            seq_advance(c, s->acked);
         }
     }
+
+    c->replaying = (s->flags & SEQ_REPLAY) != 0;
+    if (!c->replaying && s->seq > c->seq_last) c->seq_last = s->seq;
+    if (s->seq > c->seq_acked && s->seq - c->seq_acked <= SEQ_WINDOW &&
+        !c->seq_seen[s->seq % SEQ_WINDOW]) {
+        c->seq_seen[s->seq % SEQ_WINDOW] = 1;
+        if (c->replaying) c->backfilled++;
+    }
+    while (c->seq_seen[(c->seq_acked + 1) % SEQ_WINDOW]) {
+        seq_advance(c, c->seq_acked + 1);
+    }
 }
 
-static void redraw_window(Display *dpy, Window win, GC gc, int line_height)
-{
-    ClientData clients[MAX_CLIENTS];
-    char latest_text[MAX_LINE];
-    char line[256];
-    char timebuf[64];
-    int i;
-    int visible_clients = 0;
-    time_t now;
-    int x = 10;
-    int y = MENU_BAR_H + 20;
+/* Anomaly detection ------------------------------------------------------- */
 
-    pthread_mutex_lock(&g_line_mtx);
-    memcpy(clients, g_clients, sizeof(clients));
-    strncpy(latest_text, g_latest_text, sizeof(latest_text) - 1);
-    latest_text[sizeof(latest_text) - 1] = '\0';
-    pthread_mutex_unlock(&g_line_mtx);
+static const char *g_anomaly_names[ANOM_METRICS] = {
+    "load", "temp", "MHz", "fan", "mem avail", "stall"
+};
 
-    now = time(NULL);
-    format_time((uint64_t)now, timebuf, sizeof(timebuf));
+/* Smallest deviation assumed, so a metric that sat still (a fan at 0 rpm,
+ * an idle stall share) is not flagged for the first flicker */
+static const float g_anomaly_floor[ANOM_METRICS] = {
+    2.0f, 0.5f, 50.0f, 100.0f, 32.0f, 1.0f
+};
 
-    XClearWindow(dpy, win);
+static void init_anomaly(void)
+{
+    const char *z = getenv("PIMON_ANOMALY_Z");
 
-    snprintf(line, sizeof(line), "          %s", timebuf);
+    if (z && z[0]) g_anomaly_z = (float)atof(z);
+}
+
+/*
+ * Caller holds the shard lock. Score value against the metric's baseline,
+ * then fold it in: O(1), no history kept. The baseline goes on adapting
+ * during an anomaly, so a lasting change of level stops being one.
+ */
+static void anomaly_observe(ClientData *c, int metric, float value)
+{
+    AnomalyStat *a = &c->anom[metric];
+    int bit = 1 << metric;
+    float diff;
+    float sigma;
+
+    if (g_anomaly_z <= 0.0f) return;
+    a->value = value;
+    if (a->n == 0) {
+        a->mean = value;
+        a->var = 0.0f;
+        a->z = 0.0f;
+        a->n = 1;
+        return;
+    }
+    diff = value - a->mean;
+    sigma = sqrtf(a->var);
+    if (sigma < g_anomaly_floor[metric]) sigma = g_anomaly_floor[metric];
+    a->z = diff / sigma;
+    if (a->n >= ANOMALY_WARMUP && fabsf(a->z) > g_anomaly_z) {
+        if (!(c->anom_mask & bit)) c->anom_onset |= bit;
+        c->anom_mask |= bit;
+    } else {
+        c->anom_mask &= ~bit;
+        c->anom_onset &= ~bit;
+    }
+    a->mean += ANOMALY_ALPHA * diff;
+    a->var = (1.0f - ANOMALY_ALPHA) * (a->var + ANOMALY_ALPHA * diff * diff);
+    if (a->n < ANOMALY_WARMUP) a->n++;
+}
+
+/* Caller holds the shard lock */
+static void anomaly_header(ClientData *c, const TelemetryPacket *pkt)
+{
+    int m;
+
+    for (m = 0; m < WIN_METRICS; m++) anomaly_observe(c, m, sample_metric(pkt, m));
+}
+
+static void apply_memory(ClientData *c, const unsigned char *v)
+{
+    memcpy(&c->memory, v, sizeof(c->memory));
+    c->has_memory = 1;
+    anomaly_observe(c, ANOM_MEM, c->memory.mem_avail_kb / 1024.0f);
+}
+
+static void apply_pressure(ClientData *c, const unsigned char *v)
+{
+    uint16_t worst;
+
+    memcpy(&c->pressure, v, sizeof(c->pressure));
+    c->has_pressure = 1;
+    worst = c->pressure.some[PSI_MEMORY];
+    if (c->pressure.some[PSI_IO] > worst) worst = c->pressure.some[PSI_IO];
+    anomaly_observe(c, ANOM_STALL, worst / 100.0f);
+}
+
+/* Caller holds the shard lock and has validated the sequence with tlv_valid().
+ * List records (sensors, interfaces, disks, processes, cgroups) are
+ * replaced wholesale by the first datagram of every sample. */
+static void apply_tlvs(ClientData *c, const unsigned char *p, size_t len, int first)
+{
+    if (first) {
+        c->sensor_count = 0;
+        c->iface_count = 0;
+        c->disk_count = 0;
+        c->fs_count = 0;
+        c->proc_count = 0;
+        c->cgroup_count = 0;
+        c->window_mask = 0;
+        c->freq_count = 0;
+        c->cooling_count = 0;
+    }
+    while (len >= sizeof(TelemetryTlv)) {
+        TelemetryTlv tlv;
+        const unsigned char *v;
+
+        memcpy(&tlv, p, sizeof(tlv));
+        v = p + sizeof(tlv);
+        if (tlv.type == TLV_CPU_CORES) {
+            apply_cpu_cores(c, v, tlv.len);
+        } else if (tlv.type == TLV_SENSOR) {
+            apply_sensor(c, v, tlv.len);
+        } else if (tlv.type == TLV_MEMORY && tlv.len >= sizeof(TlvMemory)) {
+            apply_memory(c, v);
+        } else if (tlv.type == TLV_PRESSURE && tlv.len >= sizeof(TlvPressure)) {
+            apply_pressure(c, v);
+        } else if (tlv.type == TLV_NET_IFACE) {
+            apply_net_iface(c, v, tlv.len);
+        } else if (tlv.type == TLV_DISK) {
+            apply_disk(c, v, tlv.len);
+        } else if (tlv.type == TLV_FS) {
+            apply_fs(c, v, tlv.len);
+        } else if (tlv.type == TLV_PROC) {
+            apply_proc(c, v, tlv.len);
+        } else if (tlv.type == TLV_CGROUP) {
+            apply_cgroup(c, v, tlv.len);
+        } else if (tlv.type == TLV_SELF && tlv.len >= sizeof(TlvSelf)) {
+            memcpy(&c->self, v, sizeof(c->self));
+            c->has_self = 1;
+        } else if (tlv.type == TLV_FREQ) {
+            apply_freq(c, v, tlv.len);
+        } else if (tlv.type == TLV_COOLING) {
+            apply_cooling(c, v, tlv.len);
+        } else if (tlv.type == TLV_WINDOW && tlv.len >= sizeof(TlvWindow)) {
+            TlvWindow w;
+            memcpy(&w, v, sizeof(w));
+            if (w.metric < WIN_METRICS) {
+                c->window[w.metric] = w;
+                c->window_mask |= 1 << w.metric;
+            }
+        }
+        p += sizeof(tlv) + tlv.len;
+        len -= sizeof(tlv) + tlv.len;
+    }
+}
+
+/*
+ * Sender address as text. IPv4 clients reaching the dual-stack socket arrive
+ * as ::ffff:a.b.c.d; show those the way the client would write them.
+ */
+static void format_addr(const struct sockaddr_storage *ss, char *buf, size_t len)
+{
+    buf[0] = '\0';
+    if (ss->ss_family == AF_INET6) {
+        const struct in6_addr *a6 = &((const struct sockaddr_in6 *)ss)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a6)) {
+            inet_ntop(AF_INET, &a6->s6_addr[12], buf, len);
+        } else {
+            inet_ntop(AF_INET6, a6, buf, len);
+        }
+    } else if (ss->ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)ss)->sin_addr, buf, len);
+    }
+}
+
+static void format_hot_core(const ClientData *c, char *buf, size_t len)
+{
+    if (c->core_count <= 0) {
+        snprintf(buf, len, "-");
+        return;
+    }
+    snprintf(buf, len, "c%d %.0f%%", c->hot_core, c->hot_busy);
+}
+
+/* One indented detail line listing every sensor the client reported */
+static void format_sensors(const ClientData *c, char *buf, size_t len)
+{
+    int i;
+    size_t used;
+
+    buf[0] = '\0';
+    if (c->sensor_count <= 0) return;
+    used = (size_t)snprintf(buf, len, "    sensors:");
+    for (i = 0; i < c->sensor_count && used < len; i++) {
+        const TlvSensor *sn = &c->sensors[i];
+        char val[32];
+
+        switch (sn->kind) {
+        case SENSOR_TEMP:
+            snprintf(val, sizeof(val), "%.1fC", sn->value / 1000.0);
+            break;
+        case SENSOR_FAN:
+            snprintf(val, sizeof(val), "%drpm", (int)sn->value);
+            break;
+        case SENSOR_IN:
+            snprintf(val, sizeof(val), "%.3fV", sn->value / 1000.0);
+            break;
+        case SENSOR_POWER:
+            snprintf(val, sizeof(val), "%.2fW", sn->value / 1000000.0);
+            break;
+        default:
+            snprintf(val, sizeof(val), "%d", (int)sn->value);
+            break;
+        }
+        used += (size_t)snprintf(buf + used, len - used, " %s %s", sn->label, val);
+    }
+}
+
+static void format_memory(const ClientData *c, char *buf, size_t len)
+{
+    const TlvMemory *m = &c->memory;
+    const TlvPressure *p = &c->pressure;
+    size_t used;
+
+    buf[0] = '\0';
+    if (!c->has_memory) return;
+    used = (size_t)snprintf(buf, len,
+                            "    memory: avail %uM/%uM swap %uM/%uM dirty %uM writeback %uM",
+                            m->mem_avail_kb / 1024, m->mem_total_kb / 1024,
+                            m->swap_used_kb / 1024, m->swap_total_kb / 1024,
+                            m->dirty_kb / 1024, m->writeback_kb / 1024);
+    if (c->has_pressure && used < len) {
+        snprintf(buf + used, len - used,
+                 "  stall some cpu %.1f%% mem %.1f%% io %.1f%% full mem %.1f%% io %.1f%%",
+                 p->some[PSI_CPU] / 100.0, p->some[PSI_MEMORY] / 100.0,
+                 p->some[PSI_IO] / 100.0, p->full[PSI_MEMORY] / 100.0,
+                 p->full[PSI_IO] / 100.0);
+    }
+}
+
+static void format_net(const ClientData *c, char *buf, size_t len)
+{
+    int i;
+    size_t used;
+
+    buf[0] = '\0';
+    if (c->iface_count <= 0) return;
+    used = (size_t)snprintf(buf, len, "    net:");
+    for (i = 0; i < c->iface_count && used < len; i++) {
+        const TlvNetIface *n = &c->ifaces[i];
+        used += (size_t)snprintf(buf + used, len - used,
+                                 " %s rx %.2fMb/s %.0fp/s tx %.2fMb/s %.0fp/s err %.1f/s drop %.1f/s",
+                                 n->name,
+                                 n->rx_bytes * 8.0 / 1e6, n->rx_packets,
+                                 n->tx_bytes * 8.0 / 1e6, n->tx_packets,
+                                 n->rx_errors + n->tx_errors,
+                                 n->rx_drops + n->tx_drops);
+    }
+}
+
+static void format_disks(const ClientData *c, char *buf, size_t len)
+{
+    int i;
+    size_t used;
+
+    buf[0] = '\0';
+    if (c->disk_count <= 0 && c->fs_count <= 0) return;
+    used = (size_t)snprintf(buf, len, "    disk:");
+    for (i = 0; i < c->disk_count && used < len; i++) {
+        const TlvDisk *d = &c->disks[i];
+        used += (size_t)snprintf(buf + used, len - used,
+                                 " %s r %.0f w %.0f iops %.2f/%.2f MB/s await %.1fms q %u util %u%%",
+                                 d->name, d->rd_iops, d->wr_iops,
+                                 d->rd_bytes / 1e6, d->wr_bytes / 1e6,
+                                 d->await_ms, d->in_flight, d->util);
+        if (d->life_used && used < len) {
+            used += (size_t)snprintf(buf + used, len - used, " worn %u%%", d->life_used);
+        }
+    }
+    for (i = 0; i < c->fs_count && used < len; i++) {
+        const TlvFs *fs = &c->fs[i];
+        used += (size_t)snprintf(buf + used, len - used, "  %s %.1fG free of %.1fG",
+                                 fs->path, fs->free_mb / 1024.0, fs->total_mb / 1024.0);
+    }
+}
+
+/* Processes arrive in CPU order, followed by RSS-only entries. The CPU group
+ * is printed as received, the RSS group is re-sorted by resident size. */
+static void format_procs(const ClientData *c, char *buf, size_t len)
+{
+    const TlvProc *rss[MAX_PROCS];
+    int n_rss = 0;
+    int i, j;
+    size_t used;
+
+    buf[0] = '\0';
+    if (c->proc_count <= 0) return;
+
+    used = (size_t)snprintf(buf, len, "    top cpu:");
+    for (i = 0; i < c->proc_count; i++) {
+        const TlvProc *pr = &c->procs[i];
+        if ((pr->flags & PROC_TOP_CPU) && used < len) {
+            used += (size_t)snprintf(buf + used, len - used, " %s[%u] %.1f%%",
+                                     pr->comm, pr->pid, pr->cpu / 10.0);
+        }
+        if (pr->flags & PROC_TOP_RSS) {
+            for (j = n_rss; j > 0 && rss[j - 1]->rss_kb < pr->rss_kb; j--) rss[j] = rss[j - 1];
+            rss[j] = pr;
+            n_rss++;
+        }
+    }
+    if (used < len) used += (size_t)snprintf(buf + used, len - used, "  top rss:");
+    for (i = 0; i < n_rss && used < len; i++) {
+        used += (size_t)snprintf(buf + used, len - used, " %s[%u] %uM",
+                                 rss[i]->comm, rss[i]->pid, rss[i]->rss_kb / 1024);
+    }
+}
+
+static void format_cgroups(const ClientData *c, char *buf, size_t len)
+{
+    int i;
+    size_t used;
+
+    buf[0] = '\0';
+    if (c->cgroup_count <= 0) return;
+    used = (size_t)snprintf(buf, len, "    services:");
+    for (i = 0; i < c->cgroup_count && used < len; i++) {
+        const TlvCgroup *cg = &c->cgroups[i];
+        used += (size_t)snprintf(buf + used, len - used, " %s %.1f%% %uM io %.2f/%.2f MB/s",
+                                 cg->name, cg->cpu_pct, cg->mem_kb / 1024,
+                                 cg->rd_bytes / 1e6, cg->wr_bytes / 1e6);
+    }
+}
+
+/* The monitoring agent's own load; values over budget are marked with '!' */
+static void format_self(const ClientData *c, char *buf, size_t len)
+{
+    const TlvSelf *s = &c->self;
+
+    buf[0] = '\0';
+    if (!c->has_self) return;
+    snprintf(buf, len, "    agent: cpu %.2f%%%s rss %uM jitter %u ms%s work %u ms",
+             s->cpu_pct, s->cpu_pct > AGENT_CPU_WARN ? "!" : "",
+             s->rss_kb / 1024,
+             s->max_jitter_us / 1000, s->max_jitter_us > AGENT_JITTER_WARN_US ? "!" : "",
+             s->max_work_us / 1000);
+}
+
+/* Time at each frequency over the last interval, and the cooling steps in
+ * force; a cpufreq cooling device above 0 means thermal throttling ('!') */
+static void format_cpufreq(const ClientData *c, char *buf, size_t len)
+{
+    size_t used;
+    int i, k;
+
+    buf[0] = '\0';
+    if (c->freq_count <= 0 && c->cooling_count <= 0) return;
+    used = (size_t)snprintf(buf, len, "    cpufreq:");
+    for (i = 0; i < c->freq_count && used < len; i++) {
+        const TlvFreq *f = &c->freq[i];
+        used += (size_t)snprintf(buf + used, len - used, " policy%u %.1f trans/s",
+                                 f->policy, f->trans_per_sec);
+        for (k = 0; k < f->state_count && used < len; k++) {
+            used += (size_t)snprintf(buf + used, len - used, " %uM %.0f%%",
+                                     f->states[k].khz / 1000, f->states[k].share / 100.0);
+        }
+    }
+    if (c->cooling_count > 0 && used < len) {
+        used += (size_t)snprintf(buf + used, len - used, "  cooling:");
+    }
+    for (i = 0; i < c->cooling_count && used < len; i++) {
+        const TlvCooling *cd = &c->cooling[i];
+        int throttled = strncmp(cd->type, "cpufreq", 7) == 0 && cd->cur_state > 0;
+        used += (size_t)snprintf(buf + used, len - used, " %s %u/%u%s",
+                                 cd->type, cd->cur_state, cd->max_state, throttled ? "!" : "");
+    }
+}
+
+/* Spread of the header metrics between the last two sends */
+static void format_window(const ClientData *c, char *buf, size_t len)
+{
+    static const char *names[WIN_METRICS] = { "load", "temp", "mhz", "fan" };
+    size_t used;
+    int m;
+
+    buf[0] = '\0';
+    if (!c->window_mask) return;
+    used = (size_t)snprintf(buf, len, "    window (%u samples): min/mean/p95/max",
+                            (unsigned)c->window[c->window_mask & 1 ? WIN_LOAD : WIN_TEMP].count);
+    for (m = 0; m < WIN_METRICS && used < len; m++) {
+        const TlvWindow *w = &c->window[m];
+        if (!(c->window_mask & (1 << m))) continue;
+        used += (size_t)snprintf(buf + used, len - used, "  %s %.1f/%.1f/%.1f/%.1f",
+                                 names[m], w->min, w->mean, w->p95, w->max);
+    }
+}
+
+static void format_sequence(const ClientData *c, char *buf, size_t len)
+{
+    buf[0] = '\0';
+    if (!c->has_seq || c->count == 0) return;
+    snprintf(buf, len, "    acked: sample %llu, %u backfilled, %lld behind",
+             (unsigned long long)c->seq_acked, c->backfilled,
+             (long long)(c->seq_last - c->seq_acked));
+}
+
+/* The metrics off their baseline in the latest sample, and how far */
+static void format_anomaly(const ClientData *c, char *buf, size_t len)
+{
+    size_t used;
+    int m;
+
+    buf[0] = '\0';
+    if (!c->anom_mask) return;
+    used = (size_t)snprintf(buf, len, "    anomaly:");
+    for (m = 0; m < ANOM_METRICS && used < len; m++) {
+        const AnomalyStat *a = &c->anom[m];
+        if (!(c->anom_mask & (1 << m))) continue;
+        used += (size_t)snprintf(buf + used, len - used, " %s %.1f (z %+.1f, baseline %.1f)",
+                                 g_anomaly_names[m], a->value, a->z, a->mean);
+    }
+}
+
+typedef void (*DetailFormatter)(const ClientData *c, char *buf, size_t len);
+
+/* Indented lines printed under each client row; empty output is skipped */
+static const DetailFormatter g_detail_formatters[] = {
+    format_anomaly,
+    format_memory,
+    format_net,
+    format_disks,
+    format_procs,
+    format_cgroups,
+    format_sensors,
+    format_cpufreq,
+    format_window,
+    format_self,
+    format_sequence
+};
+
+#define DETAIL_COUNT ((int)(sizeof(g_detail_formatters) / sizeof(g_detail_formatters[0])))
+
+/* "avg/peak" for a header metric: the client's window when it sends one,
+ * else the mean and maximum of the samples held here */
+static void format_avg_peak(const ClientData *c, int metric, char *buf, size_t len)
+{
+    float avg = 0.0f;
+    float peak = 0.0f;
+    int j;
+
+    if (c->window_mask & (1 << metric)) {
+        avg = c->window[metric].mean;
+        peak = c->window[metric].max;
+    } else {
+        for (j = 0; j < c->count; j++) {
+            float v = sample_metric(&c->samples[j], metric);
+            avg += v;
+            if (j == 0 || v > peak) peak = v;
+        }
+        avg /= c->count;
+    }
+    if (metric == WIN_FAN || metric == WIN_MHZ) {
+        snprintf(buf, len, "%5d/%-5d", (int)avg, (int)peak);
+    } else {
+        snprintf(buf, len, "%5.1f/%-5.1f", avg, peak);
+    }
+}
+
+/* Row label: relayed clients carry their site */
+static void format_client_name(const ClientData *c, char *buf, size_t len)
+{
+    if (c->site[0]) {
+        snprintf(buf, len, "%.15s/%.31s", c->site, c->samples[0].client_id);
+    } else {
+        snprintf(buf, len, "%.31s", c->samples[0].client_id);
+    }
+}
+
+static void format_mem_avail(const ClientData *c, char *buf, size_t len)
+{
+    if (!c->has_memory) {
+        snprintf(buf, len, "-");
+        return;
+    }
+    snprintf(buf, len, "%uM", c->memory.mem_avail_kb / 1024);
+}
+
+/* Worst of the memory and io "some" stall shares */
+static void format_stall(const ClientData *c, char *buf, size_t len)
+{
+    uint16_t worst;
+    if (!c->has_pressure) {
+        snprintf(buf, len, "-");
+        return;
+    }
+    worst = c->pressure.some[PSI_MEMORY];
+    if (c->pressure.some[PSI_IO] > worst) worst = c->pressure.some[PSI_IO];
+    snprintf(buf, len, "%.1f%%", worst / 100.0);
+}
+
+/* Combined rx+tx of all interfaces in Mbit/s */
+static void format_net_total(const ClientData *c, char *buf, size_t len)
+{
+    int i;
+    double bytes = 0.0;
+
+    if (c->iface_count <= 0) {
+        snprintf(buf, len, "-");
+        return;
+    }
+    for (i = 0; i < c->iface_count; i++) {
+        bytes += c->ifaces[i].rx_bytes + c->ifaces[i].tx_bytes;
+    }
+    snprintf(buf, len, "%.2f", bytes * 8.0 / 1e6);
+}
+
+/* Worst average service time across the client's disks */
+static void format_disk_await(const ClientData *c, char *buf, size_t len)
+{
+    int i;
+    float worst = 0.0f;
+
+    if (c->disk_count <= 0) {
+        snprintf(buf, len, "-");
+        return;
+    }
+    for (i = 0; i < c->disk_count; i++) {
+        if (c->disks[i].await_ms > worst) worst = c->disks[i].await_ms;
+    }
+    snprintf(buf, len, "%.1f", worst);
+}
+
+/* Fleet aggregate ---------------------------------------------------------- */
+
+static int fleet_bucket(float v, float width, int buckets)
+{
+    int b = v > 0.0f ? (int)(v / width) : 0;
+    return b < buckets ? b : buckets - 1;
+}
+
+/* Caller holds the shard lock. Take the client's counted sample out. */
+static void fleet_remove(ClientShard *sh, ClientData *c)
+{
+    FleetAgg *f = &sh->fleet;
+    FleetSecond *sec;
+    int b;
+
+    if (!c->fleet_in) return;
+    if (c->fleet_temp >= 0) {
+        b = fleet_bucket(c->fleet_temp, FLEET_TEMP_WIDTH, FLEET_TEMP_BUCKETS);
+        f->temp[b]--;
+        f->temp_sum -= c->fleet_temp;
+        f->temp_count--;
+        if (c->fleet_prev) {
+            sh->clients[c->fleet_prev - 1].fleet_next = c->fleet_next;
+        } else {
+            f->temp_head[b] = c->fleet_next;
+        }
+        if (c->fleet_next) sh->clients[c->fleet_next - 1].fleet_prev = c->fleet_prev;
+    }
+    if (c->fleet_load >= 0) {
+        f->load[fleet_bucket(c->fleet_load, FLEET_LOAD_WIDTH, FLEET_LOAD_BUCKETS)]--;
+        f->load_sum -= c->fleet_load;
+        f->load_count--;
+    }
+    f->clients--;
+    sec = &f->seen[c->fleet_seen % OFFLINE_SECS];
+    if (sec->sec == c->fleet_seen && sec->count > 0) sec->count--;
+    c->fleet_in = 0;
+}
+
+/*
+ * Caller holds the shard lock. Count the client's new sample in place of
+ * the one before; O(1). A wheel slot still holding a second more than
+ * OFFLINE_SECS old is reused, which drops those clients from online. A
+ * client clock running ahead is clamped to rx, the receive time, so it
+ * cannot claim a wheel slot for the future.
+ */
+static void fleet_update(ClientShard *sh, ClientData *c, const TelemetryPacket *pkt,
+                         time_t rx)
+{
+    FleetAgg *f = &sh->fleet;
+    FleetSecond *sec;
+    int self = (int)(c - sh->clients) + 1;
+    int b;
+
+    fleet_remove(sh, c);
+    c->fleet_temp = pkt->cpu_temp;
+    c->fleet_load = pkt->cpu_load;
+    c->fleet_seen = pkt->timestamp;
+    if (rx > 0 && c->fleet_seen > (uint64_t)rx) c->fleet_seen = (uint64_t)rx;
+    if (c->fleet_temp >= 0) {
+        b = fleet_bucket(c->fleet_temp, FLEET_TEMP_WIDTH, FLEET_TEMP_BUCKETS);
+        f->temp[b]++;
+        f->temp_sum += c->fleet_temp;
+        f->temp_count++;
+        c->fleet_prev = 0;
+        c->fleet_next = f->temp_head[b];
+        if (c->fleet_next) sh->clients[c->fleet_next - 1].fleet_prev = self;
+        f->temp_head[b] = self;
+    }
+    if (c->fleet_load >= 0) {
+        f->load[fleet_bucket(c->fleet_load, FLEET_LOAD_WIDTH, FLEET_LOAD_BUCKETS)]++;
+        f->load_sum += c->fleet_load;
+        f->load_count++;
+    }
+    f->clients++;
+    sec = &f->seen[c->fleet_seen % OFFLINE_SECS];
+    if (sec->sec < c->fleet_seen) {
+        sec->sec = c->fleet_seen;
+        sec->count = 0;
+    }
+    if (sec->sec == c->fleet_seen) sec->count++;
+    c->fleet_in = 1;
+}
+
+/* Caller holds the shard lock. The entry leaves its hash chain for the
+ * free list. */
+static void clear_client_entry(ClientShard *sh, ClientData *c)
+{
+    int self = (int)(c - sh->clients) + 1;
+    int *link;
+
+    if (!c->in_use) return;
+    fleet_remove(sh, c);
+    link = client_chain(sh, c->samples[0].client_id, c->site);
+    while (*link != self) link = &sh->clients[*link - 1].hash_next;
+    *link = c->hash_next;
+    memset(c, 0, sizeof(*c));
+    c->hash_next = sh->client_free;
+    sh->client_free = self;
+}
+
+/* Caller holds the shard lock; the allocation is kept for reuse */
+static void reset_clients(ClientShard *sh)
+{
+    memset(&sh->fleet, 0, sizeof(sh->fleet));
+    memset(sh->client_hash, 0, sizeof(sh->client_hash));
+    sh->client_used = 0;
+    sh->client_free = 0;
+}
+
+static void clear_all_clients(void)
+{
+    int s;
+
+    for (s = 0; s < g_shard_count; s++) {
+        pthread_mutex_lock(&g_shards[s].mtx);
+        reset_clients(&g_shards[s]);
+        pthread_mutex_unlock(&g_shards[s].mtx);
+    }
+    pthread_mutex_lock(&g_line_mtx);
+    g_latest_text[0] = '\0';
+    g_latest_set = 0;
+    pthread_mutex_unlock(&g_line_mtx);
+}
+
+/* The clock the table is read against: the recorded one during a replay */
+static time_t view_time(void)
+{
+    return time(NULL) + g_view_offset;
+}
+
+static void clear_offline_clients(void)
+{
+    int s, i;
+    time_t now = view_time();
+
+    for (s = 0; s < g_shard_count; s++) {
+        pthread_mutex_lock(&g_shards[s].mtx);
+        for (i = 0; i < g_shards[s].client_used; i++) {
+            ClientData *c = &g_shards[s].clients[i];
+            int age;
+
+            if (!c->in_use) continue;
+            /* an entry that never got a live sample ages from its last datagram */
+            if (c->count > 0) {
+                age = (int)(now - (time_t)c->samples[c->count - 1].timestamp);
+            } else {
+                age = (int)(now - c->heard);
+            }
+            if (age < 0) age = 0;
+            if (age >= OFFLINE_SECS) {
+                clear_client_entry(&g_shards[s], c);
+            }
+        }
+        pthread_mutex_unlock(&g_shards[s].mtx);
+    }
+}
+
+/* Copy of the live clients of every shard, for the readers. Returns the
+ * count; *out is grown to hold them and kept by the caller for the next. */
+static int snapshot_clients(ClientData **out, int *cap, char *latest_text, size_t text_len)
+{
+    int s, i;
+    int n = 0;
+
+    for (s = 0; s < g_shard_count; s++) {
+        ClientShard *sh = &g_shards[s];
+
+        pthread_mutex_lock(&sh->mtx);
+        if (n + sh->client_used > *cap) {
+            ClientData *grown = grow_array(*out, cap, n + sh->client_used, sizeof(**out));
+            if (grown) *out = grown;
+        }
+        for (i = 0; i < sh->client_used && n < *cap; i++) {
+            if (sh->clients[i].count > 0) (*out)[n++] = sh->clients[i];
+        }
+        pthread_mutex_unlock(&sh->mtx);
+    }
+    pthread_mutex_lock(&g_line_mtx);
+    strncpy(latest_text, g_latest_text, text_len - 1);
+    latest_text[text_len - 1] = '\0';
+    pthread_mutex_unlock(&g_line_mtx);
+    return n;
+}
+
+/* The shards' fleet aggregates merged, and the hottest hosts */
+typedef struct {
+    float temp;
+    char name[CLIENT_ID_LEN + SITE_LEN];
+} FleetHot;
+
+typedef struct {
+    uint32_t clients;
+    uint32_t online;
+    uint32_t temp_count;
+    uint32_t load_count;
+    double temp_sum;
+    double load_sum;
+    uint32_t temp[FLEET_TEMP_BUCKETS];
+    uint32_t load[FLEET_LOAD_BUCKETS];
+    int hot_count;
+    FleetHot hot[FLEET_TOP];    /* min-heap on temp until sorted */
+} FleetSummary;
+
+/* Bounded min-heap: keep the FLEET_TOP hottest offered */
+static void fleet_hot_push(FleetSummary *f, const ClientData *c)
+{
+    FleetHot h;
+    int i = 0;
+
+    if (f->hot_count == FLEET_TOP && c->fleet_temp <= f->hot[0].temp) return;
+    h.temp = c->fleet_temp;
+    format_client_name(c, h.name, sizeof(h.name));
+    if (f->hot_count < FLEET_TOP) {
+        i = f->hot_count++;
+        while (i > 0 && f->hot[(i - 1) / 2].temp > h.temp) {
+            f->hot[i] = f->hot[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else {
+        for (;;) {
+            int child = 2 * i + 1;
+            if (child >= FLEET_TOP) break;
+            if (child + 1 < FLEET_TOP && f->hot[child + 1].temp < f->hot[child].temp) child++;
+            if (f->hot[child].temp >= h.temp) break;
+            f->hot[i] = f->hot[child];
+            i = child;
+        }
+    }
+    f->hot[i] = h;
+}
+
+/*
+ * Merge every shard's aggregate: a few hundred bucket counts each. Hottest
+ * hosts come from walking each shard's temperature buckets from the top,
+ * stopping once the heap is full of hosts hotter than any bucket left.
+ */
+static void snapshot_fleet(FleetSummary *out, time_t now)
+{
+    int s, b, i;
+
+    memset(out, 0, sizeof(*out));
+    for (s = 0; s < g_shard_count; s++) {
+        ClientShard *sh = &g_shards[s];
+        const FleetAgg *f = &sh->fleet;
+
+        pthread_mutex_lock(&sh->mtx);
+        out->clients += f->clients;
+        out->temp_count += f->temp_count;
+        out->load_count += f->load_count;
+        out->temp_sum += f->temp_sum;
+        out->load_sum += f->load_sum;
+        for (b = 0; b < FLEET_TEMP_BUCKETS; b++) out->temp[b] += f->temp[b];
+        for (b = 0; b < FLEET_LOAD_BUCKETS; b++) out->load[b] += f->load[b];
+        for (i = 0; i < OFFLINE_SECS; i++) {
+            if (f->seen[i].count && (int64_t)((uint64_t)now - f->seen[i].sec) < OFFLINE_SECS) {
+                out->online += f->seen[i].count;
+            }
+        }
+        for (b = FLEET_TEMP_BUCKETS - 1; b >= 0; b--) {
+            int idx;
+            /* the top bucket also holds everything above the range */
+            if (b < FLEET_TEMP_BUCKETS - 1 && out->hot_count == FLEET_TOP &&
+                out->hot[0].temp >= (b + 1) * FLEET_TEMP_WIDTH) {
+                break;
+            }
+            for (idx = f->temp_head[b]; idx; idx = sh->clients[idx - 1].fleet_next) {
+                fleet_hot_push(out, &sh->clients[idx - 1]);
+            }
+        }
+        pthread_mutex_unlock(&sh->mtx);
+    }
+    if (out->online > out->clients) out->online = out->clients;
+
+    for (i = 1; i < out->hot_count; i++) {
+        FleetHot h = out->hot[i];
+        int j = i;
+        while (j > 0 && out->hot[j - 1].temp < h.temp) {
+            out->hot[j] = out->hot[j - 1];
+            j--;
+        }
+        out->hot[j] = h;
+    }
+}
+
+/* Value at quantile q, interpolated within its bucket */
+static float fleet_quantile(const uint32_t *hist, int buckets, float width,
+                            uint32_t total, double q)
+{
+    double target = q * total;
+    double cum = 0.0;
+    int b;
+
+    for (b = 0; b < buckets; b++) {
+        if (hist[b] && cum + hist[b] >= target) {
+            return (float)((b + (target - cum) / hist[b]) * width);
+        }
+        cum += hist[b];
+    }
+    return buckets * width;
+}
+
+/* "   Name mean p50 p95 p99" of one metric, "   Name n/a" when no client has it */
+static size_t format_fleet_metric(char *line, size_t len, const char *name,
+                                  const uint32_t *hist, int buckets, float width,
+                                  uint32_t count, double sum)
+{
+    if (count == 0) return (size_t)snprintf(line, len, "   %s n/a", name);
+    return (size_t)snprintf(line, len, "   %s mean %.1f p50 %.1f p95 %.1f p99 %.1f",
+                            name, sum / count,
+                            fleet_quantile(hist, buckets, width, count, 0.50),
+                            fleet_quantile(hist, buckets, width, count, 0.95),
+                            fleet_quantile(hist, buckets, width, count, 0.99));
+}
+
+/* Panel lines above the table; "" when no client is known */
+static void format_fleet(const FleetSummary *f, char *line, size_t len)
+{
+    size_t used;
+
+    line[0] = '\0';
+    if (f->clients == 0) return;
+    used = (size_t)snprintf(line, len, "  Fleet: %u online, %u offline",
+                            f->online, f->clients - f->online);
+    if (used < len) {
+        used += format_fleet_metric(line + used, len - used, "Temp", f->temp,
+                                    FLEET_TEMP_BUCKETS, FLEET_TEMP_WIDTH,
+                                    f->temp_count, f->temp_sum);
+    }
+    if (used < len) {
+        format_fleet_metric(line + used, len - used, "Load", f->load,
+                            FLEET_LOAD_BUCKETS, FLEET_LOAD_WIDTH,
+                            f->load_count, f->load_sum);
+    }
+}
+
+static void format_fleet_hot(const FleetSummary *f, char *line, size_t len)
+{
+    size_t used;
+    int i;
+
+    line[0] = '\0';
+    if (f->hot_count == 0) return;
+    used = (size_t)snprintf(line, len, "  Hottest:");
+    for (i = 0; i < f->hot_count && used < len; i++) {
+        used += (size_t)snprintf(line + used, len - used, "%s %s %.1f C",
+                                 i ? "," : "", f->hot[i].name, f->hot[i].temp);
+    }
+}
+
+static int append_text(char **buf, size_t *len, size_t *cap, const char *text)
+{
+    size_t add = strlen(text);
+    char *tmp;
+    if (*len + add + 1 > *cap) {
+        size_t new_cap = *cap ? *cap : 1024;
+        while (*len + add + 1 > new_cap) new_cap *= 2;
+        tmp = (char *)realloc(*buf, new_cap);
+        if (!tmp) return 0;
+        *buf = tmp;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, text, add);
+    *len += add;
+    (*buf)[*len] = '\0';
+    return 1;
+}
+
+/* Totals over the shards, and the source that lost most; "" without drops */
+static void format_flood(char *buf, size_t len)
+{
+    uint64_t src = 0, id = 0, worst = 0;
+    const FloodBucket *worst_b = NULL;
+    int s, i;
+
+    buf[0] = '\0';
+    for (s = 0; s < g_shard_count; s++) {
+        src += __atomic_load_n(&g_shards[s].dropped_src, __ATOMIC_RELAXED);
+        id += __atomic_load_n(&g_shards[s].dropped_id, __ATOMIC_RELAXED);
+    }
+    if (src + id == 0) return;
+    for (s = 0; s < g_shard_count; s++) {
+        for (i = 0; i < FLOOD_SLOTS; i++) {
+            const FloodBucket *b = &g_shards[s].src_flood[i];
+            uint64_t d = __atomic_load_n(&b->dropped, __ATOMIC_RELAXED);
+            if (d > worst) {
+                worst = d;
+                worst_b = b;
+            }
+        }
+    }
+    if (worst_b) {
+        struct sockaddr_storage ss;
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+        char addr[INET6_ADDRSTRLEN];
+
+        memset(&ss, 0, sizeof(ss));
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, worst_b->key, 16);
+        format_addr(&ss, addr, sizeof(addr));
+        snprintf(buf, len, "  flood drops: %llu by source, %llu by client_id; most from %s (%llu)",
+                 (unsigned long long)src, (unsigned long long)id, addr,
+                 (unsigned long long)worst);
+    } else {
+        snprintf(buf, len, "  flood drops: %llu by source, %llu by client_id",
+                 (unsigned long long)src, (unsigned long long)id);
+    }
+}
+
+static void format_table_header(char *line, size_t len)
+{
+    snprintf(line, len, "%-32s %-*s %11s %11s %11s %11s %8s %8s %8s %8s %8s %s",
+             "Client", IP_COL_W, "IP", "Load avg/pk", "Temp avg/pk", "Fan avg/pk", "MHz avg/pk", "Hot Core",
+             "MemAvail", "Stall", "Net Mb/s", "Await ms", "Seen");
+}
+
+/* One table row of a client with samples, without the newline */
+static void format_client_row(const ClientData *c, time_t now, char *line, size_t len)
+{
+    char load[12];
+    char temp[12];
+    char fan[12];
+    char mhz[12];
+    char name[CLIENT_ID_LEN + SITE_LEN];
+    TelemetryPacket last;
+    int age;
+    char ip[INET6_ADDRSTRLEN];
+    char seen_time[64];
+    char hot[16];
+    char mem[16];
+    char stall[16];
+    char net[16];
+    char await[16];
+    const char *seen;
+
+    format_avg_peak(c, WIN_LOAD, load, sizeof(load));
+    format_avg_peak(c, WIN_TEMP, temp, sizeof(temp));
+    format_avg_peak(c, WIN_FAN, fan, sizeof(fan));
+    format_avg_peak(c, WIN_MHZ, mhz, sizeof(mhz));
+
+    last = c->samples[c->count - 1];
+    age = (int)(now - (time_t)last.timestamp);
+    if (age < 0) age = 0;
+    format_time(last.timestamp, seen_time, sizeof(seen_time));
+    seen = (age < OFFLINE_SECS) ? seen_time + 11 : "offline";
+    format_addr(&c->last_addr, ip, sizeof(ip));
+    format_client_name(c, name, sizeof(name));
+    format_hot_core(c, hot, sizeof(hot));
+    format_mem_avail(c, mem, sizeof(mem));
+    format_stall(c, stall, sizeof(stall));
+    format_net_total(c, net, sizeof(net));
+    format_disk_await(c, await, sizeof(await));
+
+    snprintf(line, len, "%-32s %-*s %11s %11s %11s %11s %8s %8s %8s %8s %8s %s",
+             name,
+             IP_COL_W, ip[0] ? ip : "0.0.0.0",
+             load,
+             temp,
+             fan,
+             mhz,
+             hot,
+             mem,
+             stall,
+             net,
+             await,
+             seen);
+}
+
+static char *build_clients_snapshot(void)
+{
+    static ClientData *clients;
+    static int clients_cap;
+    int client_count;
+    char latest_text[MAX_LINE];
+    char *buf = NULL;
+    size_t cap = 0;
+    size_t len = 0;
+    char line[320];
+    char detail[MAX_LINE];
+    char ts[64];
+    FleetSummary fleet;
+    int i;
+    int visible = 0;
+    time_t now = view_time();
+
+    client_count = snapshot_clients(&clients, &clients_cap, latest_text, sizeof(latest_text));
+
+    format_time((uint64_t)now, ts, sizeof(ts));
+    snprintf(line, sizeof(line), "          %s\n", ts);
+    if (!append_text(&buf, &len, &cap, line)) return NULL;
+    format_flood(detail, sizeof(detail));
+    if (detail[0] &&
+        (!append_text(&buf, &len, &cap, detail) ||
+         !append_text(&buf, &len, &cap, "\n"))) {
+        free(buf);
+        return NULL;
+    }
+    snapshot_fleet(&fleet, now);
+    format_fleet(&fleet, detail, sizeof(detail));
+    if (detail[0] &&
+        (!append_text(&buf, &len, &cap, detail) ||
+         !append_text(&buf, &len, &cap, "\n"))) {
+        free(buf);
+        return NULL;
+    }
+    format_fleet_hot(&fleet, detail, sizeof(detail));
+    if (detail[0] &&
+        (!append_text(&buf, &len, &cap, detail) ||
+         !append_text(&buf, &len, &cap, "\n"))) {
+        free(buf);
+        return NULL;
+    }
+
+    format_table_header(line, sizeof(line));
+    if (!append_text(&buf, &len, &cap, line) || !append_text(&buf, &len, &cap, "\n")) {
+        free(buf);
+        return NULL;
+    }
+
+    for (i = 0; i < client_count; i++) {
+        int d;
+
+        if (clients[i].count <= 0) continue;
+        format_client_row(&clients[i], now, line, sizeof(line));
+        if (!append_text(&buf, &len, &cap, line) || !append_text(&buf, &len, &cap, "\n")) {
+            free(buf);
+            return NULL;
+        }
+        for (d = 0; d < DETAIL_COUNT; d++) {
+            g_detail_formatters[d](&clients[i], detail, sizeof(detail));
+            if (detail[0] &&
+                (!append_text(&buf, &len, &cap, detail) ||
+                 !append_text(&buf, &len, &cap, "\n"))) {
+                free(buf);
+                return NULL;
+            }
+        }
+        visible++;
+    }
+
+    if (visible == 0) {
+        if (latest_text[0]) {
+            if (!append_text(&buf, &len, &cap, latest_text) ||
+                !append_text(&buf, &len, &cap, "\n")) {
+                free(buf);
+                return NULL;
+            }
+        } else {
+            if (!append_text(&buf, &len, &cap, "No clients connected.\n")) {
+                free(buf);
+                return NULL;
+            }
+        }
+    }
+    return buf;
+}
+
+static void draw_text(Display *dpy, Window win, GC gc, int x, int y, const char *text)
+{
+    XDrawString(dpy, win, gc, x, y, text, (int)strlen(text));
+}
+
+static void draw_menu(Display *dpy, Window win, GC gc, int line_height)
+{
+    int i;
+    unsigned long black = BlackPixel(dpy, DefaultScreen(dpy));
+    unsigned long white = WhitePixel(dpy, DefaultScreen(dpy));
+
+    XSetForeground(dpy, gc, white);
+    XFillRectangle(dpy, win, gc, 0, 0, WINDOW_W, MENU_BAR_H);
+    XSetForeground(dpy, gc, black);
+    XDrawRectangle(dpy, win, gc, 0, 0, WINDOW_W - 1, MENU_BAR_H - 1);
+    draw_text(dpy, win, gc, MENU_PAD_X, 16, "Edit");
+
+    if (!g_menu_open) return;
+
+    XSetForeground(dpy, gc, white);
+    XFillRectangle(dpy, win, gc, MENU_PAD_X + 1, MENU_BAR_H + 1,
+                   MENU_DROP_W - 1, MENU_ITEM_H * MENU_COUNT - 1);
+    XSetForeground(dpy, gc, black);
+    XDrawRectangle(dpy, win, gc, MENU_PAD_X, MENU_BAR_H,
+                   MENU_DROP_W, MENU_ITEM_H * MENU_COUNT);
+    for (i = 0; i < MENU_COUNT; i++) {
+        int y = MENU_BAR_H + i * MENU_ITEM_H;
+        if (i == MENU_SEPARATOR) {
+            int line_y = y + (MENU_ITEM_H / 2);
+            XDrawLine(dpy, win, gc,
+                      MENU_PAD_X + 8, line_y,
+                      MENU_PAD_X + MENU_DROP_W - 8, line_y);
+            continue;
+        }
+        if (i == g_menu_hover) {
+            XFillRectangle(dpy, win, gc, MENU_PAD_X + 1, y + 1,
+                           MENU_DROP_W - 1, MENU_ITEM_H - 1);
+            XSetForeground(dpy, gc, WhitePixel(dpy, DefaultScreen(dpy)));
+            draw_text(dpy, win, gc, MENU_PAD_X + 8, y + (line_height - 2), g_menu_items[i]);
+            XSetForeground(dpy, gc, BlackPixel(dpy, DefaultScreen(dpy)));
+        } else {
+            draw_text(dpy, win, gc, MENU_PAD_X + 8, y + (line_height - 2), g_menu_items[i]);
+        }
+    }
+}
+
+/* Heatmap ------------------------------------------------------------------ */
+
+/* Blue through green and yellow to red, allocated once */
+static void heat_palette(Display *dpy)
+{
+    Colormap cmap = DefaultColormap(dpy, DefaultScreen(dpy));
+    XColor xc;
+    int i;
+
+    if (g_heat.palette_ready) return;
+    for (i = 0; i < HEAT_COLORS; i++) {
+        float t = (float)i / (HEAT_COLORS - 1);
+        float r = t < 0.5f ? 0.0f : (t - 0.5f) * 2.0f;
+        float g = t < 0.5f ? t * 2.0f : (1.0f - t) * 2.0f;
+        float b = t < 0.5f ? 1.0f - t * 2.0f : 0.0f;
+
+        if (t >= 0.5f && g < 1.0f) r = 1.0f;
+        xc.red = (unsigned short)(r * 65535.0f);
+        xc.green = (unsigned short)(g * 65535.0f);
+        xc.blue = (unsigned short)(b * 65535.0f);
+        xc.flags = DoRed | DoGreen | DoBlue;
+        g_heat.palette[i] = XAllocColor(dpy, cmap, &xc) ? xc.pixel
+                                                          : BlackPixel(dpy, DefaultScreen(dpy));
+    }
+    xc.red = xc.green = xc.blue = 0xa000;
+    xc.flags = DoRed | DoGreen | DoBlue;
+    g_heat.offline_pixel = XAllocColor(dpy, cmap, &xc) ? xc.pixel
+                                                        : WhitePixel(dpy, DefaultScreen(dpy));
+    g_heat.palette_ready = 1;
+}
+
+#ifdef HAVE_XSHM
+static int g_heat_shm_failed = 0;
+
+static int heat_shm_error(Display *dpy, XErrorEvent *err)
+{
+    (void)dpy;
+    (void)err;
+    g_heat_shm_failed = 1;
+    return 0;
+}
+#endif
+
+/* Image of w x h for the grid, shared with the server when it can be. A
+ * remote display refuses the attach, and the image is then a plain one. */
+static XImage *heat_image(Display *dpy, int w, int h)
+{
+    int screen = DefaultScreen(dpy);
+    XImage *img;
+
+    if (g_heat.img) return g_heat.img;
+#ifdef HAVE_XSHM
+    if (XShmQueryExtension(dpy)) {
+        XShmSegmentInfo *si = &g_heat.shminfo;
+        int (*old)(Display *, XErrorEvent *);
+
+        img = XShmCreateImage(dpy, DefaultVisual(dpy, screen), (unsigned int)DefaultDepth(dpy, screen),
+                              ZPixmap, NULL, si, (unsigned int)w, (unsigned int)h);
+        if (img) {
+            si->shmid = shmget(IPC_PRIVATE, (size_t)img->bytes_per_line * (size_t)h, IPC_CREAT | 0600);
+            si->shmaddr = si->shmid >= 0 ? shmat(si->shmid, NULL, 0) : (char *)-1;
+            if (si->shmaddr != (char *)-1) {
+                img->data = si->shmaddr;
+                si->readOnly = False;
+                g_heat_shm_failed = 0;
+                old = XSetErrorHandler(heat_shm_error);
+                XShmAttach(dpy, si);
+                XSync(dpy, False);
+                XSetErrorHandler(old);
+                /* removed now, freed when both sides have detached */
+                shmctl(si->shmid, IPC_RMID, NULL);
+                if (!g_heat_shm_failed) {
+                    g_heat.img = img;
+                    g_heat.shm = 1;
+                    return img;
+                }
+                shmdt(si->shmaddr);
+            } else if (si->shmid >= 0) {
+                shmctl(si->shmid, IPC_RMID, NULL);
+            }
+            img->data = NULL;
+            XDestroyImage(img);
+        }
+    }
+#endif
+    img = XCreateImage(dpy, DefaultVisual(dpy, screen), (unsigned int)DefaultDepth(dpy, screen),
+                       ZPixmap, 0, NULL, (unsigned int)w, (unsigned int)h, 32, 0);
+    if (!img) return NULL;
+    img->data = malloc((size_t)img->bytes_per_line * (size_t)h);
+    if (!img->data) {
+        XDestroyImage(img);
+        return NULL;
+    }
+    g_heat.img = img;
+    g_heat.shm = 0;
+    return img;
+}
+
+static void heat_image_free(Display *dpy)
+{
+    if (!g_heat.img) return;
+#ifdef HAVE_XSHM
+    if (g_heat.shm) {
+        XShmDetach(dpy, &g_heat.shminfo);
+        shmdt(g_heat.shminfo.shmaddr);
+        g_heat.img->data = NULL;
+    }
+#endif
+    (void)dpy;
+    XDestroyImage(g_heat.img);
+    g_heat.img = NULL;
+}
+
+static int heat_cell_cmp(const void *a, const void *b)
+{
+    return strcmp(((const HeatCell *)a)->name, ((const HeatCell *)b)->name);
+}
+
+/* What each cell needs, by name so cells keep their place between draws */
+static int snapshot_cells(HeatCell **cells, int *cap, time_t now)
+{
+    int s, i;
+    int n = 0;
+
+    for (s = 0; s < g_shard_count; s++) {
+        ClientShard *sh = &g_shards[s];
+
+        pthread_mutex_lock(&sh->mtx);
+        if (n + sh->client_used > *cap) {
+            HeatCell *grown = grow_array(*cells, cap, n + sh->client_used, sizeof(**cells));
+            if (grown) *cells = grown;
+        }
+        for (i = 0; i < sh->client_used && n < *cap; i++) {
+            const ClientData *c = &sh->clients[i];
+            HeatCell *out = *cells;
+            const TelemetryPacket *last;
+
+            if (c->count <= 0) continue;
+            last = &c->samples[c->count - 1];
+            out[n].value = sample_metric(last, g_heat_metric);
+            out[n].online = (int)(now - (time_t)last->timestamp) < OFFLINE_SECS;
+            out[n].anomalous = c->anom_mask != 0;
+            format_client_name(c, out[n].name, sizeof(out[n].name));
+            n++;
+        }
+        pthread_mutex_unlock(&sh->mtx);
+    }
+    if (n > 0) qsort(*cells, (size_t)n, sizeof(**cells), heat_cell_cmp);
+    return n;
+}
+
+/* Copy of the client shown as name; 0 when it is gone */
+static int find_client(const char *name, ClientData *out)
+{
+    char have[CLIENT_ID_LEN + SITE_LEN];
+    int s, i;
+
+    for (s = 0; s < g_shard_count; s++) {
+        pthread_mutex_lock(&g_shards[s].mtx);
+        for (i = 0; i < g_shards[s].client_used; i++) {
+            const ClientData *c = &g_shards[s].clients[i];
+            if (c->count <= 0) continue;
+            format_client_name(c, have, sizeof(have));
+            if (strcmp(have, name) == 0) {
+                *out = *c;
+                pthread_mutex_unlock(&g_shards[s].mtx);
+                return 1;
+            }
+        }
+        pthread_mutex_unlock(&g_shards[s].mtx);
+    }
+    return 0;
+}
+
+static unsigned long heat_pixel(const HeatCell *cell)
+{
+    float lo = g_heat_metric == WIN_TEMP ? HEAT_TEMP_LO : 0.0f;
+    float hi = g_heat_metric == WIN_TEMP ? HEAT_TEMP_HI : 100.0f;
+    int idx;
+
+    if (!cell->online) return g_heat.offline_pixel;
+    idx = (int)((cell->value - lo) / (hi - lo) * (HEAT_COLORS - 1) + 0.5f);
+    if (idx < 0) idx = 0;
+    if (idx >= HEAT_COLORS) idx = HEAT_COLORS - 1;
+    return g_heat.palette[idx];
+}
+
+/* Fill a rectangle of the image. 32-bit images in host byte order are
+ * written directly; anything else, e.g. a remote server of the other
+ * endianness, goes through XPutPixel. */
+static void heat_fill(XImage *img, int x, int y, int w, int h, unsigned long pixel)
+{
+    const uint16_t one = 1;
+    int host_order = *(const unsigned char *)&one ? LSBFirst : MSBFirst;
+    int i, j;
+
+    if (img->bits_per_pixel == 32 && img->byte_order == host_order) {
+        for (j = y; j < y + h; j++) {
+            uint32_t *row = (uint32_t *)(img->data + (size_t)j * img->bytes_per_line) + x;
+            for (i = 0; i < w; i++) row[i] = (uint32_t)pixel;
+        }
+        return;
+    }
+    for (j = y; j < y + h; j++) {
+        for (i = 0; i < w; i++) XPutPixel(img, x + i, j, pixel);
+    }
+}
+
+/*
+ * The heatmap below the header lines at y: a legend, the grid sent as one
+ * image, then the selected client's row and details. Cells are the largest
+ * square size, within limits, that fits every client in the space left.
+ */
+static void redraw_heatmap(Display *dpy, Window win, GC gc, int x, int y,
+                           int line_height, time_t now)
+{
+    static ClientData sel;
+    int screen = DefaultScreen(dpy);
+    int grid_w = WINDOW_W - 2 * x;
+    int grid_h = WINDOW_H - y - HEAT_DETAIL_LINES * line_height;
+    unsigned long white = WhitePixel(dpy, screen);
+    unsigned long black = BlackPixel(dpy, screen);
+    XImage *img;
+    char line[320];
+    char detail[MAX_LINE];
+    int n, i, cell, cols, rows, used_h, shown;
+
+    if (g_heat_metric == WIN_TEMP) {
+        snprintf(line, sizeof(line), "  Heatmap by temperature: blue %.0f C, red %.0f C",
+                 HEAT_TEMP_LO, HEAT_TEMP_HI);
+    } else {
+        snprintf(line, sizeof(line), "  Heatmap by load: blue 0%%, red 100%%");
+    }
+    strncat(line, "; grey offline, framed anomalous or selected. Click a cell for details.",
+            sizeof(line) - strlen(line) - 1);
+    draw_text(dpy, win, gc, x, y, line);
+    y += line_height / 2;
+
+    n = snapshot_cells(&g_heat.cells, &g_heat.cells_cap, now);
+    g_heat.count = 0;
+    g_heat.x0 = x;
+    g_heat.y0 = y;
+    g_heat.cell = 0;
+    if (n == 0 || grid_h < HEAT_CELL_MIN) {
+        draw_text(dpy, win, gc, x, y + line_height, "No clients connected.");
+        return;
+    }
+
+    for (cell = HEAT_CELL_MAX; cell > HEAT_CELL_MIN; cell--) {
+        cols = grid_w / cell;
+        if (((n + cols - 1) / cols) * cell <= grid_h) break;
+    }
+    cols = grid_w / cell;
+    rows = (n + cols - 1) / cols;
+    if (rows * cell > grid_h) rows = grid_h / cell;
+    used_h = rows * cell;
+    shown = n < rows * cols ? n : rows * cols;
+    g_heat.cell = cell;
+    g_heat.cols = cols;
+    g_heat.count = shown;
+
+    heat_palette(dpy);
+    img = heat_image(dpy, grid_w, WINDOW_H);
+    if (!img) return;
+    heat_fill(img, 0, 0, grid_w, used_h, white);
+    for (i = 0; i < shown; i++) {
+        int cx = (i % cols) * cell;
+        int cy = (i / cols) * cell;
+
+        heat_fill(img, cx, cy, cell - 1, cell - 1, heat_pixel(&g_heat.cells[i]));
+        if (g_heat.cells[i].anomalous || strcmp(g_heat.cells[i].name, g_heat_selected) == 0) {
+            heat_fill(img, cx, cy, cell - 1, 1, black);
+            heat_fill(img, cx, cy + cell - 2, cell - 1, 1, black);
+            heat_fill(img, cx, cy, 1, cell - 1, black);
+            heat_fill(img, cx + cell - 2, cy, 1, cell - 1, black);
+        }
+    }
+#ifdef HAVE_XSHM
+    if (g_heat.shm) {
+        XShmPutImage(dpy, win, gc, img, 0, 0, x, y, (unsigned int)grid_w, (unsigned int)used_h, False);
+        /* the next draw rewrites the segment; let the server finish reading */
+        XSync(dpy, False);
+    } else
+#endif
+    {
+        XPutImage(dpy, win, gc, img, 0, 0, x, y, (unsigned int)grid_w, (unsigned int)used_h);
+    }
+    y += used_h + line_height;
+    if (shown < n) {
+        snprintf(line, sizeof(line), "  %d more clients do not fit", n - shown);
+        draw_text(dpy, win, gc, x, y, line);
+        y += line_height;
+    }
+
+    if (!g_heat_selected[0] || !find_client(g_heat_selected, &sel)) return;
+    format_table_header(line, sizeof(line));
+    draw_text(dpy, win, gc, x, y, line);
+    y += line_height;
+    format_client_row(&sel, now, line, sizeof(line));
+    draw_text(dpy, win, gc, x, y, line);
+    y += line_height;
+    for (i = 0; i < DETAIL_COUNT && y < WINDOW_H; i++) {
+        g_detail_formatters[i](&sel, detail, sizeof(detail));
+        if (detail[0]) {
+            draw_text(dpy, win, gc, x, y, detail);
+            y += line_height;
+        }
+    }
+}
+
+/* Select the cell under a click; 1 when there was one */
+static int heat_hit(int px, int py)
+{
+    int col, row, i;
+
+    if (!g_heatmap || g_heat.cell <= 0) return 0;
+    if (px < g_heat.x0 || py < g_heat.y0) return 0;
+    col = (px - g_heat.x0) / g_heat.cell;
+    row = (py - g_heat.y0) / g_heat.cell;
+    if (col >= g_heat.cols) return 0;
+    i = row * g_heat.cols + col;
+    if (i >= g_heat.count) return 0;
+    snprintf(g_heat_selected, sizeof(g_heat_selected), "%s", g_heat.cells[i].name);
+    return 1;
+}
+
+static void redraw_window(Display *dpy, Window win, GC gc, int line_height)
+{
+    static ClientData *clients;
+    static int clients_cap;
+    int client_count;
+    char latest_text[MAX_LINE];
+    char line[320];
+    char detail[MAX_LINE];
+    char timebuf[64];
+    FleetSummary fleet;
+    int i;
+    int visible_clients = 0;
+    time_t now;
+    int x = 10;
+    int y = MENU_BAR_H + 20;
+
+    now = view_time();
+    format_time((uint64_t)now, timebuf, sizeof(timebuf));
+
+    XClearWindow(dpy, win);
+
+    snprintf(line, sizeof(line), "          %s", timebuf);
+    draw_text(dpy, win, gc, x, y, line);
+    y += line_height;
+    format_flood(detail, sizeof(detail));
+    if (detail[0]) {
+        draw_text(dpy, win, gc, x, y, detail);
+        y += line_height;
+    }
+    snapshot_fleet(&fleet, now);
+    format_fleet(&fleet, detail, sizeof(detail));
+    if (detail[0]) {
+        draw_text(dpy, win, gc, x, y, detail);
+        y += line_height;
+    }
+    format_fleet_hot(&fleet, detail, sizeof(detail));
+    if (detail[0]) {
+        draw_text(dpy, win, gc, x, y, detail);
+        y += line_height;
+    }
+
+    if (g_heatmap) {
+        redraw_heatmap(dpy, win, gc, x, y, line_height, now);
+        draw_menu(dpy, win, gc, line_height);
+        XFlush(dpy);
+        return;
+    }
+
+    client_count = snapshot_clients(&clients, &clients_cap, latest_text, sizeof(latest_text));
+    format_table_header(line, sizeof(line));
     draw_text(dpy, win, gc, x, y, line);
     y += line_height;
 
-    snprintf(line, sizeof(line), "%-32s %-15s %8s %8s %8s %8s %s",
-             "Client", "IP", "Avg Load", "Avg Temp", "Avg Fan", "Avg MHz", "Seen");
-    draw_text(dpy, win, gc, x, y, line);
-    y += line_height;
+    for (i = 0; i < client_count; i++) {
+        int d;
+
+        if (clients[i].count <= 0) continue;
+        format_client_row(&clients[i], now, line, sizeof(line));
+        if (clients[i].anom_mask) {
+            /* Inverse video, like the hovered menu item */
+            XFillRectangle(dpy, win, gc, x - 4, y - line_height + 5,
+                           WINDOW_W - 2 * x + 8, line_height);
+            XSetForeground(dpy, gc, WhitePixel(dpy, DefaultScreen(dpy)));
+            draw_text(dpy, win, gc, x, y, line);
+            XSetForeground(dpy, gc, BlackPixel(dpy, DefaultScreen(dpy)));
+        } else {
+            draw_text(dpy, win, gc, x, y, line);
+        }
+        y += line_height;
+        for (d = 0; d < DETAIL_COUNT; d++) {
+            g_detail_formatters[d](&clients[i], detail, sizeof(detail));
+            if (detail[0]) {
+                draw_text(dpy, win, gc, x, y, detail);
+                y += line_height;
+            }
+        }
+        visible_clients++;
+    }
+
+    if (visible_clients == 0) {
+        draw_text(dpy, win, gc, x, y,
+                  latest_text[0] ? latest_text : "No clients connected.");
+    }
+
+    draw_menu(dpy, win, gc, line_height);
+
+    XFlush(dpy);
+}
+
+static void redraw_prefs(Display *dpy, Window prefs, GC gc)
+{
+    char line[128];
+
+    XClearWindow(dpy, prefs);
+    draw_text(dpy, prefs, gc, 12, 24, "Preferences");
+
+    XDrawRectangle(dpy, prefs, gc, 14, 38, 14, 14);
+    if (g_prefs_checkbox) {
+        XDrawLine(dpy, prefs, gc, 16, 45, 20, 50);
+        XDrawLine(dpy, prefs, gc, 20, 50, 27, 40);
+    }
+    draw_text(dpy, prefs, gc, 36, 50, "Start minimized");
+
+    XDrawRectangle(dpy, prefs, gc, 170, 98, 74, 28);
+    draw_text(dpy, prefs, gc, 194, 116, "Save");
+
+    XDrawRectangle(dpy, prefs, gc, 258, 98, 86, 28);
+    draw_text(dpy, prefs, gc, 282, 116, "Cancel");
+
+    snprintf(line, sizeof(line), "Config: ~/.PiMon/config.json");
+    draw_text(dpy, prefs, gc, 12, 82, line);
+    XFlush(dpy);
+}
+
+static void open_preferences_dialog(Display *dpy, int screen, Window parent, Atom wm_delete_window)
+{
+    int display_w = DisplayWidth(dpy, screen);
+    int display_h = DisplayHeight(dpy, screen);
+    int x = (display_w - PREF_W) / 2;
+    int y = (display_h - PREF_H) / 2;
+
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+
+    if (g_prefs_win != None) {
+        XRaiseWindow(dpy, g_prefs_win);
+        return;
+    }
+
+    g_prefs_checkbox = g_prefs.start_minimized;
+    g_prefs_win = XCreateSimpleWindow(dpy, RootWindow(dpy, screen),
+                                      x, y, PREF_W, PREF_H, 1,
+                                      BlackPixel(dpy, screen),
+                                      WhitePixel(dpy, screen));
+    XStoreName(dpy, g_prefs_win, "Preferences");
+    XSetTransientForHint(dpy, g_prefs_win, parent);
+    XSelectInput(dpy, g_prefs_win,
+                 ExposureMask | ButtonPressMask | StructureNotifyMask | KeyPressMask);
+    XSetWMProtocols(dpy, g_prefs_win, &wm_delete_window, 1);
+    XMapWindow(dpy, g_prefs_win);
+}
+
+static void close_preferences_dialog(Display *dpy)
+{
+    if (g_prefs_win != None) {
+        XDestroyWindow(dpy, g_prefs_win);
+        g_prefs_win = None;
+    }
+}
+
+static int menu_hit_item(int x, int y)
+{
+    int rel;
+    if (x < MENU_PAD_X || x > (MENU_PAD_X + MENU_DROP_W)) return -1;
+    if (y < MENU_BAR_H || y > (MENU_BAR_H + MENU_ITEM_H * MENU_COUNT)) return -1;
+    rel = (y - MENU_BAR_H) / MENU_ITEM_H;
+    if (rel < 0 || rel >= MENU_COUNT) return -1;
+    if (rel == MENU_SEPARATOR) return -1;
+    return rel;
+}
+
+static int menu_hit_edit(int x, int y)
+{
+    return (y >= 0 && y <= MENU_BAR_H && x >= MENU_PAD_X && x <= (MENU_PAD_X + MENU_EDIT_W));
+}
+
+static void handle_selection_request(Display *dpy,
+                                     XSelectionRequestEvent *req,
+                                     Atom atom_clipboard,
+                                     Atom atom_targets,
+                                     Atom atom_utf8)
+{
+    XEvent resp;
+    Atom property = req->property ? req->property : req->target;
+
+    memset(&resp, 0, sizeof(resp));
+    resp.xselection.type = SelectionNotify;
+    resp.xselection.display = req->display;
+    resp.xselection.requestor = req->requestor;
+    resp.xselection.selection = req->selection;
+    resp.xselection.target = req->target;
+    resp.xselection.time = req->time;
+    resp.xselection.property = None;
+
+    if (!g_clip_text) {
+        XSendEvent(dpy, req->requestor, False, 0, &resp);
+        return;
+    }
+
+    if (req->target == atom_targets) {
+        Atom targets[3];
+        int count = 0;
+        targets[count++] = XA_STRING;
+        targets[count++] = atom_utf8;
+        targets[count++] = atom_targets;
+        XChangeProperty(dpy, req->requestor, property, XA_ATOM, 32,
+                        PropModeReplace, (unsigned char *)targets, count);
+        resp.xselection.property = property;
+    } else if (req->target == XA_STRING || req->target == atom_utf8) {
+        Atom type = (req->target == atom_utf8) ? atom_utf8 : XA_STRING;
+        XChangeProperty(dpy, req->requestor, property, type, 8,
+                        PropModeReplace,
+                        (const unsigned char *)g_clip_text,
+                        (int)strlen(g_clip_text));
+        resp.xselection.property = property;
+    }
+
+    XSendEvent(dpy, req->requestor, False, 0, &resp);
+    XFlush(dpy);
+    (void)atom_clipboard;
+}
+
+static void set_clipboard_text(Display *dpy, Window owner, const char *text, Atom atom_clipboard)
+{
+    free(g_clip_text);
+    g_clip_text = NULL;
+
+    if (!text) return;
+    g_clip_text = strdup(text);
+    if (!g_clip_text) return;
+
+    XSetSelectionOwner(dpy, XA_PRIMARY, owner, CurrentTime);
+    XSetSelectionOwner(dpy, atom_clipboard, owner, CurrentTime);
+    XFlush(dpy);
+}
+
+static void handle_menu_action(Display *dpy,
+                               Window win,
+                               GC gc,
+                               int line_height,
+                               int action,
+                               Atom atom_clipboard,
+                               int screen,
+                               Atom wm_delete_window)
+{
+    if (action == MENU_CLEAR_ALL) {
+        clear_all_clients();
+    } else if (action == MENU_CLEAR_OFFLINE) {
+        clear_offline_clients();
+    } else if (action == MENU_SELECT_TEXT) {
+        char *snapshot = build_clients_snapshot();
+        if (snapshot) {
+            set_clipboard_text(dpy, win, snapshot, atom_clipboard);
+            free(snapshot);
+        }
+    } else if (action == MENU_HEATMAP) {
+        g_heatmap = !g_heatmap;
+    } else if (action == MENU_HEAT_METRIC) {
+        g_heat_metric = g_heat_metric == WIN_TEMP ? WIN_LOAD : WIN_TEMP;
+    } else if (action == MENU_PREFS) {
+        open_preferences_dialog(dpy, screen, win, wm_delete_window);
+    } else if (action == MENU_EXIT) {
+        XEvent close_event;
+        memset(&close_event, 0, sizeof(close_event));
+        close_event.type = ClientMessage;
+        close_event.xclient.window = win;
+        close_event.xclient.format = 32;
+        close_event.xclient.data.l[0] = wm_delete_window;
+        XPutBackEvent(dpy, &close_event);
+        return;
+    }
+
+    notify_main_thread();
+    redraw_window(dpy, win, gc, line_height);
+}
+
+/*
+ * Dual-stack when the kernel allows it: one AF_INET6 socket with V6ONLY off
+ * receives IPv4 clients as v4-mapped addresses. Falls back to plain IPv4.
+ * With reuseport, several such sockets share the port and the kernel picks
+ * one per source address.
+ */
+static int open_receiver_socket(int reuseport)
+{
+    int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    int on = 1;
+
+    if (sock >= 0) {
+        struct sockaddr_in6 bind6;
+        int off = 0;
+
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        if (reuseport) setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        memset(&bind6, 0, sizeof(bind6));
+        bind6.sin6_family = AF_INET6;
+        bind6.sin6_addr = in6addr_any;
+        bind6.sin6_port = htons(PORT);
+        if (bind(sock, (struct sockaddr *)&bind6, sizeof(bind6)) == 0) {
+            return sock;
+        }
+        close(sock);
+    }
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    {
+        struct sockaddr_in bind_addr;
+
+        memset(&bind_addr, 0, sizeof(bind_addr));
+        bind_addr.sin_family = AF_INET;
+        bind_addr.sin_addr.s_addr = INADDR_ANY;
+        bind_addr.sin_port = htons(PORT);
+        if (reuseport) setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+        if (bind(sock, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) < 0) {
+            perror("bind");
+            close(sock);
+            return -1;
+        }
+    }
+    return sock;
+}
+
+/*
+ * With several SO_REUSEPORT sockets Linux hands a multicast datagram to each
+ * of them by default, not to one. Only the first socket joins the group, and
+ * the others are told to take only the groups they joined themselves: none.
+ */
+static void multicast_joined_only(int sock)
+{
+    int off = 0;
+
+#ifdef IP_MULTICAST_ALL
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off));
+#endif
+#ifdef IPV6_MULTICAST_ALL
+    setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_ALL, &off, sizeof(off));
+#endif
+    (void)off;
+}
+
+/*
+ * Optionally join the multicast group named by PIMON_MCAST_GROUP (IPv4 or
+ * IPv6), on the interface named by PIMON_MCAST_IF or the default route's.
+ * Clients then list the group as their server and every collector on the
+ * segment receives the same datagram.
+ */
+static void join_multicast(int sock)
+{
+    const char *group = getenv("PIMON_MCAST_GROUP");
+    const char *ifname = getenv("PIMON_MCAST_IF");
+    unsigned int ifindex = 0;
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    struct in_addr g4;
+    struct in6_addr g6;
+    int rc = -1;
+
+    if (!group || !group[0]) return;
+    if (ifname && ifname[0]) {
+        ifindex = if_nametoindex(ifname);
+        if (ifindex == 0) {
+            fprintf(stderr, "PIMON_MCAST_IF: unknown interface %s\n", ifname);
+        }
+    }
+    if (getsockname(sock, (struct sockaddr *)&local, &local_len) != 0) {
+        perror("getsockname");
+        return;
+    }
+
+    if (inet_pton(AF_INET, group, &g4) == 1) {
+        /* Works on the dual-stack socket too; IPv4 options apply to it */
+        struct ip_mreqn mreq;
+
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.imr_multiaddr = g4;
+        mreq.imr_ifindex = (int)ifindex;
+        rc = setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    } else if (inet_pton(AF_INET6, group, &g6) == 1 && local.ss_family == AF_INET6) {
+        struct ipv6_mreq mreq6;
+
+        memset(&mreq6, 0, sizeof(mreq6));
+        mreq6.ipv6mr_multiaddr = g6;
+        mreq6.ipv6mr_interface = ifindex;
+        rc = setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq6, sizeof(mreq6));
+    } else {
+        fprintf(stderr, "PIMON_MCAST_GROUP: cannot join %s\n", group);
+        return;
+    }
+
+    if (rc != 0) {
+        perror("multicast join");
+    }
+}
+
+/* Telemetry replaces a plain text line; the flag keeps the global lock off
+ * the per-packet path */
+static void clear_latest_text(void)
+{
+    if (!__atomic_load_n(&g_latest_set, __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&g_line_mtx);
+    g_latest_text[0] = '\0';
+    __atomic_store_n(&g_latest_set, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_line_mtx);
+}
+
+/* Caller holds the shard lock. One event line per metric that went off its
+ * baseline since the last call, appended to buf for printing unlocked. */
+static void anomaly_events(ClientData *c, char *buf, size_t len)
+{
+    size_t used = strlen(buf);
+    char name[CLIENT_ID_LEN + SITE_LEN];
+    char ts[64];
+    int m;
+
+    if (!c->anom_onset) return;
+    format_client_name(c, name, sizeof(name));
+    format_time(c->samples[c->count > 0 ? c->count - 1 : 0].timestamp, ts, sizeof(ts));
+    for (m = 0; m < ANOM_METRICS && used < len; m++) {
+        const AnomalyStat *a = &c->anom[m];
+        if (!(c->anom_onset & (1 << m))) continue;
+        used += (size_t)snprintf(buf + used, len - used,
+                                 "%s anomaly %s %s %.1f z %+.1f baseline %.1f\n",
+                                 ts, name, g_anomaly_names[m], a->value, a->z, a->mean);
+    }
+    c->anom_onset = 0;
+}
+
+static void print_events(const char *events)
+{
+    if (!events[0]) return;
+    fputs(events, stdout);
+    fflush(stdout);
+}
+
+/* Caller holds the shard lock */
+static void push_sample(ClientData *c, const TelemetryPacket *pkt)
+{
+    if (c->count < MAX_SAMPLES) {
+        c->samples[c->count++] = *pkt;
+    } else {
+        memmove(&c->samples[0], &c->samples[1],
+                sizeof(TelemetryPacket) * (MAX_SAMPLES - 1));
+        c->samples[MAX_SAMPLES - 1] = *pkt;
+    }
+}
+
+/* Caller holds the shard lock. Relay mode: fold the sample just applied into
+ * the summary forwarded next; the client's own window counts when it sends
+ * one, so peaks between its sends survive too. */
+static void relay_accumulate(ClientData *c, const TelemetryPacket *pkt)
+{
+    int m;
+
+    for (m = 0; m < WIN_METRICS; m++) {
+        float v = sample_metric(pkt, m);
+        float lo = v, hi = v, p95 = v;
+
+        if (c->window_mask & (1 << m)) {
+            lo = c->window[m].min;
+            hi = c->window[m].max;
+            p95 = c->window[m].p95;
+        }
+        if (c->relay_count == 0 || lo < c->relay_min[m]) c->relay_min[m] = lo;
+        if (c->relay_count == 0 || hi > c->relay_max[m]) c->relay_max[m] = hi;
+        if (c->relay_count == 0 || p95 > c->relay_p95[m]) c->relay_p95[m] = p95;
+        if (c->relay_count == 0) c->relay_sum[m] = 0;
+        c->relay_sum[m] += v;
+    }
+    if (c->relay_count == 0) c->relay_samples = 0;
+    c->relay_samples += (c->window_mask & 1) ? c->window[WIN_LOAD].count : 1;
+    c->relay_count++;
+}
+
+/* FNV-1a 64 of a whole datagram */
+static uint64_t datagram_hash(const unsigned char *buf, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < n; i++) h = (h ^ buf[i]) * 1099511628211ULL;
+    return h;
+}
+
+/*
+ * One datagram from a client. A first datagram seen before is a duplicate
+ * (client sending to two addresses we listen on, multicast plus unicast);
+ * it and its continuations are dropped. With TLV_SEQUENCE that is a live
+ * sequence number already received; without, the same length and
+ * bytes as the previous first datagram, records included, since the header
+ * alone repeats whenever a client sends steady values within one second.
+ * Both copies reach the same entry however the kernel spread
+ * them, since the shard follows the client_id. rx is the receiving thread's
+ * shard; the ack leaves through its socket.
+ */
+static void ingest_telemetry(ClientShard *rx, const unsigned char *buf, size_t n,
+                             const struct sockaddr_storage *from, socklen_t from_len)
+{
+    TelemetryPacket pkt;
+    ClientShard *sh;
+    ClientData *c;
+    const unsigned char *ext = buf + sizeof(TelemetryPacket);
+    size_t ext_len = n - sizeof(TelemetryPacket);
+    int first = !tlv_is_continuation(ext, ext_len);
+    TlvSequence seq;
+    int has_seq = first && find_sequence(ext, ext_len, &seq);
+    AckPacket ack;
+    char events[MAX_LINE] = "";
+
+    memcpy(&pkt, buf, sizeof(pkt));
+    pkt.client_id[CLIENT_ID_LEN - 1] = '\0';
+    sh = client_shard(pkt.client_id, "");
+
+    pthread_mutex_lock(&sh->mtx);
+    c = get_client(sh, pkt.client_id, "");
+    if (c) {
+        c->last_addr = *from;
+        c->heard = view_time();
+        if (has_seq) {
+            c->duplicate = c->has_seq && seq.epoch == c->seq_epoch &&
+                           !(seq.flags & SEQ_REPLAY) &&
+                           (seq.seq <= c->seq_acked ||
+                            (seq.seq - c->seq_acked <= SEQ_WINDOW &&
+                             c->seq_seen[seq.seq % SEQ_WINDOW]));
+            apply_sequence(c, &seq);
+            memset(&ack, 0, sizeof(ack));
+            ack.magic = ACK_MAGIC;
+            ack.epoch = seq.epoch;
+            memcpy(ack.client_id, pkt.client_id, CLIENT_ID_LEN);
+            ack.acked = c->seq_acked;
+        } else if (first) {
+            c->replaying = 0;
+        }
+        if (first && !has_seq) {
+            uint64_t h = datagram_hash(buf, n);
+            c->duplicate = c->count > 0 && c->first_len == n && c->first_hash == h;
+            c->first_hash = h;
+            c->first_len = n;
+        }
+    }
+    /* Resent samples only fill the ack; the table shows live data */
+    if (c && !c->replaying && !c->duplicate) {
+        if (first) {
+            push_sample(c, &pkt);
+            anomaly_header(c, &pkt);
+            fleet_update(sh, c, &pkt, c->heard);
+        }
+        apply_tlvs(c, ext, ext_len, first);
+        if (first && g_relay_fd >= 0) relay_accumulate(c, &pkt);
+        anomaly_events(c, events, sizeof(events));
+    }
+    pthread_mutex_unlock(&sh->mtx);
+    clear_latest_text();
+    print_events(events);
+
+    if (c && has_seq && rx->sock >= 0) {
+        sendto(rx->sock, &ack, sizeof(ack), 0, (const struct sockaddr *)from, from_len);
+    }
+}
+
+/* A batch from a site relay: every record is a whole sample of one client */
+static void ingest_relay(const unsigned char *buf, size_t len,
+                         const struct sockaddr_storage *from)
+{
+    RelayHeader hdr;
+    const unsigned char *p = buf + sizeof(hdr);
+    char events[MAX_LINE] = "";
+    int i;
+
+    memcpy(&hdr, buf, sizeof(hdr));
+    len -= sizeof(hdr);
+
+    for (i = 0; i < hdr.count && len >= sizeof(uint16_t); i++) {
+        uint16_t rec_len;
+        TelemetryPacket pkt;
+        char site[SITE_LEN];
+        ClientShard *sh;
+        ClientData *c;
+
+        memcpy(&rec_len, p, sizeof(rec_len));
+        p += sizeof(rec_len);
+        len -= sizeof(rec_len);
+        if (rec_len > len || rec_len < sizeof(pkt) ||
+            !tlv_valid(p + sizeof(pkt), rec_len - sizeof(pkt))) {
+            break;
+        }
+        memcpy(&pkt, p, sizeof(pkt));
+        pkt.client_id[CLIENT_ID_LEN - 1] = '\0';
+        find_site(p + sizeof(pkt), rec_len - sizeof(pkt), site);
+        sh = client_shard(pkt.client_id, site);
+        pthread_mutex_lock(&sh->mtx);
+        c = get_client(sh, pkt.client_id, site);
+        if (c) {
+            c->last_addr = *from;
+            c->heard = view_time();
+            push_sample(c, &pkt);
+            anomaly_header(c, &pkt);
+            fleet_update(sh, c, &pkt, c->heard);
+            apply_tlvs(c, p + sizeof(pkt), rec_len - sizeof(pkt), 1);
+            if (g_relay_fd >= 0) relay_accumulate(c, &pkt);
+            anomaly_events(c, events, sizeof(events));
+        }
+        pthread_mutex_unlock(&sh->mtx);
+        p += rec_len;
+        len -= rec_len;
+    }
+    clear_latest_text();
+    print_events(events);
+}
+
+/* Capture ------------------------------------------------------------------ */
+
+/* Source address as 16 bytes: IPv4 as ::ffff:a.b.c.d, the form the
+ * dual-stack socket reports it in */
+static void addr_key(const struct sockaddr_storage *from, unsigned char *key)
+{
+    memset(key, 0, 16);
+    if (from->ss_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6 *)from)->sin6_addr, 16);
+    } else {
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in *)from)->sin_addr, 4);
+    }
+}
+
+static uint16_t addr_port(const struct sockaddr_storage *from)
+{
+    if (from->ss_family == AF_INET6) return ((const struct sockaddr_in6 *)from)->sin6_port;
+    return ((const struct sockaddr_in *)from)->sin_port;
+}
+
+/* SO_TIMESTAMPNS receive time from the control data, 0 without it */
+static uint64_t cmsg_rx_ns(struct msghdr *msg)
+{
+    struct cmsghdr *cm;
+
+    for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+            return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+        }
+    }
+    return 0;
+}
+
+static int capture_open(const char *path)
+{
+    CaptureHeader hdr;
+
+    g_capture = fopen(path, "wb");
+    if (!g_capture) {
+        perror(path);
+        return -1;
+    }
+    setvbuf(g_capture, NULL, _IOFBF, CAPTURE_BUF);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CAPTURE_MAGIC;
+    hdr.version = CAPTURE_VERSION;
+    fwrite(&hdr, sizeof(hdr), 1, g_capture);
+    return 0;
+}
+
+/* Append one datagram; the file is flushed at most once a second */
+static void capture_write(uint64_t rx_ns, const struct sockaddr_storage *from,
+                          const unsigned char *buf, size_t n)
+{
+    CaptureRecord rec;
+
+    if (rx_ns == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        rx_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.rx_ns = rx_ns;
+    addr_key(from, rec.addr);
+    rec.port = addr_port(from);
+    rec.len = (uint16_t)n;
+
+    pthread_mutex_lock(&g_capture_mtx);
+    fwrite(&rec, sizeof(rec), 1, g_capture);
+    fwrite(buf, 1, n, g_capture);
+    if (rx_ns / 1000000000ULL != g_capture_flushed) {
+        fflush(g_capture);
+        g_capture_flushed = rx_ns / 1000000000ULL;
+    }
+    pthread_mutex_unlock(&g_capture_mtx);
+}
+
+static void capture_close(void)
+{
+    uint64_t skipped = __atomic_load_n(&g_capture_skipped, __ATOMIC_RELAXED);
+
+    if (!g_capture) return;
+    if (skipped) {
+        fprintf(stderr, "capture: %llu flood-dropped datagrams not recorded\n",
+                (unsigned long long)skipped);
+    }
+    pthread_mutex_lock(&g_capture_mtx);
+    fclose(g_capture);
+    g_capture = NULL;
+    pthread_mutex_unlock(&g_capture_mtx);
+}
+
+/* Flood protection --------------------------------------------------------- */
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t flood_hash(const unsigned char *key)
+{
+    uint32_t h = 2166136261u;   /* FNV-1a */
+    int i;
+
+    for (i = 0; i < CLIENT_ID_LEN; i++) h = (h ^ key[i]) * 16777619u;
+    return h;
+}
+
+/*
+ * Take a token from the bucket of key in table; returns 0 when it is empty
+ * and the datagram should be dropped. The table is open-addressed over
+ * FLOOD_PROBE slots; a new key replaces the longest idle one there, which
+ * starts it with a full bucket. A continuation takes no token: it passes
+ * only if the first datagram of its sample did, up to FLOOD_ID_CONT.
+ */
+static int flood_take(FloodBucket *table, const unsigned char *key, double pps,
+                      uint64_t now, int cont)
+{
+    static const unsigned char zero[CLIENT_ID_LEN];
+    uint32_t h = flood_hash(key);
+    FloodBucket *b = NULL;
+    FloodBucket *idle = NULL;
+    double burst = pps * FLOOD_BURST_SEC;
+    int i;
+
+    for (i = 0; i < FLOOD_PROBE; i++) {
+        FloodBucket *e = &table[(h + (uint32_t)i) & (FLOOD_SLOTS - 1)];
+        if (memcmp(e->key, key, CLIENT_ID_LEN) == 0) {
+            b = e;
+            break;
+        }
+        if (memcmp(e->key, zero, CLIENT_ID_LEN) == 0) {
+            e->last_ns = 0;     /* a free slot is the idlest of all */
+        }
+        if (!idle || e->last_ns < idle->last_ns) idle = e;
+    }
+    if (!b) {
+        b = idle;
+        memcpy(b->key, key, CLIENT_ID_LEN);
+        b->tokens = burst;
+        b->dropped = 0;
+        b->last_ns = now;
+        b->cont_left = 0;
+    }
+    if (cont) {
+        if (b->cont_left > 0) {
+            b->cont_left--;
+            return 1;
+        }
+        __atomic_store_n(&b->dropped, b->dropped + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (now > b->last_ns) b->tokens += (double)(now - b->last_ns) * pps / 1e9;
+    if (b->tokens > burst) b->tokens = burst;
+    b->last_ns = now;
+    if (b->tokens < 1.0) {
+        __atomic_store_n(&b->dropped, b->dropped + 1, __ATOMIC_RELAXED);
+        b->cont_left = 0;
+        return 0;
+    }
+    b->tokens -= 1.0;
+    b->cont_left = FLOOD_ID_CONT;
+    return 1;
+}
+
+/* Both buckets of one datagram, before anything shared is looked at */
+static int flood_admit(ClientShard *sh, const unsigned char *buf, size_t n,
+                       const struct sockaddr_storage *from, uint64_t now)
+{
+    unsigned char key[CLIENT_ID_LEN];
+    int cont;
+
+    if (g_flood_src_pps <= 0 && g_flood_id_pps <= 0) return 1;
+
+    if (g_flood_src_pps > 0) {
+        memset(key, 0, sizeof(key));
+        addr_key(from, key);
+        if (!flood_take(sh->src_flood, key, g_flood_src_pps, now, 0)) {
+            __atomic_store_n(&sh->dropped_src, sh->dropped_src + 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    if (g_flood_id_pps > 0 && n >= sizeof(TelemetryPacket) && buf[0] != 0xff) {
+        memcpy(key, buf, CLIENT_ID_LEN);
+        key[CLIENT_ID_LEN - 1] = '\0';
+        cont = tlv_is_continuation(buf + sizeof(TelemetryPacket),
+                                   n - sizeof(TelemetryPacket));
+        if (!flood_take(sh->id_flood, key, g_flood_id_pps, now, cont)) {
+            __atomic_store_n(&sh->dropped_id, sh->dropped_id + 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void init_flood(void)
+{
+    const char *src = getenv("PIMON_FLOOD_SRC_PPS");
+    const char *id = getenv("PIMON_FLOOD_ID_PPS");
+
+    if (src && src[0]) g_flood_src_pps = atof(src);
+    if (id && id[0]) g_flood_id_pps = atof(id);
+}
+
+/*
+ * One received datagram: relay batch, telemetry or a plain text line.
+ * rx_ns is the kernel receive time when known (capture on, or replay) and
+ * then also the clock of the flood buckets. Only admitted datagrams are
+ * captured, so a flood neither takes the capture lock nor fills the disk,
+ * and a replay admits all of them again.
+ */
+static void handle_datagram(ClientShard *sh, const unsigned char *buf, size_t n,
+                            const struct sockaddr_storage *from, socklen_t from_len,
+                            uint64_t rx_ns)
+{
+    uint32_t magic = 0;
+
+    if (!flood_admit(sh, buf, n, from, rx_ns ? rx_ns : monotonic_ns())) {
+        if (g_capture) __atomic_add_fetch(&g_capture_skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (g_capture) capture_write(rx_ns, from, buf, n);
+    if (n >= sizeof(RelayHeader)) memcpy(&magic, buf, sizeof(magic));
+    if (magic == RELAY_MAGIC) {
+        ingest_relay(buf, n, from);
+    } else if (n >= sizeof(TelemetryPacket) &&
+               tlv_valid(buf + sizeof(TelemetryPacket), n - sizeof(TelemetryPacket))) {
+        ingest_telemetry(sh, buf, n, from, from_len);
+    } else {
+        size_t copy_len = n;
+        if (copy_len >= sizeof(g_latest_text)) {
+            copy_len = sizeof(g_latest_text) - 1;
+        }
+
+        pthread_mutex_lock(&g_line_mtx);
+        memcpy(g_latest_text, buf, copy_len);
+        g_latest_text[copy_len] = '\0';
+        __atomic_store_n(&g_latest_set, copy_len > 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&g_line_mtx);
+    }
+    __atomic_add_fetch(&sh->packets, 1, __ATOMIC_RELAXED);
+
+    notify_main_thread();
+}
+
+/* One recvmsg() per datagram; recvmsg rather than recvfrom only for the
+ * receive timestamp a capture wants */
+static void recvfrom_loop(ClientShard *sh)
+{
+    unsigned char buf[MAX_PACKET];
+    unsigned char control[RX_CMSG_SPACE];
+
+    while (!sh->stop) {
+        struct sockaddr_storage from_addr;
+        struct iovec iov;
+        struct msghdr msg;
+        ssize_t n;
+
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &from_addr;
+        msg.msg_namelen = sizeof(from_addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (g_capture) {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+        }
+        n = recvmsg(sh->sock, &msg, 0);
+        sh->syscalls++;
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        handle_datagram(sh, buf, (size_t)n, &from_addr, msg.msg_namelen,
+                        g_capture ? cmsg_rx_ns(&msg) : 0);
+    }
+}
+
+#ifdef HAVE_URING_RECV
+
+/* Each provided buffer takes the recvmsg header, the source address, the
+ * receive timestamp and the payload */
+#define URING_BUF_SIZE (sizeof(struct io_uring_recvmsg_out) + \
+                        sizeof(struct sockaddr_storage) + RX_CMSG_SPACE + MAX_PACKET)
+
+typedef struct {
+    int fd;
+    unsigned char *ring;    /* SQ and CQ rings, one mapping */
+    size_t ring_sz;
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;
+    unsigned char *bufs;
+    unsigned short br_tail;
+} UringRecv;
+
+static void uring_buf_put(UringRecv *u, unsigned short bid)
+{
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_BUFS - 1)];
+
+    b->addr = (uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = (uint32_t)URING_BUF_SIZE;
+    b->bid = bid;
+    u->br_tail++;
+}
+
+static void uring_close(UringRecv *u)
+{
+    if (u->br) munmap(u->br, URING_BUFS * sizeof(struct io_uring_buf));
+    if (u->sqes) munmap(u->sqes, u->sqes_sz);
+    if (u->ring) munmap(u->ring, u->ring_sz);
+    if (u->fd >= 0) close(u->fd);
+    free(u->bufs);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+/* Ring, buffer ring and buffers; -1 when the kernel lacks any of them */
+static int uring_open(UringRecv *u)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    unsigned short i;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_CQ_ENTRIES;
+    u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP)) goto fail;
+
+    u->ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > u->ring_sz) {
+        u->ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    u->ring = mmap(NULL, u->ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        u->ring = NULL;
+        goto fail;
+    }
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+    u->sq_tail = (unsigned *)(u->ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(u->ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(u->ring + p.sq_off.array);
+    u->cq_head = (unsigned *)(u->ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(u->ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(u->ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(u->ring + p.cq_off.cqes);
+
+    u->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        goto fail;
+    }
+    u->bufs = malloc(URING_BUFS * URING_BUF_SIZE);
+    if (!u->bufs) goto fail;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)u->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) goto fail;
+    for (i = 0; i < URING_BUFS; i++) uring_buf_put(u, i);
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+    return 0;
+
+fail:
+    uring_close(u);
+    return -1;
+}
+
+/* Queue the multishot recvmsg; it keeps completing until it runs out of
+ * buffers or fails, and is queued again then */
+static void uring_arm(UringRecv *u, int sock, struct msghdr *msg)
+{
+    unsigned tail = *u->sq_tail;
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sock;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Completions are reaped straight from the shared ring; io_uring_enter() is
+ * only called to submit or when the ring is empty, so a steady stream costs
+ * about one syscall per batch. The wait times out every second so stop and
+ * thread cancellation are noticed. Returns -1 when io_uring cannot serve
+ * the socket and nothing was received yet, 0 when stopped.
+ */
+static int uring_loop(ClientShard *sh)
+{
+    UringRecv u;
+    struct msghdr msg;
+    int to_submit = 1;
+    int received = 0;
+
+    if (uring_open(&u) != 0) return -1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_namelen = sizeof(struct sockaddr_storage);
+    if (g_capture) msg.msg_controllen = RX_CMSG_SPACE;
+    uring_arm(&u, sh->sock, &msg);
+    sh->uring = 1;
+
+    while (!sh->stop) {
+        unsigned head = *u.cq_head;
+        unsigned tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail || to_submit) {
+            struct __kernel_timespec ts = { 1, 0 };
+            struct io_uring_getevents_arg ga;
+            unsigned flags = IORING_ENTER_EXT_ARG;
+
+            memset(&ga, 0, sizeof(ga));
+            ga.sigmask_sz = _NSIG / 8;
+            ga.ts = (uintptr_t)&ts;
+            if (head == tail) flags |= IORING_ENTER_GETEVENTS;
+            sh->syscalls++;
+            syscall(__NR_io_uring_enter, u.fd, to_submit, head == tail ? 1 : 0,
+                    flags, &ga, sizeof(ga));
+            to_submit = 0;
+            pthread_testcancel();
+            continue;
+        }
+
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+
+            if (cqe->res < 0) {
+                if (!received && cqe->res != -ENOBUFS) {
+                    sh->uring = 0;
+                    uring_close(&u);
+                    return -1;
+                }
+            } else if (cqe->flags & IORING_CQE_F_BUFFER) {
+                unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                unsigned char *buf = u.bufs + (size_t)bid * URING_BUF_SIZE;
+                struct io_uring_recvmsg_out out;
+
+                memcpy(&out, buf, sizeof(out));
+                if (!(out.flags & MSG_TRUNC)) {
+                    struct sockaddr_storage from;
+                    socklen_t from_len = out.namelen < msg.msg_namelen ? out.namelen
+                                                                       : msg.msg_namelen;
+                    uint64_t rx_ns = 0;
+
+                    memset(&from, 0, sizeof(from));
+                    memcpy(&from, buf + sizeof(out), from_len);
+                    if (out.controllen > 0) {
+                        struct msghdr cm;
+
+                        memset(&cm, 0, sizeof(cm));
+                        cm.msg_control = buf + sizeof(out) + msg.msg_namelen;
+                        cm.msg_controllen = out.controllen;
+                        rx_ns = cmsg_rx_ns(&cm);
+                    }
+                    handle_datagram(sh, buf + sizeof(out) + msg.msg_namelen + msg.msg_controllen,
+                                    out.payloadlen, &from, from_len, rx_ns);
+                }
+                uring_buf_put(&u, bid);
+                received = 1;
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                uring_arm(&u, sh->sock, &msg);
+                to_submit = 1;
+            }
+        }
+        __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+        __atomic_store_n(&u.br->tail, u.br_tail, __ATOMIC_RELEASE);
+    }
+    sh->uring = 0;
+    uring_close(&u);
+    return 0;
+}
+
+#else
+
+static int uring_loop(ClientShard *sh)
+{
+    (void)sh;
+    return -1;
+}
+
+#endif
 
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        int j;
-        float load = 0.0f;
-        float temp = 0.0f;
-        float fan = 0.0f;
-        float mhz = 0.0f;
-        int n = clients[i].count;
-        TelemetryPacket last;
-        int age;
-        char seen_time[64];
-        const char *seen;
-        char ip[INET_ADDRSTRLEN];
-
-        if (n <= 0) continue;
-
-        for (j = 0; j < n; j++) {
-            load += clients[i].samples[j].cpu_load;
-            temp += clients[i].samples[j].cpu_temp;
-            fan += clients[i].samples[j].fan_speed;
-            mhz += clients[i].samples[j].cpu_mhz;
-        }
-
-        last = clients[i].samples[n - 1];
-        age = (int)(now - (time_t)last.timestamp);
-        if (age < 0) age = 0;
-        format_time(last.timestamp, seen_time, sizeof(seen_time));
-        seen = (age < OFFLINE_SECS) ? seen_time + 11 : "offline";
-        inet_ntop(AF_INET, &clients[i].last_addr.sin_addr, ip, sizeof(ip));
-
-        snprintf(line, sizeof(line), "%-32s %-15s %7.2f%% %8.2f %8d %8.2f %s",
-                 last.client_id,
-                 ip[0] ? ip : "0.0.0.0",
-                 load / n,
-                 temp / n,
-                 (int)(fan / n),
-                 mhz / n,
-                 seen);
-        draw_text(dpy, win, gc, x, y, line);
-        y += line_height;
-        visible_clients++;
-    }
+static void *udp_receiver(void *arg)
+{
+    ClientShard *sh = (ClientShard *)arg;
 
-    if (visible_clients == 0) {
-        draw_text(dpy, win, gc, x, y,
-                  latest_text[0] ? latest_text : "No clients connected.");
+    if (g_recv_uring && uring_loop(sh) == 0) return NULL;
+    if (g_recv_uring) {
+        fprintf(stderr, "io_uring receive not available, using recvfrom\n");
     }
+    recvfrom_loop(sh);
+    return NULL;
+}
 
-    draw_menu(dpy, win, gc, line_height);
+/*
+ * Open the receiver sockets and start one thread per shard. PIMON_RECV_THREADS
+ * (default 1) sets the count; with more than one, every socket binds port
+ * PORT with SO_REUSEPORT. Returns the number started, 0 on failure.
+ */
+static int start_receivers(void)
+{
+    const char *env = getenv("PIMON_RECV_THREADS");
+    const char *backend = getenv("PIMON_RECV");
+    const char *capture = getenv("PIMON_CAPTURE");
+    int want = env && env[0] ? atoi(env) : 1;
+    int s;
+
+    g_recv_uring = backend && strcmp(backend, "uring") == 0;
+    init_flood();
+    init_anomaly();
+    if (capture && capture[0] && capture_open(capture) != 0) return 0;
+    if (want < 1) want = 1;
+    if (want > MAX_SHARDS) want = MAX_SHARDS;
+    for (s = 0; s < MAX_SHARDS; s++) pthread_mutex_init(&g_shards[s].mtx, NULL);
+
+    /* Every socket first: routing by client_id needs the final shard count
+     * before the first datagram is read */
+    g_shard_count = 0;
+    for (s = 0; s < want; s++) {
+        ClientShard *sh = &g_shards[s];
+
+        sh->sock = open_receiver_socket(want > 1);
+        if (sh->sock < 0) break;
+        if (want > 1) multicast_joined_only(sh->sock);
+        if (s == 0) join_multicast(sh->sock);
+        if (g_capture) {
+            int on = 1;
+            setsockopt(sh->sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+        }
+        g_shard_count++;
+    }
+    if (g_shard_count == 0) return 0;
 
-    XFlush(dpy);
+    /* A shard whose thread fails to start still holds its clients */
+    g_receiver_count = 0;
+    for (s = 0; s < g_shard_count; s++) {
+        if (pthread_create(&g_receivers[s], NULL, udp_receiver, &g_shards[s]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        g_receiver_count++;
+    }
+    for (; s < g_shard_count; s++) {
+        close(g_shards[s].sock);
+        g_shards[s].sock = -1;
+    }
+    return g_receiver_count;
 }
 
-static void redraw_prefs(Display *dpy, Window prefs, GC gc)
+static void stop_receivers(void)
 {
-    char line[128];
-
-    XClearWindow(dpy, prefs);
-    draw_text(dpy, prefs, gc, 12, 24, "Preferences");
+    int s;
 
-    XDrawRectangle(dpy, prefs, gc, 14, 38, 14, 14);
-    if (g_prefs_checkbox) {
-        XDrawLine(dpy, prefs, gc, 16, 45, 20, 50);
-        XDrawLine(dpy, prefs, gc, 20, 50, 27, 40);
+    for (s = 0; s < g_receiver_count; s++) {
+        pthread_cancel(g_receivers[s]);
+        pthread_join(g_receivers[s], NULL);
     }
-    draw_text(dpy, prefs, gc, 36, 50, "Start minimized");
+    for (s = 0; s < g_shard_count; s++) {
+        if (g_shards[s].sock >= 0) close(g_shards[s].sock);
+    }
+    capture_close();
+}
 
-    XDrawRectangle(dpy, prefs, gc, 170, 98, 74, 28);
-    draw_text(dpy, prefs, gc, 194, 116, "Save");
+/* Replay -------------------------------------------------------------------- */
 
-    XDrawRectangle(dpy, prefs, gc, 258, 98, 86, 28);
-    draw_text(dpy, prefs, gc, 282, 116, "Cancel");
+/* Map a capture file; -1 when it is missing or not a capture */
+static int replay_open(const char *path)
+{
+    struct stat st;
+    CaptureHeader hdr;
+    int fd = open(path, O_RDONLY);
+    void *map;
+
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(hdr)) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+    memcpy(&hdr, map, sizeof(hdr));
+    if (hdr.magic != CAPTURE_MAGIC || hdr.version != CAPTURE_VERSION) {
+        fprintf(stderr, "%s: not a PiMon capture\n", path);
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+    g_replay = map;
+    g_replay_size = (size_t)st.st_size;
+    return 0;
+}
 
-    snprintf(line, sizeof(line), "Config: ~/.PiMon/config.json");
-    draw_text(dpy, prefs, gc, 12, 82, line);
-    XFlush(dpy);
+/* Next record at *off; 0 at the end or at a record cut short */
+static int replay_next(size_t *off, CaptureRecord *rec, const unsigned char **payload)
+{
+    if (*off + sizeof(*rec) > g_replay_size) return 0;
+    memcpy(rec, g_replay + *off, sizeof(*rec));
+    if (rec->len > MAX_PACKET || *off + sizeof(*rec) + rec->len > g_replay_size) return 0;
+    *payload = g_replay + *off + sizeof(*rec);
+    *off += sizeof(*rec) + rec->len;
+    return 1;
 }
 
-static void open_preferences_dialog(Display *dpy, int screen, Window parent, Atom wm_delete_window)
+/* Recorded source as the dual-stack socket would have reported it */
+static socklen_t replay_from(const CaptureRecord *rec, struct sockaddr_storage *from)
 {
-    int display_w = DisplayWidth(dpy, screen);
-    int display_h = DisplayHeight(dpy, screen);
-    int x = (display_w - PREF_W) / 2;
-    int y = (display_h - PREF_H) / 2;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)from;
 
-    if (x < 0) x = 0;
-    if (y < 0) y = 0;
+    memset(from, 0, sizeof(*from));
+    sin6->sin6_family = AF_INET6;
+    memcpy(&sin6->sin6_addr, rec->addr, 16);
+    sin6->sin6_port = rec->port;
+    return sizeof(*sin6);
+}
 
-    if (g_prefs_win != None) {
-        XRaiseWindow(dpy, g_prefs_win);
-        return;
+/* Feed the capture to one shard at the recorded pace */
+static void *replay_thread(void *arg)
+{
+    ClientShard *sh = (ClientShard *)arg;
+    CaptureRecord rec;
+    const unsigned char *payload;
+    size_t off = sizeof(CaptureHeader);
+    uint64_t first_ns = 0;
+    uint64_t start = monotonic_ns();
+
+    while (replay_next(&off, &rec, &payload)) {
+        struct sockaddr_storage from;
+        socklen_t from_len = replay_from(&rec, &from);
+        uint64_t due;
+
+        if (first_ns == 0) first_ns = rec.rx_ns;
+        due = start + (rec.rx_ns > first_ns ? rec.rx_ns - first_ns : 0);
+        if (due > monotonic_ns()) {
+            struct timespec ts;
+            ts.tv_sec = (time_t)(due / 1000000000ULL);
+            ts.tv_nsec = (long)(due % 1000000000ULL);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+        }
+        handle_datagram(sh, payload, rec.len, &from, from_len, rec.rx_ns);
     }
-
-    g_prefs_checkbox = g_prefs.start_minimized;
-    g_prefs_win = XCreateSimpleWindow(dpy, RootWindow(dpy, screen),
-                                      x, y, PREF_W, PREF_H, 1,
-                                      BlackPixel(dpy, screen),
-                                      WhitePixel(dpy, screen));
-    XStoreName(dpy, g_prefs_win, "Preferences");
-    XSetTransientForHint(dpy, g_prefs_win, parent);
-    XSelectInput(dpy, g_prefs_win,
-                 ExposureMask | ButtonPressMask | StructureNotifyMask | KeyPressMask);
-    XSetWMProtocols(dpy, g_prefs_win, &wm_delete_window, 1);
-    XMapWindow(dpy, g_prefs_win);
+    DBG_PRINT("Replay finished.\n");
+    return NULL;
 }
 
-static void close_preferences_dialog(Display *dpy)
+/* One shard without a socket, fed by the replay thread instead of a
+ * receiver. Returns 1 like start_receivers(), 0 on failure. */
+static int start_replay(const char *path)
 {
-    if (g_prefs_win != None) {
-        XDestroyWindow(dpy, g_prefs_win);
-        g_prefs_win = None;
+    ClientShard *sh = &g_shards[0];
+    CaptureRecord rec;
+    const unsigned char *payload;
+    size_t off = sizeof(CaptureHeader);
+
+    if (replay_open(path) != 0) return 0;
+    init_flood();
+    init_anomaly();
+    pthread_mutex_init(&sh->mtx, NULL);
+    sh->sock = -1;
+    g_shard_count = 1;
+    if (replay_next(&off, &rec, &payload)) {
+        g_view_offset = (long)(rec.rx_ns / 1000000000ULL) - (long)time(NULL);
+    }
+    if (pthread_create(&g_receivers[0], NULL, replay_thread, sh) != 0) {
+        perror("pthread_create");
+        return 0;
     }
+    return 1;
 }
 
-static int menu_hit_item(int x, int y)
+/*
+ * Headless replay as fast as the ingest goes: the throughput against real
+ * fleet traffic, then the table as it stood at the end of the capture.
+ * PIMON_FLOOD_* apply as they would live; set them to 0 to measure ingest
+ * alone.
+ */
+static int run_replay_fast(const char *path)
 {
-    int rel;
-    if (x < MENU_PAD_X || x > (MENU_PAD_X + MENU_DROP_W)) return -1;
-    if (y < MENU_BAR_H || y > (MENU_BAR_H + MENU_ITEM_H * MENU_COUNT)) return -1;
-    rel = (y - MENU_BAR_H) / MENU_ITEM_H;
-    if (rel < 0 || rel >= MENU_COUNT) return -1;
-    if (rel == MENU_SEPARATOR) return -1;
-    return rel;
+    ClientShard *sh = &g_shards[0];
+    CaptureRecord rec;
+    const unsigned char *payload;
+    size_t off = sizeof(CaptureHeader);
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    uint64_t last_ns = 0;
+    uint64_t t0, t1;
+    struct timespec c0, c1;
+    double cpu_ns;
+    char *table;
+
+    if (replay_open(path) != 0) return 1;
+    init_flood();
+    init_anomaly();
+    pthread_mutex_init(&sh->mtx, NULL);
+    sh->sock = -1;
+    g_shard_count = 1;
+
+    t0 = monotonic_ns();
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c0);
+    while (replay_next(&off, &rec, &payload)) {
+        struct sockaddr_storage from;
+        socklen_t from_len = replay_from(&rec, &from);
+
+        handle_datagram(sh, payload, rec.len, &from, from_len, rec.rx_ns);
+        count++;
+        bytes += rec.len;
+        last_ns = rec.rx_ns;
+    }
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c1);
+    t1 = monotonic_ns();
+    if (off != g_replay_size) fprintf(stderr, "%s: stopped at a damaged record\n", path);
+
+    cpu_ns = (double)(c1.tv_sec - c0.tv_sec) * 1e9 + (double)(c1.tv_nsec - c0.tv_nsec);
+    printf("replayed %llu datagrams, %llu bytes in %.3f s: %.0f datagrams/s, %.0f cpu ns each\n",
+           (unsigned long long)count, (unsigned long long)bytes, (double)(t1 - t0) / 1e9,
+           t1 > t0 ? (double)count * 1e9 / (double)(t1 - t0) : 0.0,
+           count ? cpu_ns / (double)count : 0.0);
+    if (last_ns) g_view_offset = (long)(last_ns / 1000000000ULL) - (long)time(NULL);
+    table = build_clients_snapshot();
+    if (table) {
+        fputs(table, stdout);
+        free(table);
+    }
+    return 0;
 }
 
-static int menu_hit_edit(int x, int y)
+/* Relay mode -------------------------------------------------------------- */
+
+static void record_append(unsigned char *rec, size_t *used, size_t cap,
+                          uint16_t type, const void *value, size_t len)
 {
-    return (y >= 0 && y <= MENU_BAR_H && x >= MENU_PAD_X && x <= (MENU_PAD_X + MENU_EDIT_W));
+    TelemetryTlv tlv;
+
+    if (*used + sizeof(tlv) + len > cap) return;
+    tlv.type = type;
+    tlv.len = (uint16_t)len;
+    memcpy(rec + *used, &tlv, sizeof(tlv));
+    memcpy(rec + *used + sizeof(tlv), value, len);
+    *used += sizeof(tlv) + len;
 }
 
-static void handle_selection_request(Display *dpy,
-                                     XSelectionRequestEvent *req,
-                                     Atom atom_clipboard,
-                                     Atom atom_targets,
-                                     Atom atom_utf8)
+/*
+ * Caller holds the shard lock. Summary of one client since the last forward:
+ * the latest header with the means, a TLV_WINDOW per metric, memory and
+ * pressure, and the site. Per-core, network, disk and process detail stays
+ * at the site. Returns the record length.
+ */
+static size_t relay_record(ClientData *c, unsigned char *rec, size_t cap)
 {
-    XEvent resp;
-    Atom property = req->property ? req->property : req->target;
-
-    memset(&resp, 0, sizeof(resp));
-    resp.xselection.type = SelectionNotify;
-    resp.xselection.display = req->display;
-    resp.xselection.requestor = req->requestor;
-    resp.xselection.selection = req->selection;
-    resp.xselection.target = req->target;
-    resp.xselection.time = req->time;
-    resp.xselection.property = None;
-
-    if (!g_clip_text) {
-        XSendEvent(dpy, req->requestor, False, 0, &resp);
-        return;
+    TelemetryPacket pkt = c->samples[c->count - 1];
+    float *header[WIN_METRICS] = { &pkt.cpu_load, &pkt.cpu_temp, &pkt.cpu_mhz, &pkt.fan_speed };
+    const char *site = c->site[0] ? c->site : g_site;
+    size_t used = sizeof(pkt);
+    int m;
+
+    for (m = 0; m < WIN_METRICS; m++) {
+        TlvWindow w;
+
+        memset(&w, 0, sizeof(w));
+        w.min = c->relay_min[m];
+        w.max = c->relay_max[m];
+        w.mean = c->relay_sum[m] / c->relay_count;
+        w.p95 = c->relay_p95[m];     /* highest p95 reported, an upper bound */
+        w.count = (uint16_t)(c->relay_samples > UINT16_MAX ? UINT16_MAX : c->relay_samples);
+        w.metric = (uint8_t)m;
+        *header[m] = w.mean;
+        if (w.mean >= 0) record_append(rec, &used, cap, TLV_WINDOW, &w, sizeof(w));
     }
-
-    if (req->target == atom_targets) {
-        Atom targets[3];
-        int count = 0;
-        targets[count++] = XA_STRING;
-        targets[count++] = atom_utf8;
-        targets[count++] = atom_targets;
-        XChangeProperty(dpy, req->requestor, property, XA_ATOM, 32,
-                        PropModeReplace, (unsigned char *)targets, count);
-        resp.xselection.property = property;
-    } else if (req->target == XA_STRING || req->target == atom_utf8) {
-        Atom type = (req->target == atom_utf8) ? atom_utf8 : XA_STRING;
-        XChangeProperty(dpy, req->requestor, property, type, 8,
-                        PropModeReplace,
-                        (const unsigned char *)g_clip_text,
-                        (int)strlen(g_clip_text));
-        resp.xselection.property = property;
+    memcpy(rec, &pkt, sizeof(pkt));
+    if (c->has_memory) record_append(rec, &used, cap, TLV_MEMORY, &c->memory, sizeof(c->memory));
+    if (c->has_pressure) {
+        record_append(rec, &used, cap, TLV_PRESSURE, &c->pressure, sizeof(c->pressure));
     }
-
-    XSendEvent(dpy, req->requestor, False, 0, &resp);
-    XFlush(dpy);
-    (void)atom_clipboard;
+    record_append(rec, &used, cap, TLV_SITE, site, strlen(site));
+    c->relay_count = 0;
+    return used;
 }
 
-static void set_clipboard_text(Display *dpy, Window owner, const char *text, Atom atom_clipboard)
+static void relay_send(unsigned char *dgram, size_t len, RelayHeader *hdr)
 {
-    free(g_clip_text);
-    g_clip_text = NULL;
-
-    if (!text) return;
-    g_clip_text = strdup(text);
-    if (!g_clip_text) return;
-
-    XSetSelectionOwner(dpy, XA_PRIMARY, owner, CurrentTime);
-    XSetSelectionOwner(dpy, atom_clipboard, owner, CurrentTime);
-    XFlush(dpy);
+    memcpy(dgram, hdr, sizeof(*hdr));
+    if (sendto(g_relay_fd, dgram, len, 0,
+               (struct sockaddr *)&g_relay_addr, g_relay_addr_len) < 0) {
+        perror("relay sendto");
+    }
+    hdr->count = 0;
 }
 
-static void handle_menu_action(Display *dpy,
-                               Window win,
-                               GC gc,
-                               int line_height,
-                               int action,
-                               Atom atom_clipboard,
-                               int screen,
-                               Atom wm_delete_window)
+/* Forward everything heard since the last call, packed into as few
+ * datagrams as fit. Duplicates were already dropped at ingest. */
+static void relay_forward(void)
 {
-    if (action == MENU_CLEAR_ALL) {
-        clear_all_clients();
-    } else if (action == MENU_CLEAR_OFFLINE) {
-        clear_offline_clients();
-    } else if (action == MENU_SELECT_TEXT) {
-        char *snapshot = build_clients_snapshot();
-        if (snapshot) {
-            set_clipboard_text(dpy, win, snapshot, atom_clipboard);
-            free(snapshot);
+    static RelayRecord *recs;
+    static int recs_cap;
+    unsigned char dgram[MAX_PACKET];
+    RelayHeader hdr;
+    size_t used = sizeof(hdr);
+    int n = 0;
+    int s, i;
+
+    for (s = 0; s < g_shard_count; s++) {
+        ClientShard *sh = &g_shards[s];
+
+        pthread_mutex_lock(&sh->mtx);
+        if (n + sh->client_used > recs_cap) {
+            RelayRecord *grown = grow_array(recs, &recs_cap, n + sh->client_used,
+                                            sizeof(*recs));
+            if (grown) recs = grown;
         }
-    } else if (action == MENU_PREFS) {
-        open_preferences_dialog(dpy, screen, win, wm_delete_window);
-    } else if (action == MENU_EXIT) {
-        XEvent close_event;
-        memset(&close_event, 0, sizeof(close_event));
-        close_event.type = ClientMessage;
-        close_event.xclient.window = win;
-        close_event.xclient.format = 32;
-        close_event.xclient.data.l[0] = wm_delete_window;
-        XPutBackEvent(dpy, &close_event);
-        return;
+        for (i = 0; i < sh->client_used && n < recs_cap; i++) {
+            ClientData *c = &sh->clients[i];
+            if (c->count > 0 && c->relay_count > 0) {
+                recs[n].len = relay_record(c, recs[n].rec, sizeof(recs[n].rec));
+                n++;
+            }
+        }
+        pthread_mutex_unlock(&sh->mtx);
     }
 
-    notify_main_thread();
-    redraw_window(dpy, win, gc, line_height);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = RELAY_MAGIC;
+    for (i = 0; i < n; i++) {
+        uint16_t rec_len = (uint16_t)recs[i].len;
+
+        if (used + sizeof(rec_len) + recs[i].len > sizeof(dgram)) {
+            relay_send(dgram, used, &hdr);
+            used = sizeof(hdr);
+        }
+        memcpy(dgram + used, &rec_len, sizeof(rec_len));
+        memcpy(dgram + used + sizeof(rec_len), recs[i].rec, recs[i].len);
+        used += sizeof(rec_len) + recs[i].len;
+        hdr.count++;
+    }
+    if (hdr.count > 0) relay_send(dgram, used, &hdr);
 }
 
-static void *udp_receiver(void *arg)
+/* "host", "host:port", "[v6]:port" or a bare IPv6 literal */
+static int relay_open(const char *spec)
 {
-    int sock;
-    struct sockaddr_in bind_addr;
-    unsigned char buf[MAX_LINE];
-    (void)arg;
-
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) {
-        perror("socket");
-        return NULL;
+    char host[256];
+    const char *port = "5000";
+    const char *colon = strrchr(spec, ':');
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    int rc;
+
+    if (spec[0] == '[') {
+        const char *end = strchr(spec, ']');
+        if (!end) return -1;
+        snprintf(host, sizeof(host), "%.*s", (int)(end - spec - 1), spec + 1);
+        if (end[1] == ':') port = end + 2;
+    } else if (colon && strchr(spec, ':') == colon) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+        port = colon + 1;
+    } else {
+        snprintf(host, sizeof(host), "%s", spec);
     }
 
-    memset(&bind_addr, 0, sizeof(bind_addr));
-    bind_addr.sin_family = AF_INET;
-    bind_addr.sin_addr.s_addr = INADDR_ANY;
-    bind_addr.sin_port = htons(PORT);
-
-    if (bind(sock, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) < 0) {
-        perror("bind");
-        close(sock);
-        return NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    rc = getaddrinfo(host, port, &hints, &res);
+    if (rc != 0 || !res) {
+        fprintf(stderr, "PIMON_RELAY: %s: %s\n", spec, gai_strerror(rc));
+        return -1;
+    }
+    g_relay_fd = socket(res->ai_family, SOCK_DGRAM, 0);
+    if (g_relay_fd >= 0) {
+        memcpy(&g_relay_addr, res->ai_addr, res->ai_addrlen);
+        g_relay_addr_len = res->ai_addrlen;
+    }
+    freeaddrinfo(res);
+    if (g_relay_fd < 0) {
+        perror("relay socket");
+        return -1;
     }
+    return 0;
+}
 
+/*
+ * Headless site relay: the receiver thread ingests local clients as usual,
+ * this thread forwards a summary every PIMON_RELAY_SEC seconds over the one
+ * upstream socket. WAN traffic then grows with sites, not clients.
+ */
+static int run_relay(const char *upstream)
+{
+    const char *site = getenv("PIMON_SITE");
+    const char *sec_env = getenv("PIMON_RELAY_SEC");
+    int sec = RELAY_DEFAULT_SEC;
+
+    if (sec_env && sec_env[0]) sec = atoi(sec_env);
+    if (sec < 1) sec = 1;
+    if (site && site[0]) {
+        strncpy(g_site, site, SITE_LEN - 1);
+    } else {
+        gethostname(g_site, SITE_LEN - 1);
+    }
+    if (relay_open(upstream) != 0) return 1;
+    if (start_receivers() == 0) return 1;
+    DBG_PRINT("Relaying site %s to %s every %d s\n", g_site, upstream, sec);
     while (1) {
-        struct sockaddr_in from_addr;
-        socklen_t from_len = sizeof(from_addr);
-        ssize_t n = recvfrom(sock, buf, sizeof(buf), 0,
-                             (struct sockaddr *)&from_addr, &from_len);
-        if (n <= 0) {
-            if (n < 0 && errno == EINTR) continue;
-            break;
-        }
-
-        if (n == (ssize_t)sizeof(TelemetryPacket)) {
-            TelemetryPacket pkt;
-            ClientData *c;
+        sleep((unsigned int)sec);
+        relay_forward();
+    }
+    return 0;
+}
 
-            memcpy(&pkt, buf, sizeof(pkt));
-            pkt.client_id[CLIENT_ID_LEN - 1] = '\0';
+/* Benchmark ---------------------------------------------------------------- */
 
-            pthread_mutex_lock(&g_line_mtx);
-            c = get_client(pkt.client_id);
-            if (c) {
-                c->last_addr = from_addr;
-                if (c->count < MAX_SAMPLES) {
-                    c->samples[c->count++] = pkt;
-                } else {
-                    memmove(&c->samples[0], &c->samples[1],
-                            sizeof(TelemetryPacket) * (MAX_SAMPLES - 1));
-                    c->samples[MAX_SAMPLES - 1] = pkt;
-                }
-            }
-            g_latest_text[0] = '\0';
-            pthread_mutex_unlock(&g_line_mtx);
-        } else {
-            size_t copy_len = (size_t)n;
-            if (copy_len >= sizeof(g_latest_text)) {
-                copy_len = sizeof(g_latest_text) - 1;
-            }
+/*
+ * Feed count heartbeats from RECV_BENCH_SENDERS loopback sockets into one
+ * receiver with the given backend and report its CPU time and receive
+ * syscalls per packet. The sender stays a bounded number of packets ahead
+ * so the socket buffer does not overflow.
+ */
+static void bench_backend(int uring, long count)
+{
+    ClientShard *sh = &g_shards[0];
+    int tx[RECV_BENCH_SENDERS];
+    unsigned char pkt[sizeof(TelemetryPacket) + sizeof(TelemetryTlv) + 4 * sizeof(TlvCpuCore)];
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    TelemetryTlv tlv;
+    TlvCpuCore cores[4];
+    pthread_t thr;
+    clockid_t cpu_clock;
+    struct timespec c0, c1;
+    uint64_t start;
+    uint64_t got;
+    long sent;
+    int rcvbuf = 4 << 20;
+    int i;
 
-            pthread_mutex_lock(&g_line_mtx);
-            memcpy(g_latest_text, buf, copy_len);
-            g_latest_text[copy_len] = '\0';
-            pthread_mutex_unlock(&g_line_mtx);
+    reset_clients(sh);
+    sh->stop = 0;
+    sh->packets = 0;
+    sh->syscalls = 0;
+    sh->uring = 0;
+    g_recv_uring = uring;
+
+    sh->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    setsockopt(sh->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sh->sock < 0 || bind(sh->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(sh->sock, (struct sockaddr *)&addr, &addr_len) != 0) {
+        perror("bench socket");
+        return;
+    }
+    for (i = 0; i < RECV_BENCH_SENDERS; i++) tx[i] = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memset(pkt, 0, sizeof(pkt));
+    tlv.type = TLV_CPU_CORES;
+    tlv.len = sizeof(cores);
+    for (i = 0; i < 4; i++) {
+        cores[i].busy = (uint16_t)(1000 * i);
+        cores[i].mhz = 1500;
+    }
+    memcpy(pkt + sizeof(TelemetryPacket), &tlv, sizeof(tlv));
+    memcpy(pkt + sizeof(TelemetryPacket) + sizeof(tlv), cores, sizeof(cores));
+
+    pthread_create(&thr, NULL, udp_receiver, sh);
+    pthread_getcpuclockid(thr, &cpu_clock);
+    usleep(100000);     /* let the receive loop settle */
+    clock_gettime(cpu_clock, &c0);
+    start = (uint64_t)time(NULL);
+
+    for (sent = 0; sent < count; sent++) {
+        TelemetryPacket hdr;
+        int k = (int)(sent % RECV_BENCH_SENDERS);
+
+        memset(&hdr, 0, sizeof(hdr));
+        snprintf(hdr.client_id, sizeof(hdr.client_id), "bench%02d", k);
+        hdr.cpu_load = (float)(sent % 100);
+        hdr.cpu_temp = 50.0f;
+        hdr.cpu_mhz = 1500.0f;
+        hdr.timestamp = start + (uint64_t)sent;
+        memcpy(pkt, &hdr, sizeof(hdr));
+        while ((uint64_t)sent - __atomic_load_n(&sh->packets, __ATOMIC_RELAXED) > 1024) {
+            sched_yield();
         }
-
-        notify_main_thread();
+        sendto(tx[k], pkt, sizeof(pkt), 0, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    /* Whatever is still queued, or lost */
+    for (i = 0; i < 100 && __atomic_load_n(&sh->packets, __ATOMIC_RELAXED) < (uint64_t)count; i++) {
+        usleep(10000);
     }
+    clock_gettime(cpu_clock, &c1);
+    got = __atomic_load_n(&sh->packets, __ATOMIC_RELAXED);
 
-    close(sock);
-    return NULL;
+    printf("%-10s %10llu %12.0f %16.3f\n", sh->uring ? "io_uring" : "recvfrom",
+           (unsigned long long)got,
+           got ? ((c1.tv_sec - c0.tv_sec) * 1e9 + (c1.tv_nsec - c0.tv_nsec)) / (double)got : 0.0,
+           got ? (double)sh->syscalls / (double)got : 0.0);
+
+    /* Wake the loop so it sees the stop flag */
+    sh->stop = 1;
+    sendto(tx[0], "", 0, 0, (struct sockaddr *)&addr, sizeof(addr));
+    pthread_join(thr, NULL);
+    for (i = 0; i < RECV_BENCH_SENDERS; i++) close(tx[i]);
+    close(sh->sock);
+}
+
+static int run_recv_bench(long count)
+{
+    if (count < 1000) count = 1000;
+    g_flood_src_pps = 0;    /* the senders are one loopback source */
+    g_flood_id_pps = 0;
+    printf("%-10s %10s %12s %16s\n", "backend", "packets", "cpu ns/pkt", "syscalls/pkt");
+    bench_backend(0, count);
+    bench_backend(1, count);
+#ifndef HAVE_URING_RECV
+    printf("io_uring receive not built in (kernel headers older than 6.0)\n");
+#endif
+    return 0;
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
     Display *dpy;
     Window win;
@@ -760,13 +4176,22 @@ int main(void)
     GC gc;
     XFontStruct *font_info = NULL;
     int line_height = 18;
-    pthread_t thr;
     int notify_pipe[2] = { -1, -1 };
     Atom wm_delete_window;
     Atom atom_clipboard;
     Atom atom_targets;
     Atom atom_utf8;
     XSizeHints size_hints;
+    const char *relay;
+    const char *replay = NULL;
+
+    if (argc > 1 && strcmp(argv[1], "--bench-recv") == 0) {
+        return run_recv_bench(argc > 2 ? atol(argv[2]) : RECV_BENCH_DEFAULT);
+    }
+    if (argc > 2 && strcmp(argv[1], "--replay-fast") == 0) return run_replay_fast(argv[2]);
+    if (argc > 2 && strcmp(argv[1], "--replay") == 0) replay = argv[2];
+    relay = getenv("PIMON_RELAY");
+    if (relay && relay[0]) return run_relay(relay);
 
     load_preferences();
     DBG_PRINT("Starting X health monitor server...\n");
@@ -851,8 +4276,7 @@ int main(void)
 
     DBG_PRINT("Window mapped and visible.\n");
 
-    if (pthread_create(&thr, NULL, udp_receiver, NULL) != 0) {
-        perror("pthread_create");
+    if ((replay ? start_replay(replay) : start_receivers()) == 0) {
         close(notify_pipe[0]);
         close(notify_pipe[1]);
         XDestroyWindow(dpy, win);
@@ -860,7 +4284,7 @@ int main(void)
         return 1;
     }
 
-    DBG_PRINT("Receiver thread started.\n");
+    DBG_PRINT("%d receiver thread(s) started.\n", g_shard_count);
     redraw_window(dpy, win, gc, line_height);
 
     while (1) {
@@ -892,6 +4316,7 @@ int main(void)
 
         if (FD_ISSET(notify_pipe[0], &rfds)) {
             char drain[64];
+            __atomic_store_n(&g_notify_pending, 0, __ATOMIC_RELEASE);
             while (read(notify_pipe[0], drain, sizeof(drain)) > 0) {
                 /* drain bytes */
             }
@@ -969,12 +4394,12 @@ int main(void)
                         g_menu_hover = -1;
                         handle_menu_action(dpy, win, gc, line_height, item,
                                            atom_clipboard, screen, wm_delete_window);
-                    } else {
-                        if (g_menu_open) {
-                            g_menu_open = 0;
-                            g_menu_hover = -1;
-                            redraw_window(dpy, win, gc, line_height);
-                        }
+                    } else if (g_menu_open) {
+                        g_menu_open = 0;
+                        g_menu_hover = -1;
+                        redraw_window(dpy, win, gc, line_height);
+                    } else if (heat_hit(x, y)) {
+                        redraw_window(dpy, win, gc, line_height);
                     }
                 } else if (ev.type == ClientMessage) {
                     if ((Atom)ev.xclient.data.l[0] == wm_delete_window) {
@@ -986,6 +4411,12 @@ int main(void)
                     int n = XLookupString(&ev.xkey, keybuf, (int)sizeof(keybuf), &keysym, NULL);
                     if (n > 0 && (keybuf[0] == 'q' || keybuf[0] == 'Q')) {
                         goto done;
+                    } else if (n > 0 && keybuf[0] == 'h') {
+                        handle_menu_action(dpy, win, gc, line_height, MENU_HEATMAP,
+                                           atom_clipboard, screen, wm_delete_window);
+                    } else if (n > 0 && keybuf[0] == 'm') {
+                        handle_menu_action(dpy, win, gc, line_height, MENU_HEAT_METRIC,
+                                           atom_clipboard, screen, wm_delete_window);
                     }
                 }
             }
@@ -1008,11 +4439,11 @@ done:
     if (font_info) {
         XFreeFont(dpy, font_info);
     }
+    heat_image_free(dpy);
     XDestroyWindow(dpy, win);
     XCloseDisplay(dpy);
 
-    pthread_cancel(thr);
-    pthread_join(thr, NULL);
+    stop_receivers();
     pthread_mutex_destroy(&g_line_mtx);
     return 0;
 }